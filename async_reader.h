@@ -0,0 +1,267 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define RAW_HAVE_COROUTINES
+#endif
+
+#include "header.h"
+#include "reader.h"
+#include "thread_pool.h"
+
+/*
+  Reading many files from one event-loop thread.
+
+  An AsyncEngine runs blocking reads on a small, fixed pool of I/O threads and
+  hands each result back to the thread that drives the engine, through a
+  completion queue. The engine's eventfd becomes readable when completions are
+  waiting, so it can be added to an existing epoll or poll loop, which then
+  calls engine.poll(). Programs without their own loop can call engine.run().
+
+  Each AsyncReader wraps a Reader and a single block buffer, and has at most one
+  read in flight, so memory is bounded by one block per open file no matter how
+  many files there are. Callbacks and coroutine resumptions always happen on the
+  engine's thread, inside poll or run.
+
+  With callbacks, which work in C++14:
+
+    raw::AsyncEngine engine;
+    raw::AsyncReader reader(engine, filename);
+    std::function<void(const raw::AsyncBlock*)> handle = [&](const raw::AsyncBlock* block) {
+      if (block) {
+        handleData(block->header, block->data);
+        reader.nextBlock(handle);
+      }
+    };
+    reader.nextBlock(handle);
+    engine.run();
+
+  With C++20 coroutines, inside a coroutine that runs on the engine's thread:
+
+    while (const raw::AsyncBlock* block = co_await reader.nextBlock()) {
+      handleData(block->header, block->data);
+    }
+*/
+
+namespace raw {
+
+  // Frees what makeAligned allocates.
+  template<typename T>
+  struct AlignedDelete {
+    void operator()(T* p) const {
+      p->~T();
+      free(p);
+    }
+  };
+
+  // Allocates a T with its full alignment. Header is aligned to 512 bytes, which
+  // plain new doesn't respect before C++17.
+  template<typename T>
+  std::unique_ptr<T, AlignedDelete<T> > makeAligned() {
+    void* p = nullptr;
+    size_t alignment = alignof(T) < sizeof(void*) ? sizeof(void*) : alignof(T);
+    if (posix_memalign(&p, alignment, sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return std::unique_ptr<T, AlignedDelete<T> >(new (p) T());
+  }
+
+  /*
+    Runs blocking work on I/O threads and completions on the caller's thread.
+  */
+  class AsyncEngine {
+  private:
+    // Held by pointer so the destructor can finish the I/O threads' work first.
+    std::unique_ptr<ThreadPool> pool;
+
+    // Signals that completions are waiting. Nonblocking.
+    int event_fd;
+
+    std::mutex mutex;
+    std::deque<std::function<void()> > completions;
+
+    // Work that has been submitted but whose completion hasn't run yet.
+    // Only touched on the engine's thread.
+    int outstanding = 0;
+
+  public:
+    explicit AsyncEngine(int num_threads = 4) : pool(new ThreadPool(num_threads)) {
+      event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    AsyncEngine(const AsyncEngine&) = delete;
+    AsyncEngine& operator=(AsyncEngine&) = delete;
+
+    ~AsyncEngine() {
+      pool.reset();
+      if (event_fd >= 0) {
+        close(event_fd);
+      }
+    }
+
+    // A descriptor that is readable when poll has completions to run.
+    int fd() const {
+      return event_fd;
+    }
+
+    // How many submitted operations haven't completed yet.
+    int pending() const {
+      return outstanding;
+    }
+
+    // Runs work on an I/O thread, and then done on the engine's thread.
+    // Must be called from the engine's thread.
+    void submit(std::function<void()> work, std::function<void()> done) {
+      ++outstanding;
+      pool->submit([this, work, done]() {
+        work();
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          completions.push_back(done);
+        }
+        uint64_t one = 1;
+        ssize_t n = write(event_fd, &one, sizeof(one));
+        (void) n;
+      });
+    }
+
+    // Runs the completions that are ready, without blocking.
+    // Returns how many ran.
+    int poll() {
+      uint64_t count;
+      ssize_t n = read(event_fd, &count, sizeof(count));
+      (void) n;
+      std::deque<std::function<void()> > ready;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(completions);
+      }
+      for (auto& done : ready) {
+        --outstanding;
+        done();
+      }
+      return ready.size();
+    }
+
+    // Runs completions, waiting for them as needed, until nothing is pending.
+    void run() {
+      while (outstanding > 0) {
+        struct pollfd pfd;
+        pfd.fd = event_fd;
+        pfd.events = POLLIN;
+        ::poll(&pfd, 1, -1);
+        poll();
+      }
+    }
+  };
+
+  // A block read by an AsyncReader.
+  struct AsyncBlock {
+    Header header;
+    std::vector<char> data;
+  };
+
+  /*
+    Reads a file block by block through an AsyncEngine.
+
+    The reader must not be destroyed while a nextBlock is in flight.
+  */
+  class AsyncReader {
+  private:
+    AsyncEngine& engine;
+    Reader reader;
+    std::unique_ptr<AsyncBlock, AlignedDelete<AsyncBlock> > block;
+    bool busy = false;
+
+    // Set by the I/O thread. Read on the engine's thread after the completion.
+    bool block_ok = false;
+
+  public:
+    AsyncReader(AsyncEngine& engine, const std::string& filename)
+      : engine(engine), reader(filename), block(makeAligned<AsyncBlock>()) {}
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(AsyncReader&) = delete;
+
+    // Whether we have run into an error
+    bool error() {
+      return reader.error();
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return reader.errorMessage();
+    }
+
+    const std::string& filename() const {
+      return reader.filename;
+    }
+
+    // Checks each block against its DATACRC card. See Reader::verifyChecksums.
+    void verifyChecksums(bool on) {
+      reader.verifyChecksums(on);
+    }
+
+    // Reads the next header and data block on an I/O thread, then calls done on the
+    // engine's thread with the block, or with nullptr at the end of the file or on
+    // an error. Check error() to tell which.
+    // The block is valid until the next call to nextBlock.
+    // Only one nextBlock can be in flight at a time.
+    void nextBlock(std::function<void(const AsyncBlock*)> done) {
+      assert(!busy);
+      busy = true;
+      engine.submit([this]() {
+        block_ok = reader.readHeader(&block->header);
+        if (block_ok) {
+          block->data.resize(block->header.blocsize);
+          block_ok = reader.readData(block->data.data());
+        }
+      }, [this, done]() {
+        busy = false;
+        done(block_ok ? block.get() : nullptr);
+      });
+    }
+
+#ifdef RAW_HAVE_COROUTINES
+    // What co_await reader.nextBlock() waits on.
+    struct NextBlockAwaiter {
+      AsyncReader* reader;
+      const AsyncBlock* result = nullptr;
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        reader->nextBlock([this, handle](const AsyncBlock* block) {
+          result = block;
+          handle.resume();
+        });
+      }
+
+      const AsyncBlock* await_resume() const noexcept {
+        return result;
+      }
+    };
+
+    // The coroutine version of nextBlock. co_await gives the block, or nullptr at
+    // the end of the file or on an error.
+    NextBlockAwaiter nextBlock() {
+      return NextBlockAwaiter{this};
+    }
+#endif
+  };
+}
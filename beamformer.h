@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <complex>
+#include <stdint.h>
+#include <vector>
+
+#include "header.h"
+#include "thread_pool.h"
+
+/*
+  Beamforming across the antenna axis.
+
+  The input is a block in the data[antenna][channel][time][pol] layout described
+  in header.h. The output of readBand has the same layout with fewer channels, so
+  it works as input too, by passing the band's channel count.
+
+  The inner loops convert each antenna's int8 row to floats once and then run a
+  plain multiply-accumulate over separate real and imaginary arrays, which the
+  compiler vectorizes. Build with RAW_NATIVE to let it use AVX2 or AVX-512.
+*/
+
+namespace raw {
+
+  // Converts one row of complex int8 into separate float arrays.
+  inline void rowToFloat(const int8_t* row, size_t size, float* re, float* im) {
+    for (size_t i = 0; i < size; ++i) {
+      re[i] = row[2 * i];
+      im[i] = row[2 * i + 1];
+    }
+  }
+
+  /*
+    Forms coherent beams: for each beam, the weighted complex sum over antennas.
+
+    weights is indexed [beam][antenna][channel], and the same weight is applied to
+    every polarization.
+    output is indexed [beam][channel][time][pol].
+    Channels are processed in parallel on the pool, if one is provided.
+  */
+  inline void formCoherentBeams(const BlockShape& shape, const char* data,
+                                const std::complex<float>* weights, int num_beams,
+                                std::complex<float>* output, ThreadPool* pool = nullptr) {
+    size_t row_size = shape.rowSize();
+    forRanges(pool, shape.num_channels, [&](int first, int last) {
+      std::vector<float> x_re(row_size);
+      std::vector<float> x_im(row_size);
+      std::vector<float> acc_re(num_beams * row_size);
+      std::vector<float> acc_im(num_beams * row_size);
+
+      for (int channel = first; channel < last; ++channel) {
+        std::fill(acc_re.begin(), acc_re.end(), 0.0f);
+        std::fill(acc_im.begin(), acc_im.end(), 0.0f);
+
+        for (int antenna = 0; antenna < shape.nants; ++antenna) {
+          const int8_t* row = (const int8_t*) data +
+            ((size_t) antenna * shape.num_channels + channel) * row_size * 2;
+          rowToFloat(row, row_size, x_re.data(), x_im.data());
+          const float* xr = x_re.data();
+          const float* xi = x_im.data();
+
+          for (int beam = 0; beam < num_beams; ++beam) {
+            std::complex<float> w =
+              weights[((size_t) beam * shape.nants + antenna) * shape.num_channels + channel];
+            float wr = w.real();
+            float wi = w.imag();
+            float* __restrict__ ar = acc_re.data() + beam * row_size;
+            float* __restrict__ ai = acc_im.data() + beam * row_size;
+            for (size_t i = 0; i < row_size; ++i) {
+              ar[i] += wr * xr[i] - wi * xi[i];
+              ai[i] += wr * xi[i] + wi * xr[i];
+            }
+          }
+        }
+
+        for (int beam = 0; beam < num_beams; ++beam) {
+          std::complex<float>* out = output +
+            ((size_t) beam * shape.num_channels + channel) * row_size;
+          const float* ar = acc_re.data() + beam * row_size;
+          const float* ai = acc_im.data() + beam * row_size;
+          for (size_t i = 0; i < row_size; ++i) {
+            out[i] = std::complex<float>(ar[i], ai[i]);
+          }
+        }
+      }
+    });
+  }
+
+  inline void formCoherentBeams(const Header& header, const char* data,
+                                const std::complex<float>* weights, int num_beams,
+                                std::complex<float>* output, ThreadPool* pool = nullptr) {
+    formCoherentBeams(BlockShape(header), data, weights, num_beams, output, pool);
+  }
+
+  /*
+    Forms an incoherent beam: the power re^2 + im^2, summed over antennas.
+
+    output is indexed [channel][time][pol].
+    Channels are processed in parallel on the pool, if one is provided.
+  */
+  inline void formIncoherentBeam(const BlockShape& shape, const char* data, float* output,
+                                 ThreadPool* pool = nullptr) {
+    size_t row_size = shape.rowSize();
+    forRanges(pool, shape.num_channels, [&](int first, int last) {
+      for (int channel = first; channel < last; ++channel) {
+        float* __restrict__ out = output + (size_t) channel * row_size;
+        std::fill(out, out + row_size, 0.0f);
+        for (int antenna = 0; antenna < shape.nants; ++antenna) {
+          const int8_t* row = (const int8_t*) data +
+            ((size_t) antenna * shape.num_channels + channel) * row_size * 2;
+          for (size_t i = 0; i < row_size; ++i) {
+            int re = row[2 * i];
+            int im = row[2 * i + 1];
+            out[i] += (float) (re * re + im * im);
+          }
+        }
+      }
+    });
+  }
+
+  inline void formIncoherentBeam(const Header& header, const char* data, float* output,
+                                 ThreadPool* pool = nullptr) {
+    formIncoherentBeam(BlockShape(header), data, output, pool);
+  }
+}
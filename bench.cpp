@@ -0,0 +1,575 @@
+#include <chrono>
+#include <complex>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string.h>
+#include <vector>
+
+#include "raw.h"
+
+using namespace std;
+
+// Benchmarks the library against a synthetic file, so it runs on any Linux box.
+// Prints a single JSON line with every measurement, which run_bench.sh appends to
+// bench_output.txt to track performance across commits.
+
+struct BenchOptions {
+  string dir = "/tmp";
+  string label = "";
+  int blocks = 16;
+
+  // Whether to evict the file from the page cache before each I/O benchmark.
+  bool cold = false;
+};
+
+// The measurements, in the order they were made.
+vector<pair<string, double> > results;
+
+void record(const string& name, double value) {
+  cerr << name << ": " << value << endl;
+  results.push_back(make_pair(name, value));
+}
+
+// Runs f and returns how many seconds it took.
+double timeIt(const function<void()>& f) {
+  auto start = chrono::steady_clock::now();
+  f();
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+void dropCache(const BenchOptions& options, const string& filename) {
+  if (!options.cold) {
+    return;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+void benchHeaderScan(const BenchOptions& options, const string& filename) {
+  dropCache(options, filename);
+  int headers = 0;
+  double secs = timeIt([&]() {
+    raw::Reader reader(filename);
+    raw::Header header;
+    while (reader.readHeader(&header)) {
+      ++headers;
+    }
+  });
+  record("header_scan_headers_per_sec", headers / secs);
+}
+
+void benchReadData(const BenchOptions& options, const string& filename) {
+  dropCache(options, filename);
+  size_t bytes = 0;
+  double secs = timeIt([&]() {
+    raw::Reader reader(filename);
+    raw::Header header;
+    vector<char> data;
+    while (reader.readHeader(&header)) {
+      data.resize(header.blocsize);
+      reader.readData(data.data());
+      bytes += header.blocsize;
+    }
+  });
+  record("read_data_mb_per_sec", bytes / secs / 1e6);
+}
+
+// readData with the scan cache policy. It drops the file from the page cache
+// as it goes, so it runs after the other benchmarks that read the file.
+void benchScanPolicy(const BenchOptions& options, const string& filename) {
+  dropCache(options, filename);
+  size_t bytes = 0;
+  double secs = timeIt([&]() {
+    raw::Reader reader(filename);
+    reader.cachePolicy(raw::CachePolicy::scan());
+    raw::Header header;
+    vector<char> data;
+    while (reader.readHeader(&header)) {
+      data.resize(header.blocsize);
+      reader.readData(data.data());
+      bytes += header.blocsize;
+    }
+  });
+  record("scan_policy_read_mb_per_sec", bytes / secs / 1e6);
+}
+
+void benchReadBand(const BenchOptions& options, const string& filename) {
+  dropCache(options, filename);
+  const int num_bands = 8;
+  size_t bytes = 0;
+  double secs = timeIt([&]() {
+    raw::Reader reader(filename);
+    raw::Header header;
+    vector<char> data;
+    while (reader.readHeader(&header)) {
+      data.resize(header.blocsize / num_bands);
+      for (int band = 0; band < num_bands; ++band) {
+        reader.readBand(header, band, num_bands, data.data());
+        bytes += data.size();
+      }
+    }
+  });
+  record("read_band_mb_per_sec", bytes / secs / 1e6);
+}
+
+void benchTimeRange(const BenchOptions& options, const string& filename) {
+  dropCache(options, filename);
+  size_t bytes = 0;
+  double secs = timeIt([&]() {
+    raw::Reader reader(filename);
+    raw::Header header;
+    if (!reader.readHeader(&header)) {
+      return;
+    }
+    // Four channels over the whole file, in ranges that start and end mid-block
+    raw::TimeSeries series;
+    double start = header.getStartTime() + header.tbin * header.num_timesteps / 2;
+    for (int i = 0; i < 4; ++i) {
+      double end = start + 3 * header.tbin * header.num_timesteps;
+      reader.readTimeRange(0, 8, 12, start, end, &series);
+      bytes += series.data.size();
+      start = end;
+    }
+  });
+  record("time_range_mb_per_sec", bytes / secs / 1e6);
+}
+
+void benchOverlapReader(const BenchOptions& options, const string& filename) {
+  dropCache(options, filename);
+  size_t bytes = 0;
+  double secs = timeIt([&]() {
+    raw::OverlapReader reader(filename, 255);
+    while (reader.next()) {
+      bytes += reader.header().blocsize;
+    }
+  });
+  record("overlap_read_mb_per_sec", bytes / secs / 1e6);
+}
+
+// Rereads bands through a cache, as an interactive viewer would, once the first
+// pass has filled it.
+void benchBlockCache(const string& filename) {
+  raw::BlockCache cache(size_t(1) << 30);
+  raw::Reader reader(filename);
+  reader.useCache(&cache);
+  vector<unique_ptr<raw::Header, raw::AlignedDelete<raw::Header> > > headers;
+  headers.push_back(raw::makeAligned<raw::Header>());
+  while (headers.size() <= 16 && reader.readHeader(headers.back().get())) {
+    headers.push_back(raw::makeAligned<raw::Header>());
+  }
+  headers.pop_back();
+  const int num_bands = 8;
+  raw::PinnedBlock band;
+  auto readAll = [&]() {
+    for (auto& h : headers) {
+      for (int b = 0; b < num_bands; ++b) {
+        reader.readBand(*h, b, num_bands, &band);
+      }
+    }
+  };
+  readAll();
+  double secs = timeIt(readAll);
+  if (!headers.empty()) {
+    record("block_cache_hit_us", secs * 1e6 / (headers.size() * num_bands));
+  }
+}
+
+void benchParse(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  const int iterations = 20000;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      raw::rawspec_raw_parse_header(&header);
+    }
+  });
+  record("parse_ns_per_header", secs * 1e9 / iterations);
+}
+
+// Reads every band of every block with one thread per NUMA node.
+// "local" keeps each node's destination memory on that node; "remote" puts it on
+// the next node over, which is what happens without any placement.
+// On a single-node machine the two are the same.
+void benchNuma(const BenchOptions& options, const string& filename) {
+  int num_nodes = raw::numa::numNodes();
+  for (int remote = 0; remote < 2; ++remote) {
+    dropCache(options, filename);
+    raw::Reader reader(filename);
+    raw::Header header;
+    size_t bytes = 0;
+    double secs = 0;
+    while (reader.readHeader(&header)) {
+      size_t size = header.blocsize;
+      raw::numa::NodeBuffer buffer(size, raw::numa::nodeId(remote));
+      vector<vector<function<bool()> > > tasks;
+      reader.readBandTasksByNode(header, 0, 1, buffer.data(), num_nodes, &tasks);
+      if (remote) {
+        // Undo the placement that readBandTasksByNode did
+        raw::numa::placeOnNode(buffer.data(), size, raw::numa::nodeId(1));
+      }
+      secs += timeIt([&]() {
+        raw::numa::runOnNodes(tasks);
+      });
+      bytes += size;
+    }
+    record(remote ? "numa_remote_mb_per_sec" : "numa_local_mb_per_sec", bytes / secs / 1e6);
+  }
+  record("numa_nodes", num_nodes);
+}
+
+void benchBlockStats(const BenchOptions& options, const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  vector<raw::ChannelStats> stats;
+  const int iterations = 20;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      raw::computeBlockStats(header, data.data(), &stats);
+    }
+  });
+  record("block_stats_mb_per_sec", iterations * header.blocsize / secs / 1e6);
+
+  dropCache(options, filename);
+  raw::QuickLook ql;
+  size_t bytes = 0;
+  secs = timeIt([&]() {
+    raw::quicklook(filename, &ql);
+  });
+  bytes = (size_t) ql.num_blocks * header.blocsize;
+  record("quicklook_mb_per_sec", bytes / secs / 1e6);
+}
+
+// Forms beams from one block, counting every output sample of every beam.
+void benchBeamformer(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  raw::BlockShape shape(header);
+  size_t samples = (size_t) shape.num_channels * shape.rowSize();
+
+  const int num_beams = 16;
+  vector<complex<float> > weights(num_beams * shape.nants * shape.num_channels,
+                                  complex<float>(0.5, -0.5));
+  vector<complex<float> > beams(num_beams * samples);
+  raw::ThreadPool pool;
+  const int iterations = 5;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      raw::formCoherentBeams(shape, data.data(), weights.data(), num_beams, beams.data(), &pool);
+    }
+  });
+  record("coherent_beam_samples_per_sec", iterations * num_beams * samples / secs);
+
+  vector<float> power(samples);
+  secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      raw::formIncoherentBeam(shape, data.data(), power.data(), &pool);
+    }
+  });
+  record("incoherent_beam_samples_per_sec", iterations * samples / secs);
+}
+
+void benchDecimator(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  raw::ThreadPool pool;
+  raw::Decimator decimator(64, raw::DecimateMode::POWER, true, &pool);
+  vector<float> output;
+  const int iterations = 20;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      decimator.process(header, data.data(), &output);
+    }
+  });
+  record("decimate_power_mb_per_sec", iterations * header.blocsize / secs / 1e6);
+}
+
+void benchRFI(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  raw::ThreadPool pool;
+  raw::RFIFlagger flagger(256, 4.0, raw::Excision::ZERO, &pool);
+  const int iterations = 20;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      flagger.process(header, data.data());
+    }
+  });
+  record("rfi_flag_mb_per_sec", iterations * header.blocsize / secs / 1e6);
+}
+
+void benchRequantizer() {
+  raw::BlockShape shape(1, 64, 8192, 2);
+  vector<float> input(shape.num_channels * shape.rowSize() * 2);
+  for (size_t i = 0; i < input.size(); ++i) {
+    input[i] = (float) ((i * 2654435761u) % 1000) / 10 - 50;
+  }
+  raw::ThreadPool pool;
+  for (int nbits : {8, 4}) {
+    raw::Requantizer requantizer(nbits, 0, &pool);
+    vector<char> output(requantizer.outputSize(shape));
+    const int iterations = 20;
+    double secs = timeIt([&]() {
+      for (int i = 0; i < iterations; ++i) {
+        requantizer.process(shape, input.data(), output.data());
+      }
+    });
+    record("requantize_" + to_string(nbits) + "bit_input_mb_per_sec",
+           iterations * input.size() * sizeof(float) / secs / 1e6);
+  }
+}
+
+void benchChecksum(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  const int iterations = 20;
+  uint32_t crc = 0;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      crc ^= raw::crc32c(data.data(), data.size());
+    }
+  });
+  record("crc32c_mb_per_sec", iterations * header.blocsize / secs / 1e6);
+  if (crc == 1) {
+    cerr << "unlikely checksum" << endl;
+  }
+}
+
+// Sums power per channel and pol, with npol only known at runtime.
+void powerRuntime(const raw::BlockShape& shape, const char* data, float* out) {
+  for (int a = 0; a < shape.nants; ++a) {
+    for (int c = 0; c < shape.num_channels; ++c) {
+      const int8_t* row = (const int8_t*) data +
+        ((size_t) a * shape.num_channels + c) * shape.rowSize() * 2;
+      int32_t sums[4] = {};
+      for (int t = 0; t < shape.num_timesteps; ++t) {
+        for (int p = 0; p < shape.npol; ++p) {
+          int re = row[(t * shape.npol + p) * 2];
+          int im = row[(t * shape.npol + p) * 2 + 1];
+          sums[p] += re * re + im * im;
+        }
+      }
+      for (int p = 0; p < shape.npol; ++p) {
+        out[c * shape.npol + p] += sums[p];
+      }
+    }
+  }
+}
+
+// The same as powerRuntime, written against a compile-time layout.
+template<typename Layout>
+void powerLayout(const Layout& layout, const char* data, float* out) {
+  for (int a = 0; a < layout.nants; ++a) {
+    for (int c = 0; c < layout.num_channels; ++c) {
+      const int8_t* row = layout.row(data, a, c);
+      int32_t sums[Layout::npol] = {};
+      for (int t = 0; t < layout.num_timesteps; ++t) {
+        for (int p = 0; p < Layout::npol; ++p) {
+          int re = row[t * Layout::timestep_bytes + p * Layout::sample_bytes];
+          int im = row[t * Layout::timestep_bytes + p * Layout::sample_bytes + 1];
+          sums[p] += re * re + im * im;
+        }
+      }
+      for (int p = 0; p < Layout::npol; ++p) {
+        out[c * Layout::npol + p] += sums[p];
+      }
+    }
+  }
+}
+
+void benchLayout(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  raw::BlockShape shape(header);
+  vector<float> out(shape.num_channels * shape.npol);
+  const int iterations = 20;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      powerRuntime(shape, data.data(), out.data());
+    }
+  });
+  record("power_runtime_strides_mb_per_sec", iterations * header.blocsize / secs / 1e6);
+
+  secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      raw::withLayout(header, [&](auto layout) {
+        powerLayout(layout, data.data(), out.data());
+      });
+    }
+  });
+  record("power_layout_mb_per_sec", iterations * header.blocsize / secs / 1e6);
+}
+
+// Queries an in-memory catalog the size of a large observing session.
+void benchCatalog() {
+  raw::Catalog catalog;
+  const int num_files = 10000;
+  for (int i = 0; i < num_files; ++i) {
+    raw::CatalogEntry e;
+    e.filename = "session/file" + to_string(i) + ".0000.raw";
+    e.src_name = "SOURCE" + to_string(i % 50);
+    e.telescop = "GBT";
+    e.obsfreq = 1000 + (i % 8) * 500;
+    e.obsbw = 187.5;
+    e.start_time = 1652363000 + i * 60;
+    e.end_time = e.start_time + 60;
+    catalog.add(e);
+  }
+  raw::CatalogQuery query;
+  query.src_name = "SOURCE7";
+  query.frequency = 2510;
+  query.start_time = 1652363000 + 1000 * 60;
+  query.end_time = 1652363000 + 9000 * 60;
+  const int iterations = 1000;
+  size_t matches = 0;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      matches += catalog.query(query).size();
+    }
+  });
+  record("catalog_query_us", secs * 1e6 / iterations);
+  if (matches == 0) {
+    cerr << "catalog query found nothing" << endl;
+  }
+}
+
+// Reads several streams together, which the MultiStreamReader does concurrently.
+void benchMultiStream(const BenchOptions& options, const string& filename) {
+  const int num_streams = 4;
+  dropCache(options, filename);
+  vector<string> filenames(num_streams, filename);
+  size_t bytes = 0;
+  double secs = timeIt([&]() {
+    raw::MultiStreamReader reader(filenames);
+    vector<const raw::AsyncBlock*> blocks;
+    while (reader.next(&blocks)) {
+      for (auto block : blocks) {
+        bytes += block->data.size();
+      }
+    }
+  });
+  record("multi_stream_mb_per_sec", bytes / secs / 1e6);
+}
+
+// Correlates one block, counting every baseline of every channel at every timestep.
+void benchCorrelator(const string& filename) {
+  raw::Reader reader(filename);
+  raw::Header header;
+  if (!reader.readHeader(&header)) {
+    return;
+  }
+  vector<char> data(header.blocsize);
+  reader.readData(data.data());
+  raw::ThreadPool pool;
+  raw::Correlator correlator(&pool);
+  const int iterations = 5;
+  double secs = timeIt([&]() {
+    for (int i = 0; i < iterations; ++i) {
+      correlator.add(header, data.data());
+    }
+  });
+  double baseline_channels = (double) raw::Correlator::numBaselines(header.nants) *
+    header.num_channels;
+  record("correlator_baseline_channel_samples_per_sec",
+         iterations * baseline_channels * header.num_timesteps / secs);
+}
+
+int main(int argc, char* argv[]) {
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    if (arg == "--cold") {
+      options.cold = true;
+    } else if (arg == "--dir" && i + 1 < argc) {
+      options.dir = argv[++i];
+    } else if (arg == "--label" && i + 1 < argc) {
+      options.label = argv[++i];
+    } else if (arg == "--blocks" && i + 1 < argc) {
+      options.blocks = atoi(argv[++i]);
+    } else {
+      cerr << "usage: bench [--dir DIR] [--label LABEL] [--blocks N] [--cold]\n";
+      exit(1);
+    }
+  }
+
+  raw::SyntheticOptions synthetic;
+  synthetic.nants = 4;
+  synthetic.obsnchan = 64;
+  synthetic.blocsize = synthetic.bytesPerTimestep() * 16384;
+  synthetic.num_blocks = options.blocks;
+  synthetic.gap_every = 7;
+  string filename = options.dir + "/raw_bench_" + to_string(getpid()) + ".0000.raw";
+  string error_message;
+  if (!raw::writeSyntheticFile(filename, synthetic, &error_message)) {
+    cerr << "error: " << error_message << endl;
+    exit(1);
+  }
+
+  benchHeaderScan(options, filename);
+  benchReadData(options, filename);
+  benchReadBand(options, filename);
+  benchTimeRange(options, filename);
+  benchOverlapReader(options, filename);
+  benchBlockCache(filename);
+  benchParse(filename);
+  benchNuma(options, filename);
+  benchMultiStream(options, filename);
+  benchBlockStats(options, filename);
+  benchBeamformer(filename);
+  benchCorrelator(filename);
+  benchDecimator(filename);
+  benchRFI(filename);
+  benchRequantizer();
+  benchChecksum(filename);
+  benchLayout(filename);
+  benchCatalog();
+  benchScanPolicy(options, filename);
+  unlink(filename.c_str());
+
+  stringstream ss;
+  ss << "{\"label\": \"" << options.label << "\", \"time\": " << time(NULL)
+     << ", \"cold\": " << (options.cold ? "true" : "false");
+  for (auto& result : results) {
+    ss << ", \"" << result.first << "\": " << result.second;
+  }
+  ss << "}";
+  cout << ss.str() << endl;
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+  A size-bounded cache of block data shared between readers and threads, for
+  interactive tools that read the same blocks and bands over and over.
+
+  A Reader uses it for readBand once it's given one:
+
+    raw::BlockCache cache(1 << 30);
+    raw::Reader reader(filename);
+    reader.useCache(&cache);
+    ...
+    raw::PinnedBlock band;
+    reader.readBand(header, 2, 8, &band);  // no copy when it's already cached
+
+  Entries are kept in least-recently-used order and evicted once the cache is
+  over capacity, except while they're pinned by a PinnedBlock. The cache is
+  split into shards, each with its own lock, so threads reading different
+  blocks rarely contend. When several threads ask for the same missing block at
+  once, one reads it and the others wait for that read.
+*/
+
+namespace raw {
+
+  // What a cache entry holds: the bytes of one band of one block.
+  struct CacheKey {
+    std::string filename;
+    off_t data_offset;
+    int band;
+    int num_bands;
+
+    // Whether the channels were reversed by Reader::ascendingFrequency.
+    bool reversed;
+
+    bool operator==(const CacheKey& other) const {
+      return filename == other.filename && data_offset == other.data_offset &&
+        band == other.band && num_bands == other.num_bands && reversed == other.reversed;
+    }
+  };
+
+  struct CacheKeyHash {
+    size_t operator()(const CacheKey& key) const {
+      size_t h = std::hash<std::string>()(key.filename);
+      h = h * 31 + std::hash<long>()(key.data_offset);
+      h = h * 31 + key.band;
+      h = h * 31 + key.num_bands;
+      return h * 2 + key.reversed;
+    }
+  };
+
+  struct CacheEntry {
+    std::vector<char> data;
+
+    // How many PinnedBlocks hold this entry.
+    std::atomic<int> pins{0};
+
+    // Whether the first reader has finished loading the data, or failed to.
+    bool ready = false;
+    bool failed = false;
+  };
+
+  /*
+    Access to the data of a cache entry. The entry can't be evicted until the
+    PinnedBlock is unpinned or destroyed.
+  */
+  class PinnedBlock {
+  private:
+    std::shared_ptr<CacheEntry> entry;
+
+  public:
+    PinnedBlock() {}
+
+    // Takes over a pin that was already counted on the entry.
+    explicit PinnedBlock(std::shared_ptr<CacheEntry> entry) : entry(std::move(entry)) {}
+
+    PinnedBlock(const PinnedBlock&) = delete;
+    PinnedBlock& operator=(const PinnedBlock&) = delete;
+
+    PinnedBlock(PinnedBlock&& other) : entry(std::move(other.entry)) {}
+
+    PinnedBlock& operator=(PinnedBlock&& other) {
+      unpin();
+      entry = std::move(other.entry);
+      return *this;
+    }
+
+    ~PinnedBlock() {
+      unpin();
+    }
+
+    // Lets the entry be evicted. data() can't be used afterwards.
+    void unpin() {
+      if (entry != nullptr) {
+        --entry->pins;
+        entry.reset();
+      }
+    }
+
+    bool pinned() const {
+      return entry != nullptr;
+    }
+
+    const char* data() const {
+      return entry->data.data();
+    }
+
+    size_t size() const {
+      return entry->data.size();
+    }
+  };
+
+  class BlockCache {
+  private:
+    struct Shard {
+      std::mutex mutex;
+
+      // Signaled when an entry finishes loading or fails to.
+      std::condition_variable loaded;
+
+      // Most recently used at the front.
+      std::list<std::pair<CacheKey, std::shared_ptr<CacheEntry> > > lru;
+      std::unordered_map<CacheKey, decltype(lru.begin()), CacheKeyHash> index;
+      size_t bytes = 0;
+    };
+
+    size_t shard_capacity;
+    std::vector<std::unique_ptr<Shard> > shards;
+
+    std::atomic<int64_t> hit_count{0};
+    std::atomic<int64_t> miss_count{0};
+    std::atomic<int64_t> eviction_count{0};
+
+    Shard& shardFor(const CacheKey& key) {
+      return *shards[CacheKeyHash()(key) % shards.size()];
+    }
+
+    // Evicts unpinned entries from the back until the shard holds at most limit
+    // bytes, or nothing more can be evicted. Call with the shard locked.
+    void evictTo(Shard& shard, size_t limit) {
+      auto it = shard.lru.end();
+      while (shard.bytes > limit && it != shard.lru.begin()) {
+        --it;
+        CacheEntry& entry = *it->second;
+        if (!entry.ready || entry.pins > 0) {
+          continue;
+        }
+        shard.bytes -= entry.data.size();
+        shard.index.erase(it->first);
+        it = shard.lru.erase(it);
+        ++eviction_count;
+      }
+    }
+
+  public:
+    // capacity is in bytes, and is split evenly between the shards.
+    explicit BlockCache(size_t capacity, int num_shards = 16)
+      : shard_capacity(capacity / num_shards) {
+      for (int i = 0; i < num_shards; ++i) {
+        shards.emplace_back(new Shard());
+      }
+    }
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(BlockCache&) = delete;
+
+    /*
+      Pins the entry for key into out, calling load to fill in its size bytes
+      if it isn't cached yet.
+      Returns false if load does. Nothing is cached in that case, and any other
+      threads waiting on the same key fail too.
+
+      Pinned entries are never evicted, so if everything in a shard is pinned it
+      can go over its share of the capacity until they're unpinned.
+    */
+    bool get(const CacheKey& key, size_t size, const std::function<bool(char*)>& load,
+             PinnedBlock* out) {
+      Shard& shard = shardFor(key);
+      std::shared_ptr<CacheEntry> entry;
+      {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+          entry = found->second->second;
+          ++entry->pins;
+          shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+          shard.loaded.wait(lock, [&]() { return entry->ready || entry->failed; });
+          if (entry->failed) {
+            --entry->pins;
+            return false;
+          }
+          ++hit_count;
+          *out = PinnedBlock(std::move(entry));
+          return true;
+        }
+
+        ++miss_count;
+        evictTo(shard, shard_capacity > size ? shard_capacity - size : 0);
+        entry = std::make_shared<CacheEntry>();
+        entry->pins = 1;
+        shard.lru.emplace_front(key, entry);
+        shard.index[key] = shard.lru.begin();
+      }
+
+      // Load without the lock, so other keys in the shard aren't held up.
+      entry->data.resize(size);
+      bool ok = load(entry->data.data());
+
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto found = shard.index.find(key);
+      if (!ok) {
+        if (found != shard.index.end()) {
+          shard.lru.erase(found->second);
+          shard.index.erase(found);
+        }
+        entry->failed = true;
+        --entry->pins;
+        shard.loaded.notify_all();
+        return false;
+      }
+      entry->ready = true;
+      shard.bytes += size;
+      shard.loaded.notify_all();
+      *out = PinnedBlock(std::move(entry));
+      return true;
+    }
+
+    // The bytes of data currently cached.
+    size_t bytes() {
+      size_t total = 0;
+      for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        total += shard->bytes;
+      }
+      return total;
+    }
+
+    int64_t hits() const {
+      return hit_count;
+    }
+
+    int64_t misses() const {
+      return miss_count;
+    }
+
+    int64_t evictions() const {
+      return eviction_count;
+    }
+
+    // Drops every entry that isn't pinned.
+    void clear() {
+      for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        evictTo(*shard, 0);
+      }
+    }
+  };
+
+  // Reads size bytes with load into a PinnedBlock of its own, outside of any
+  // cache, for readers that don't have one.
+  inline bool loadUncached(size_t size, const std::function<bool(char*)>& load,
+                           PinnedBlock* out) {
+    auto entry = std::make_shared<CacheEntry>();
+    entry->data.resize(size);
+    if (!load(entry->data.data())) {
+      return false;
+    }
+    entry->ready = true;
+    entry->pins = 1;
+    *out = PinnedBlock(std::move(entry));
+    return true;
+  }
+}
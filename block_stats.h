@@ -0,0 +1,320 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "header.h"
+#include "reader.h"
+#include "thread_pool.h"
+#include "util.h"
+
+// Fast data-quality statistics, computed directly on the int8 block layout
+// without converting to floating point.
+
+namespace raw {
+
+  // Statistics for one antenna, channel, and polarization of a block.
+  struct ChannelStats {
+    // The mean of re^2 + im^2 over the timesteps.
+    double mean_power;
+
+    // The variance of re^2 + im^2 over the timesteps.
+    double power_variance;
+
+    // How many of the real and imaginary values were at the edge of the int8 range,
+    // meaning 127, -127, or -128.
+    int64_t clipped;
+  };
+
+  // Whether an int8 value counts as clipped.
+  inline bool isClipped(int8_t x) {
+    return x == 127 || x == -127 || x == -128;
+  }
+
+  // Sums over one row, which is every timestep of one antenna and channel.
+  // Each output array has one entry per polarization.
+  inline void rowSumsScalar(const int8_t* row, int num_timesteps, int npol,
+                            int64_t* power_sum, int64_t* power_square_sum, int64_t* clipped) {
+    for (int t = 0; t < num_timesteps; ++t) {
+      for (int pol = 0; pol < npol; ++pol) {
+        int8_t re = row[0];
+        int8_t im = row[1];
+        int64_t p = re * re + im * im;
+        power_sum[pol] += p;
+        power_square_sum[pol] += p * p;
+        clipped[pol] += isClipped(re) + isClipped(im);
+        row += 2;
+      }
+    }
+  }
+
+  // rowSumsScalar with npol known at compile time, which the compiler can vectorize.
+  template<int NPOL>
+  inline void rowSumsFixed(const int8_t* row, int num_timesteps,
+                           int64_t* power_sum, int64_t* power_square_sum, int64_t* clipped) {
+    for (int pol = 0; pol < NPOL; ++pol) {
+      int64_t ps = 0;
+      int64_t pss = 0;
+      int64_t cl = 0;
+      for (int t = 0; t < num_timesteps; ++t) {
+        int re = row[(t * NPOL + pol) * 2];
+        int im = row[(t * NPOL + pol) * 2 + 1];
+        int p = re * re + im * im;
+        ps += p;
+        pss += (int64_t) p * p;
+        cl += (re >= 127 || re <= -127) + (im >= 127 || im <= -127);
+      }
+      power_sum[pol] += ps;
+      power_square_sum[pol] += pss;
+      clipped[pol] += cl;
+    }
+  }
+
+#ifdef __AVX2__
+  // The same as rowSumsScalar, 32 bytes at a time. Only for npol of 1 or 2.
+  inline void rowSumsAVX2(const int8_t* row, int num_timesteps, int npol,
+                          int64_t* power_sum, int64_t* power_square_sum, int64_t* clipped) {
+    size_t size = (size_t) num_timesteps * npol * 2;
+    size_t vector_size = size / 32 * 32;
+
+    // Each 32-bit lane holds one (timestep, pol) power. With npol = 2 the even
+    // lanes are pol 0 and the odd lanes are pol 1.
+    __m256i p_sum = _mm256_setzero_si256();
+    __m256i p2_sum_lo = _mm256_setzero_si256();
+    __m256i p2_sum_hi = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi8(127);
+    const __m256i neg_max = _mm256_set1_epi8(-127);
+    const __m256i min = _mm256_set1_epi8(-128);
+
+    // In the clip bitmask, bit i is byte i, and bytes 4k and 4k+1 belong to pol 0.
+    const uint32_t pol0_bits = (npol == 2) ? 0x33333333u : 0xffffffffu;
+    int64_t clipped0 = 0;
+    int64_t clipped1 = 0;
+
+    // p is at most 2 * 128^2, so the 32-bit power sums are safe for this many steps.
+    const int flush_every = 4096;
+    int64_t lane_sums[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    int steps = 0;
+
+    for (size_t i = 0; i < vector_size; i += 32) {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*) (row + i));
+      for (int half = 0; half < 2; ++half) {
+        __m256i x = _mm256_cvtepi8_epi16(half == 0 ? _mm256_castsi256_si128(bytes)
+                                         : _mm256_extracti128_si256(bytes, 1));
+        __m256i p = _mm256_madd_epi16(x, x);
+        p_sum = _mm256_add_epi32(p_sum, p);
+        __m256i p2 = _mm256_mullo_epi32(p, p);
+        p2_sum_lo = _mm256_add_epi64(p2_sum_lo,
+                                     _mm256_cvtepu32_epi64(_mm256_castsi256_si128(p2)));
+        p2_sum_hi = _mm256_add_epi64(p2_sum_hi,
+                                     _mm256_cvtepu32_epi64(_mm256_extracti128_si256(p2, 1)));
+      }
+
+      __m256i clip = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, max),
+                                                     _mm256_cmpeq_epi8(bytes, neg_max)),
+                                     _mm256_cmpeq_epi8(bytes, min));
+      uint32_t mask = _mm256_movemask_epi8(clip);
+      clipped0 += __builtin_popcount(mask & pol0_bits);
+      clipped1 += __builtin_popcount(mask & ~pol0_bits);
+
+      if (++steps == flush_every) {
+        int32_t lanes[8];
+        _mm256_storeu_si256((__m256i*) lanes, p_sum);
+        for (int j = 0; j < 8; ++j) {
+          lane_sums[j] += lanes[j];
+        }
+        p_sum = _mm256_setzero_si256();
+        steps = 0;
+      }
+    }
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i*) lanes, p_sum);
+    int64_t p2_lo[4];
+    int64_t p2_hi[4];
+    _mm256_storeu_si256((__m256i*) p2_lo, p2_sum_lo);
+    _mm256_storeu_si256((__m256i*) p2_hi, p2_sum_hi);
+    for (int j = 0; j < 8; ++j) {
+      int pol = j % npol;
+      power_sum[pol] += lane_sums[j] + lanes[j];
+      power_square_sum[pol] += (j < 4) ? p2_lo[j] : p2_hi[j - 4];
+    }
+    clipped[0] += clipped0;
+    if (npol == 2) {
+      clipped[1] += clipped1;
+    }
+
+    // The leftover bytes always start at pol 0, since 32 is a multiple of 2 * npol.
+    rowSumsScalar(row + vector_size, (size - vector_size) / (2 * npol), npol,
+                  power_sum, power_square_sum, clipped);
+  }
+#endif
+
+  // Picks the fastest of the rowSums functions for npol.
+  // Uses AVX2 when the library is compiled with it enabled.
+  inline void rowSums(const int8_t* row, int num_timesteps, int npol,
+                      int64_t* power_sum, int64_t* power_square_sum, int64_t* clipped) {
+#ifdef __AVX2__
+    if (npol <= 2) {
+      rowSumsAVX2(row, num_timesteps, npol, power_sum, power_square_sum, clipped);
+    } else {
+      rowSumsScalar(row, num_timesteps, npol, power_sum, power_square_sum, clipped);
+    }
+#else
+    if (npol == 1) {
+      rowSumsFixed<1>(row, num_timesteps, power_sum, power_square_sum, clipped);
+    } else if (npol == 2) {
+      rowSumsFixed<2>(row, num_timesteps, power_sum, power_square_sum, clipped);
+    } else {
+      rowSumsScalar(row, num_timesteps, npol, power_sum, power_square_sum, clipped);
+    }
+#endif
+  }
+
+  // Computes statistics for every antenna, channel, and polarization of a block.
+  // out is resized and indexed like the data, as [antenna][channel][pol].
+  // Uses AVX2 when the library is compiled with it enabled.
+  inline void computeBlockStats(const Header& header, const char* data,
+                                std::vector<ChannelStats>* out) {
+    int npol = header.npol;
+    int rows = header.nants * header.num_channels;
+    size_t row_bytes = (size_t) header.num_timesteps * npol * 2;
+    out->resize(rows * npol);
+
+    for (int r = 0; r < rows; ++r) {
+      const int8_t* row = (const int8_t*) (data + r * row_bytes);
+      int64_t power_sum[2] = {0, 0};
+      int64_t power_square_sum[2] = {0, 0};
+      int64_t clipped[2] = {0, 0};
+      std::vector<int64_t> extra;
+      int64_t* ps = power_sum;
+      int64_t* pss = power_square_sum;
+      int64_t* cl = clipped;
+      if (npol > 2) {
+        extra.assign(3 * npol, 0);
+        ps = extra.data();
+        pss = ps + npol;
+        cl = pss + npol;
+      }
+
+      rowSums(row, header.num_timesteps, npol, ps, pss, cl);
+
+      for (int pol = 0; pol < npol; ++pol) {
+        ChannelStats& stats = (*out)[r * npol + pol];
+        double n = header.num_timesteps;
+        stats.mean_power = ps[pol] / n;
+        stats.power_variance = pss[pol] / n - stats.mean_power * stats.mean_power;
+        stats.clipped = cl[pol];
+      }
+    }
+  }
+
+  /*
+    A time by frequency power summary of a whole file.
+  */
+  struct QuickLook {
+    int num_blocks = 0;
+    int num_channels = 0;
+
+    // The mean power per block and channel, summed over antennas and polarizations.
+    // Indexed [block][channel].
+    std::vector<float> power;
+
+    // The number of clipped values in each block.
+    std::vector<int64_t> clipped;
+
+    // The pktidx of each block.
+    std::vector<int64_t> pktidx;
+  };
+
+  // Computes a QuickLook for a file, reading and processing blocks in parallel.
+  // Returns whether it worked. If it didn't, the error is written to error_message.
+  inline bool quicklook(const std::string& filename, QuickLook* out,
+                        int num_threads = defaultNumThreads(),
+                        std::string* error_message = nullptr) {
+    // First find all the blocks, which only needs the headers.
+    struct BlockInfo {
+      off_t data_offset;
+      int64_t pktidx;
+    };
+    std::vector<BlockInfo> blocks;
+    Reader reader(filename);
+    Header header;
+    Header first;
+    while (reader.readHeader(blocks.empty() ? &first : &header)) {
+      const Header& h = blocks.empty() ? first : header;
+      if (!blocks.empty() && (h.blocsize != first.blocsize || h.npol != first.npol ||
+                              h.obsnchan != first.obsnchan)) {
+        if (error_message) {
+          *error_message = "block dimensions change within " + filename;
+        }
+        return false;
+      }
+      blocks.push_back({h.data_offset, h.pktidx});
+    }
+    if (reader.error()) {
+      if (error_message) {
+        *error_message = reader.errorMessage();
+      }
+      return false;
+    }
+
+    out->num_blocks = blocks.size();
+    out->num_channels = blocks.empty() ? 0 : first.num_channels;
+    out->power.assign(out->num_blocks * out->num_channels, 0.0);
+    out->clipped.assign(out->num_blocks, 0);
+    out->pktidx.resize(out->num_blocks);
+    if (blocks.empty()) {
+      return true;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      if (error_message) {
+        *error_message = "could not open " + filename;
+      }
+      return false;
+    }
+    std::vector<char> ok(num_threads, 1);
+    ThreadPool pool(num_threads);
+    pool.parallelFor(num_threads, [&](int thread) {
+      std::vector<char> data(first.blocsize);
+      std::vector<ChannelStats> stats;
+      for (size_t b = thread; b < blocks.size(); b += num_threads) {
+        if (!pread_fully(fd, data.data(), first.blocsize, blocks[b].data_offset)) {
+          ok[thread] = 0;
+          return;
+        }
+        computeBlockStats(first, data.data(), &stats);
+        float* power = out->power.data() + b * first.num_channels;
+        for (int antenna = 0; antenna < first.nants; ++antenna) {
+          for (int channel = 0; channel < first.num_channels; ++channel) {
+            for (int pol = 0; pol < (int) first.npol; ++pol) {
+              const ChannelStats& s =
+                stats[(antenna * first.num_channels + channel) * first.npol + pol];
+              power[channel] += s.mean_power;
+              out->clipped[b] += s.clipped;
+            }
+          }
+        }
+        out->pktidx[b] = blocks[b].pktidx;
+      }
+    });
+    close(fd);
+
+    for (char x : ok) {
+      if (!x) {
+        if (error_message) {
+          *error_message = "error reading " + filename;
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iterator>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "header.h"
+#include "reader.h"
+#include "util.h"
+
+/*
+  Iterating over blocks with a range-based for loop:
+
+    raw::Reader reader(filename);
+    for (auto& block : reader.blocks()) {
+      if (block.missing_blocks > 0) {
+        continue;
+      }
+      raw::Sample s = block.at(antenna, channel, t, pol);
+      ...
+    }
+    if (reader.error()) { ... }
+
+  blocks() reads all of the remaining headers up front, which only costs a header
+  read per block, and no data is read until a view's data() is used. The views
+  are in a vector, so the range has random-access iterators and works with
+  parallel algorithms, and different views can be used from different threads.
+
+  blockStream() is the same loop with the headers read as it goes, which is what
+  follow mode needs, since there the rest of the headers aren't written yet.
+
+  When the file can be mapped, data() points straight into the mapping, so
+  nothing is copied. Otherwise it is read into a buffer that the view owns
+  until release() is called.
+*/
+
+namespace raw {
+
+  // One complex value, as stored in the data.
+  struct Sample {
+    int8_t re;
+    int8_t im;
+  };
+
+  static_assert(sizeof(Sample) == 2, "Sample must match the data layout");
+
+  // A file that views read their data from.
+  class BlockSource {
+  private:
+    int fd;
+    const char* map = nullptr;
+    size_t map_size = 0;
+
+  public:
+    const std::string filename;
+
+    explicit BlockSource(const std::string& filename) : filename(filename) {
+      fd = open(filename.c_str(), O_RDONLY);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+          map = (const char*) p;
+          map_size = st.st_size;
+        }
+      }
+    }
+
+    BlockSource(const BlockSource&) = delete;
+    BlockSource& operator=(BlockSource&) = delete;
+
+    ~BlockSource() {
+      if (map != nullptr) {
+        munmap((void*) map, map_size);
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    // The mapped bytes at [offset, offset + size), or nullptr if they aren't mapped.
+    const char* mapped(off_t offset, size_t size) const {
+      if (map == nullptr || offset + size > map_size) {
+        return nullptr;
+      }
+      return map + offset;
+    }
+
+    bool read(char* buffer, size_t size, off_t offset) const {
+      return fd >= 0 && pread_fully(fd, buffer, size, offset);
+    }
+  };
+
+  /*
+    A lightweight handle on one block: its main header fields, and its data,
+    which is fetched the first time data() is called.
+  */
+  class BlockView {
+  private:
+    std::shared_ptr<BlockSource> source;
+
+    // The data, once it's fetched. Either points into the mapping or into buffer.
+    mutable const char* cached = nullptr;
+    mutable std::vector<char> buffer;
+
+  public:
+    // The position of this block in the range, starting from 0.
+    int index;
+
+    // These are the same as the Header fields with the same names.
+    size_t blocsize;
+    int nants;
+    int num_channels;
+    int num_timesteps;
+    int npol;
+    long pktidx;
+    int missing_blocks;
+    long datacrc;
+    double obsfreq;
+    double obsbw;
+    double tbin;
+    off_t data_offset;
+
+    BlockView(std::shared_ptr<BlockSource> source, int index, const Header& header)
+      : source(std::move(source)), index(index), blocsize(header.blocsize),
+        nants(header.nants), num_channels(header.num_channels),
+        num_timesteps(header.num_timesteps), npol(header.npol), pktidx(header.pktidx),
+        missing_blocks(header.missing_blocks), datacrc(header.datacrc),
+        obsfreq(header.obsfreq), obsbw(header.obsbw), tbin(header.tbin),
+        data_offset(header.data_offset) {}
+
+    BlockShape shape() const {
+      return BlockShape(nants, num_channels, num_timesteps, npol);
+    }
+
+    // The data for the block, fetching it if needed.
+    // Returns nullptr if it can't be read, as when the file was truncated or
+    // removed after blocks() listed it.
+    const char* data() const {
+      if (cached == nullptr) {
+        cached = source->mapped(data_offset, blocsize);
+        if (cached == nullptr) {
+          buffer.resize(blocsize);
+          if (source->read(buffer.data(), blocsize, data_offset)) {
+            cached = buffer.data();
+          }
+        }
+      }
+      return cached;
+    }
+
+    // Drops a fetched buffer, to bound memory while iterating over a large file.
+    // data() fetches it again if it's needed.
+    void release() {
+      cached = nullptr;
+      std::vector<char>().swap(buffer);
+    }
+
+    // The byte offset within the data of data[antenna][channel][t][pol].
+    size_t offset(int antenna, int channel, int t, int pol) const {
+      assert(antenna < nants && channel < num_channels && t < num_timesteps && pol < npol);
+      return ((((size_t) antenna * num_channels + channel) * num_timesteps + t) * npol + pol) * 2;
+    }
+
+    // The value of data[antenna][channel][t][pol].
+    // The data must be readable, so check data() first if the file may have
+    // changed since blocks() was called.
+    Sample at(int antenna, int channel, int t, int pol) const {
+      const char* d = data();
+      assert(d != nullptr);
+      const char* p = d + offset(antenna, channel, t, pol);
+      return Sample{(int8_t) p[0], (int8_t) p[1]};
+    }
+  };
+
+  /*
+    The blocks of a file, as returned by Reader::blocks().
+  */
+  class BlockList {
+  private:
+    std::vector<BlockView> views;
+
+  public:
+    typedef std::vector<BlockView>::iterator iterator;
+    typedef std::vector<BlockView>::const_iterator const_iterator;
+
+    void add(BlockView view) {
+      views.push_back(std::move(view));
+    }
+
+    iterator begin() { return views.begin(); }
+    iterator end() { return views.end(); }
+    const_iterator begin() const { return views.begin(); }
+    const_iterator end() const { return views.end(); }
+
+    size_t size() const {
+      return views.size();
+    }
+
+    bool empty() const {
+      return views.empty();
+    }
+
+    BlockView& operator[](size_t i) {
+      return views[i];
+    }
+
+    const BlockView& operator[](size_t i) const {
+      return views[i];
+    }
+  };
+
+  /*
+    The blocks of a file read one at a time, as returned by Reader::blockStream().
+    Its iterators are input iterators: ++ reads the next header, and a view is
+    only valid until then.
+  */
+  class BlockStream {
+  private:
+    Reader* reader;
+    std::shared_ptr<BlockSource> source;
+    std::unique_ptr<BlockView> current;
+    int count = 0;
+    bool started = false;
+
+    void advance() {
+      started = true;
+      if (reader->nextBlockView(&source, count, &current)) {
+        ++count;
+      } else {
+        current.reset();
+      }
+    }
+
+  public:
+    class iterator {
+    private:
+      // nullptr at the end.
+      BlockStream* stream;
+
+    public:
+      typedef std::input_iterator_tag iterator_category;
+      typedef BlockView value_type;
+      typedef ptrdiff_t difference_type;
+      typedef BlockView* pointer;
+      typedef BlockView& reference;
+
+      explicit iterator(BlockStream* stream) : stream(stream) {}
+
+      BlockView& operator*() const { return *stream->current; }
+      BlockView* operator->() const { return stream->current.get(); }
+
+      iterator& operator++() {
+        stream->advance();
+        if (stream->current == nullptr) {
+          stream = nullptr;
+        }
+        return *this;
+      }
+
+      bool operator==(const iterator& other) const { return stream == other.stream; }
+      bool operator!=(const iterator& other) const { return stream != other.stream; }
+    };
+
+    explicit BlockStream(Reader* reader) : reader(reader) {}
+
+    iterator begin() {
+      if (!started) {
+        advance();
+      }
+      return iterator(current == nullptr ? nullptr : this);
+    }
+
+    iterator end() {
+      return iterator(nullptr);
+    }
+  };
+
+  inline bool Reader::nextBlockView(std::shared_ptr<BlockSource>* source, int index,
+                                    std::unique_ptr<BlockView>* view) {
+    Header header;
+    if (!readHeader(&header)) {
+      return false;
+    }
+    // In follow mode the reader can roll over to the next file
+    if (*source == nullptr || (*source)->filename != filename) {
+      *source = std::make_shared<BlockSource>(filename);
+    }
+    // Leave out a last block that was cut short, which readData would also
+    // reject, so that every view's data can be read
+    off_t end = header.data_offset + header.blocsize;
+    if (follow_timeout_ms >= 0 ? !waitForBytes(end) : fileSize() < end) {
+      if (!timed_out) {
+        err << "incomplete block at end of file";
+      }
+      return false;
+    }
+    view->reset(new BlockView(*source, index, header));
+    return true;
+  }
+
+  inline BlockList Reader::blocks() {
+    BlockList answer;
+    std::shared_ptr<BlockSource> source;
+    std::unique_ptr<BlockView> view;
+    while (nextBlockView(&source, answer.size(), &view)) {
+      answer.add(std::move(*view));
+    }
+    return answer;
+  }
+
+  inline BlockStream Reader::blockStream() {
+    return BlockStream(this);
+  }
+}
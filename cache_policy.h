@@ -0,0 +1,180 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+  How a reader treats the kernel's page cache.
+
+  By default the kernel decides, which works well for files that fit in memory.
+  A scan through a file much larger than memory fills the page cache with data
+  that will never be read again, pushing out everything else on the machine, so
+  for those the reader can instead:
+
+  - advise the kernel that the file is read sequentially, so it reads further
+    ahead than it otherwise would,
+  - prefetch the data ahead of the reader itself, enough to cover a fraction of
+    a second at the rate the caller is actually consuming blocks, and
+  - drop each block from the page cache once the reader has moved past it.
+
+    raw::Reader reader(filename);
+    reader.cachePolicy(raw::CachePolicy::scan());
+*/
+
+namespace raw {
+
+  struct CachePolicy {
+    // Advise POSIX_FADV_SEQUENTIAL for the whole file.
+    bool sequential = false;
+
+    // Prefetch with POSIX_FADV_WILLNEED ahead of the reader. The window covers
+    // readahead_seconds at the measured consumption rate, and is at least two
+    // blocks and at most max_readahead bytes.
+    bool readahead = false;
+    double readahead_seconds = 0.5;
+    size_t max_readahead = 256 << 20;
+
+    // Release the pages of each block with POSIX_FADV_DONTNEED once it's behind
+    // the reader.
+    bool drop_behind = false;
+
+    // Everything on, for scanning files that are larger than memory.
+    static CachePolicy scan() {
+      CachePolicy policy;
+      policy.sequential = true;
+      policy.readahead = true;
+      policy.drop_behind = true;
+      return policy;
+    }
+  };
+
+  /*
+    Applies a CachePolicy to one file as a reader moves through it.
+    The reader calls consumed each time it gets to a new block, and release when
+    it's done with the file.
+  */
+  class PageCacheAdvisor {
+  private:
+    CachePolicy policy;
+
+    // Everything before dropped_to has been released, and everything before
+    // prefetched_to has been prefetched.
+    off_t dropped_to = 0;
+    off_t prefetched_to = 0;
+
+    // Where the last drop started. The kernel only releases a large folio when
+    // the whole of it is in the range, so each drop covers the previous one's
+    // range again, to catch a folio that straddled the end of it.
+    off_t redrop_from = 0;
+
+    // The consumption rate in bytes per second, averaged over recent blocks.
+    double rate = 0;
+    uint64_t last_ns = 0;
+    off_t last_pos = 0;
+
+    size_t window = 0;
+
+    static off_t pageFloor(off_t pos) {
+      static const off_t page_size = sysconf(_SC_PAGESIZE);
+      return pos / page_size * page_size;
+    }
+
+    void updateRate(off_t pos) {
+      uint64_t now = nowNanos();
+      if (last_ns != 0 && pos > last_pos && now > last_ns) {
+        double sample = (pos - last_pos) * 1e9 / (now - last_ns);
+        rate = (rate == 0) ? sample : 0.75 * rate + 0.25 * sample;
+      }
+      last_ns = now;
+      last_pos = pos;
+    }
+
+  public:
+    // Applies the policy's sequential advice to fd, which may already be in use.
+    void setPolicy(int fd, const CachePolicy& new_policy) {
+      if (new_policy.sequential != policy.sequential) {
+        posix_fadvise(fd, 0, 0,
+                      new_policy.sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+      }
+      policy = new_policy;
+    }
+
+    const CachePolicy& getPolicy() const {
+      return policy;
+    }
+
+    // Starts over on a newly opened file.
+    void opened(int fd) {
+      if (policy.sequential) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      }
+      dropped_to = 0;
+      redrop_from = 0;
+      prefetched_to = 0;
+      last_pos = 0;
+    }
+
+    // Everything before pos has been consumed, and the next block is blocsize
+    // bytes starting there.
+    void consumed(int fd, off_t pos, size_t blocsize) {
+      if (policy.drop_behind && pos > dropped_to) {
+        posix_fadvise(fd, redrop_from, pos - redrop_from, POSIX_FADV_DONTNEED);
+        // Only whole pages are dropped, so the partial page at the end goes next time
+        redrop_from = dropped_to;
+        dropped_to = pageFloor(pos);
+      }
+      if (!policy.readahead) {
+        return;
+      }
+      updateRate(pos);
+      double wanted = rate * policy.readahead_seconds;
+      double least = 2.0 * blocsize;
+      window = (size_t) (wanted < least ? least : wanted);
+      if (window > policy.max_readahead) {
+        window = policy.max_readahead;
+      }
+
+      // Top up once half the window is used, rather than on every block
+      off_t end = pos + window;
+      if (prefetched_to - pos < (off_t) window / 2) {
+        off_t start = prefetched_to > pos ? prefetched_to : pos;
+        posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+        prefetched_to = end;
+      }
+    }
+
+    // The reader is done with fd, having consumed everything before pos.
+    // Drops what it consumed, and what was prefetched beyond that.
+    void release(int fd, off_t pos) {
+      if (!policy.drop_behind) {
+        return;
+      }
+      off_t end = prefetched_to > pos ? prefetched_to : pos;
+      if (end > redrop_from) {
+        posix_fadvise(fd, redrop_from, end - redrop_from, POSIX_FADV_DONTNEED);
+      }
+      dropped_to = end;
+    }
+
+    // Everything before this offset has been advised out of the page cache.
+    // A large folio that straddles it is only released by the next drop.
+    off_t droppedTo() const {
+      return dropped_to;
+    }
+
+    // The current readahead window in bytes, or 0 before the first block.
+    size_t readaheadBytes() const {
+      return window;
+    }
+
+    // The measured consumption rate in bytes per second, or 0 before there's
+    // enough to measure it.
+    double consumptionRate() const {
+      return rate;
+    }
+  };
+}
@@ -0,0 +1,90 @@
+#include <iomanip>
+#include <iostream>
+#include <math.h>
+#include <string.h>
+
+#include "raw.h"
+
+using namespace std;
+
+void usage() {
+  cerr << "usage: catalog index <dir> <output.cat> [--threads N]\n"
+       << "       catalog query <input.cat> [--source NAME] [--freq MHZ]\n"
+       << "                     [--start UNIXTIME] [--end UNIXTIME]\n";
+  exit(1);
+}
+
+// Builds a catalog of a directory tree of raw files, or queries one.
+int main(int argc, char* argv[]) {
+  if (argc < 4) {
+    usage();
+  }
+  string command(argv[1]);
+
+  if (command == "index") {
+    int num_threads = raw::defaultNumThreads();
+    for (int i = 4; i < argc; ++i) {
+      string arg(argv[i]);
+      if (arg == "--threads" && i + 1 < argc) {
+        char* end;
+        long value = strtol(argv[++i], &end, 10);
+        if (*end != '\0' || value <= 0 || value > 1 << 16) {
+          cerr << "error: --threads must be a positive number, not " << argv[i] << endl;
+          exit(1);
+        }
+        num_threads = value;
+      } else {
+        usage();
+      }
+    }
+    raw::Catalog catalog;
+    vector<string> errors;
+    raw::indexDirectory(argv[2], &catalog, num_threads, &errors);
+    for (auto& error : errors) {
+      cerr << "skipped: " << error << endl;
+    }
+    string error_message;
+    if (!catalog.save(argv[3], &error_message)) {
+      cerr << "error: " << error_message << endl;
+      exit(1);
+    }
+    cout << "indexed " << catalog.size() << " files into " << argv[3] << endl;
+    return 0;
+  }
+
+  if (command != "query") {
+    usage();
+  }
+  raw::CatalogQuery query;
+  for (int i = 3; i < argc; ++i) {
+    string arg(argv[i]);
+    if (i + 1 >= argc) {
+      usage();
+    }
+    if (arg == "--source") {
+      query.src_name = argv[++i];
+    } else if (arg == "--freq") {
+      query.frequency = atof(argv[++i]);
+    } else if (arg == "--start") {
+      query.start_time = atof(argv[++i]);
+    } else if (arg == "--end") {
+      query.end_time = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+
+  raw::Catalog catalog;
+  string error_message;
+  if (!catalog.load(argv[2], &error_message)) {
+    cerr << "error: " << error_message << endl;
+    exit(1);
+  }
+  cout << fixed << setprecision(3);
+  for (int i : catalog.query(query)) {
+    raw::CatalogEntry e = catalog.entry(i);
+    cout << e.filename << "  " << e.src_name << "  " << e.lowFrequency() << "-"
+         << e.highFrequency() << " MHz  " << e.start_time << "-" << e.end_time << "  "
+         << e.num_blocks << " blocks" << endl;
+  }
+}
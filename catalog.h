@@ -0,0 +1,411 @@
+#pragma once
+
+#include <algorithm>
+#include <dirent.h>
+#include <math.h>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+#include "header.h"
+#include "reader.h"
+#include "thread_pool.h"
+
+/*
+  An index of many raw files, for questions like "which files cover source X at
+  frequency Y between times A and B".
+
+  Indexing only reads headers, so a file costs one header read per block, and
+  files are indexed in parallel. The catalog stores each field as its own
+  column, with source and telescope names stored once in a dictionary, so it is
+  compact on disk and a query is a scan over a few arrays.
+*/
+
+namespace raw {
+
+  // What the catalog knows about one file.
+  struct CatalogEntry {
+    std::string filename;
+    std::string src_name;
+    std::string telescop;
+
+    // In MHz. obsbw is negative for a reversed frequency axis.
+    double obsfreq = 0;
+    double obsbw = 0;
+
+    // In hours and degrees, from the first header.
+    double ra = 0;
+    double dec = 0;
+
+    // Unix times of the start of the first block and the end of the last block.
+    double start_time = 0;
+    double end_time = 0;
+
+    long first_pktidx = 0;
+    long last_pktidx = 0;
+    int num_blocks = 0;
+    int missing_blocks = 0;
+
+    double lowFrequency() const {
+      return obsfreq - fabs(obsbw) / 2;
+    }
+
+    double highFrequency() const {
+      return obsfreq + fabs(obsbw) / 2;
+    }
+  };
+
+  // The unix start time of a block. Uses SYNCTIME and PIPERBLK when they are
+  // present, and falls back to the less precise STT_IMJD and STT_SMJD.
+  inline double blockStartTime(const Header& header) {
+    if (header.getUnsignedInt("SYNCTIME", UNSIGNED_INT_NOT_PRESENT) != UNSIGNED_INT_NOT_PRESENT &&
+        header.getUnsignedInt("PIPERBLK", UNSIGNED_INT_NOT_PRESENT) != UNSIGNED_INT_NOT_PRESENT) {
+      return header.getStartTime();
+    }
+    const double unix_epoch_mjd = 40587;
+    return (header.mjd - unix_epoch_mjd) * 86400;
+  }
+
+  // Reads the headers of one file into an entry.
+  // Returns whether it worked. If it didn't, the error is written to error_message.
+  inline bool indexFile(const std::string& filename, CatalogEntry* entry,
+                        std::string* error_message = nullptr) {
+    Reader reader(filename);
+    Header header;
+    *entry = CatalogEntry();
+    entry->filename = filename;
+    while (reader.readHeader(&header)) {
+      if (entry->num_blocks == 0) {
+        entry->src_name = header.src_name;
+        entry->telescop = header.telescop;
+        entry->obsfreq = header.obsfreq;
+        entry->obsbw = header.obsbw;
+        entry->ra = header.ra;
+        entry->dec = header.dec;
+        entry->start_time = blockStartTime(header);
+        entry->first_pktidx = header.pktidx;
+      }
+      entry->end_time = blockStartTime(header) + header.tbin * header.num_timesteps;
+      entry->last_pktidx = header.pktidx;
+      entry->missing_blocks += header.missing_blocks;
+      ++entry->num_blocks;
+    }
+    if (reader.error() || entry->num_blocks == 0) {
+      if (error_message) {
+        *error_message = reader.error() ? reader.errorMessage() : "no blocks in " + filename;
+      }
+      return false;
+    }
+    return true;
+  }
+
+  // What to look for in a catalog. Unset conditions match everything.
+  struct CatalogQuery {
+    // An exact source name.
+    std::string src_name;
+
+    // A frequency in MHz that the file's band must contain.
+    double frequency = NAN;
+
+    // A time range, as unix times, that the file must overlap.
+    double start_time = NAN;
+    double end_time = NAN;
+  };
+
+  class Catalog {
+  private:
+    // Distinct strings, referred to by index from the columns.
+    std::vector<std::string> dictionary;
+
+    // The columns, one entry per file.
+    std::vector<std::string> filenames;
+    std::vector<int32_t> src_names;
+    std::vector<int32_t> telescops;
+    std::vector<double> obsfreqs;
+    std::vector<double> obsbws;
+    std::vector<double> low_frequencies;
+    std::vector<double> high_frequencies;
+    std::vector<double> ras;
+    std::vector<double> decs;
+    std::vector<double> start_times;
+    std::vector<double> end_times;
+    std::vector<int64_t> first_pktidxs;
+    std::vector<int64_t> last_pktidxs;
+    std::vector<int32_t> block_counts;
+    std::vector<int32_t> missing_block_counts;
+
+    // The dictionary index of a string, or -1 if it isn't there.
+    int32_t findString(const std::string& s) const {
+      auto it = std::find(dictionary.begin(), dictionary.end(), s);
+      return it == dictionary.end() ? -1 : it - dictionary.begin();
+    }
+
+    int32_t addString(const std::string& s) {
+      int32_t i = findString(s);
+      if (i >= 0) {
+        return i;
+      }
+      dictionary.push_back(s);
+      return dictionary.size() - 1;
+    }
+
+    template<typename T>
+    static void writeColumn(FILE* f, const std::vector<T>& column) {
+      fwrite(column.data(), sizeof(T), column.size(), f);
+    }
+
+    template<typename T>
+    static bool readColumn(FILE* f, size_t n, std::vector<T>* column) {
+      column->resize(n);
+      return fread(column->data(), sizeof(T), n, f) == n;
+    }
+
+    static void writeStrings(FILE* f, const std::vector<std::string>& strings) {
+      for (auto& s : strings) {
+        uint32_t size = s.size();
+        fwrite(&size, sizeof(size), 1, f);
+        fwrite(s.data(), 1, size, f);
+      }
+    }
+
+    static bool readStrings(FILE* f, size_t n, std::vector<std::string>* strings) {
+      strings->resize(n);
+      for (auto& s : *strings) {
+        uint32_t size;
+        if (fread(&size, sizeof(size), 1, f) != 1) {
+          return false;
+        }
+        s.resize(size);
+        if (size > 0 && fread(&s[0], 1, size, f) != size) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+  public:
+    size_t size() const {
+      return filenames.size();
+    }
+
+    void add(const CatalogEntry& entry) {
+      filenames.push_back(entry.filename);
+      src_names.push_back(addString(entry.src_name));
+      telescops.push_back(addString(entry.telescop));
+      obsfreqs.push_back(entry.obsfreq);
+      obsbws.push_back(entry.obsbw);
+      low_frequencies.push_back(entry.lowFrequency());
+      high_frequencies.push_back(entry.highFrequency());
+      ras.push_back(entry.ra);
+      decs.push_back(entry.dec);
+      start_times.push_back(entry.start_time);
+      end_times.push_back(entry.end_time);
+      first_pktidxs.push_back(entry.first_pktidx);
+      last_pktidxs.push_back(entry.last_pktidx);
+      block_counts.push_back(entry.num_blocks);
+      missing_block_counts.push_back(entry.missing_blocks);
+    }
+
+    CatalogEntry entry(size_t i) const {
+      CatalogEntry e;
+      e.filename = filenames[i];
+      e.src_name = dictionary[src_names[i]];
+      e.telescop = dictionary[telescops[i]];
+      e.obsfreq = obsfreqs[i];
+      e.obsbw = obsbws[i];
+      e.ra = ras[i];
+      e.dec = decs[i];
+      e.start_time = start_times[i];
+      e.end_time = end_times[i];
+      e.first_pktidx = first_pktidxs[i];
+      e.last_pktidx = last_pktidxs[i];
+      e.num_blocks = block_counts[i];
+      e.missing_blocks = missing_block_counts[i];
+      return e;
+    }
+
+    // The indices of the files that match the query, in catalog order.
+    std::vector<int> query(const CatalogQuery& q) const {
+      std::vector<int> answer;
+      int32_t src = -1;
+      if (!q.src_name.empty()) {
+        src = findString(q.src_name);
+        if (src < 0) {
+          return answer;
+        }
+      }
+      bool by_frequency = !isnan(q.frequency);
+      double start = isnan(q.start_time) ? -INFINITY : q.start_time;
+      double end = isnan(q.end_time) ? INFINITY : q.end_time;
+      for (size_t i = 0; i < size(); ++i) {
+        if ((src < 0 || src_names[i] == src) &&
+            (!by_frequency ||
+             (low_frequencies[i] <= q.frequency && q.frequency <= high_frequencies[i])) &&
+            start_times[i] <= end && end_times[i] >= start) {
+          answer.push_back(i);
+        }
+      }
+      return answer;
+    }
+
+    // Writes the catalog to a file.
+    // Returns whether it worked. If it didn't, the error is written to error_message.
+    bool save(const std::string& filename, std::string* error_message = nullptr) const {
+      FILE* f = fopen(filename.c_str(), "wb");
+      if (f == nullptr) {
+        if (error_message) {
+          *error_message = "could not open " + filename + " for writing";
+        }
+        return false;
+      }
+      fwrite("RAWCAT1\n", 1, 8, f);
+      uint64_t counts[2] = {dictionary.size(), size()};
+      fwrite(counts, sizeof(uint64_t), 2, f);
+      writeStrings(f, dictionary);
+      writeStrings(f, filenames);
+      writeColumn(f, src_names);
+      writeColumn(f, telescops);
+      writeColumn(f, obsfreqs);
+      writeColumn(f, obsbws);
+      writeColumn(f, ras);
+      writeColumn(f, decs);
+      writeColumn(f, start_times);
+      writeColumn(f, end_times);
+      writeColumn(f, first_pktidxs);
+      writeColumn(f, last_pktidxs);
+      writeColumn(f, block_counts);
+      writeColumn(f, missing_block_counts);
+      bool ok = !ferror(f);
+      ok = (fclose(f) == 0) && ok;
+      if (!ok && error_message) {
+        *error_message = "error writing " + filename;
+      }
+      return ok;
+    }
+
+    // Replaces the contents of this catalog with a file written by save.
+    // Returns whether it worked. If it didn't, the error is written to error_message.
+    bool load(const std::string& filename, std::string* error_message = nullptr) {
+      *this = Catalog();
+      FILE* f = fopen(filename.c_str(), "rb");
+      if (f == nullptr) {
+        if (error_message) {
+          *error_message = "could not open " + filename;
+        }
+        return false;
+      }
+      char magic[8];
+      uint64_t counts[2];
+      bool ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, "RAWCAT1\n", 8) &&
+        fread(counts, sizeof(uint64_t), 2, f) == 2 &&
+        readStrings(f, counts[0], &dictionary) &&
+        readStrings(f, counts[1], &filenames) &&
+        readColumn(f, counts[1], &src_names) &&
+        readColumn(f, counts[1], &telescops) &&
+        readColumn(f, counts[1], &obsfreqs) &&
+        readColumn(f, counts[1], &obsbws) &&
+        readColumn(f, counts[1], &ras) &&
+        readColumn(f, counts[1], &decs) &&
+        readColumn(f, counts[1], &start_times) &&
+        readColumn(f, counts[1], &end_times) &&
+        readColumn(f, counts[1], &first_pktidxs) &&
+        readColumn(f, counts[1], &last_pktidxs) &&
+        readColumn(f, counts[1], &block_counts) &&
+        readColumn(f, counts[1], &missing_block_counts);
+      fclose(f);
+      if (ok) {
+        for (size_t i = 0; i < size(); ++i) {
+          ok = ok && src_names[i] >= 0 && src_names[i] < (int32_t) dictionary.size() &&
+            telescops[i] >= 0 && telescops[i] < (int32_t) dictionary.size();
+          low_frequencies.push_back(obsfreqs[i] - fabs(obsbws[i]) / 2);
+          high_frequencies.push_back(obsfreqs[i] + fabs(obsbws[i]) / 2);
+        }
+      }
+      if (!ok) {
+        *this = Catalog();
+        if (error_message) {
+          *error_message = filename + " is not a valid catalog";
+        }
+      }
+      return ok;
+    }
+  };
+
+  // Adds every .raw file under dir, recursively, to a list.
+  // Symlinks are followed, but each directory is only visited once, so a link
+  // back to an ancestor doesn't loop.
+  inline void findRawFiles(const std::string& dir, std::vector<std::string>* out,
+                           std::set<std::pair<dev_t, ino_t> >* visited) {
+    struct stat dir_st;
+    if (stat(dir.c_str(), &dir_st) != 0 ||
+        !visited->insert(std::make_pair(dir_st.st_dev, dir_st.st_ino)).second) {
+      return;
+    }
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+      return;
+    }
+    std::vector<std::string> subdirs;
+    while (struct dirent* entry = readdir(d)) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") {
+        continue;
+      }
+      std::string path = dir + "/" + name;
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0) {
+        continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+        subdirs.push_back(path);
+      } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".raw") == 0) {
+        out->push_back(path);
+      }
+    }
+    closedir(d);
+    for (auto& subdir : subdirs) {
+      findRawFiles(subdir, out, visited);
+    }
+  }
+
+  inline void findRawFiles(const std::string& dir, std::vector<std::string>* out) {
+    std::set<std::pair<dev_t, ino_t> > visited;
+    findRawFiles(dir, out, &visited);
+  }
+
+  // Indexes every .raw file under dir on num_threads threads, adding them to the
+  // catalog in filename order. Fewer than one thread means one.
+  // Files that can't be indexed are left out, and their errors added to errors.
+  inline void indexDirectory(const std::string& dir, Catalog* catalog,
+                             int num_threads = defaultNumThreads(),
+                             std::vector<std::string>* errors = nullptr) {
+    if (num_threads < 1) {
+      num_threads = 1;
+    }
+    std::vector<std::string> files;
+    findRawFiles(dir, &files);
+    std::sort(files.begin(), files.end());
+
+    std::vector<CatalogEntry> entries(files.size());
+    std::vector<std::string> file_errors(files.size());
+    ThreadPool pool(num_threads);
+    pool.parallelFor(num_threads, [&](int thread) {
+      for (size_t i = thread; i < files.size(); i += num_threads) {
+        indexFile(files[i], &entries[i], &file_errors[i]);
+      }
+    });
+
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (file_errors[i].empty()) {
+        catalog->add(entries[i]);
+      } else if (errors) {
+        errors->push_back(file_errors[i]);
+      }
+    }
+  }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+/*
+  CRC32C checksums of data blocks.
+
+  When a file is written with checksums on, each header gets a "DATACRC" card
+  holding the CRC32C of its data block. CRC32C is the Castagnoli polynomial,
+  the one that SSE4.2 computes in hardware, which is used when the library is
+  compiled with it enabled, for example with RAW_NATIVE. Otherwise a
+  slicing-by-8 table version is used.
+*/
+
+namespace raw {
+
+  // The reflected Castagnoli polynomial.
+  const uint32_t CRC32C_POLYNOMIAL = 0x82f63b78;
+
+  // Lookup tables for the software CRC, where table[k][b] is the CRC of byte b
+  // followed by k zero bytes.
+  struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+      for (int b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; ++i) {
+          crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+        }
+        table[0][b] = crc;
+      }
+      for (int b = 0; b < 256; ++b) {
+        for (int k = 1; k < 8; ++k) {
+          table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+      }
+    }
+  };
+
+  inline const Crc32cTables& crc32cTables() {
+    static const Crc32cTables tables;
+    return tables;
+  }
+
+  // Continues a CRC32C over size more bytes, eight at a time, using the tables.
+  inline uint32_t crc32cSoftware(const char* data, size_t size, uint32_t crc = 0) {
+    const uint32_t (*t)[256] = crc32cTables().table;
+    const uint8_t* p = (const uint8_t*) data;
+    crc = ~crc;
+    while (size >= 8) {
+      uint32_t lo;
+      uint32_t hi;
+      memcpy(&lo, p, 4);
+      memcpy(&hi, p + 4, 4);
+      lo ^= crc;
+      crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^
+        t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+        t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+      p += 8;
+      size -= 8;
+    }
+    while (size > 0) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+      ++p;
+      --size;
+    }
+    return ~crc;
+  }
+
+#ifdef __SSE4_2__
+  // The same as crc32cSoftware, with the SSE4.2 crc32 instruction.
+  inline uint32_t crc32cHardware(const char* data, size_t size, uint32_t crc = 0) {
+    const char* p = data;
+    uint64_t c = ~crc;
+    while (size >= 8) {
+      uint64_t x;
+      memcpy(&x, p, 8);
+      c = _mm_crc32_u64(c, x);
+      p += 8;
+      size -= 8;
+    }
+    uint32_t c32 = c;
+    while (size > 0) {
+      c32 = _mm_crc32_u8(c32, *p);
+      ++p;
+      --size;
+    }
+    return ~c32;
+  }
+#endif
+
+  // Continues a CRC32C over size more bytes. Start with crc = 0.
+  inline uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0) {
+#ifdef __SSE4_2__
+    return crc32cHardware(data, size, crc);
+#else
+    return crc32cSoftware(data, size, crc);
+#endif
+  }
+}
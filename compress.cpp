@@ -0,0 +1,89 @@
+#include <iostream>
+#include <string.h>
+#include <vector>
+
+#include "raw.h"
+
+using namespace std;
+
+void usage() {
+  cerr << "usage: compress <input.raw> <output.rawz> [--codec none|zstd|lz4] [--level N]\n"
+       << "The default codec is the best one in this build, which is "
+       << raw::codecName(raw::bestCodec()) << ".\n";
+}
+
+// Converts a raw file into the compressed container format of compressed.h.
+int main(int argc, char* argv[]) {
+  raw::Codec codec = raw::bestCodec();
+  int level = 3;
+  vector<string> filenames;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    if (arg == "--help") {
+      usage();
+      exit(0);
+    }
+    if (arg.size() > 2 && arg.substr(0, 2) == "--") {
+      if (arg != "--codec" && arg != "--level") {
+        cerr << "unknown flag: " << arg << endl;
+        usage();
+        exit(1);
+      }
+      if (i + 1 >= argc) {
+        cerr << "missing value for " << arg << endl;
+        usage();
+        exit(1);
+      }
+    }
+    if (arg == "--codec") {
+      if (!raw::parseCodec(argv[++i], &codec)) {
+        cerr << "unknown codec: " << argv[i] << endl;
+        exit(1);
+      }
+    } else if (arg == "--level") {
+      level = atoi(argv[++i]);
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+
+  if (filenames.size() != 2) {
+    usage();
+    exit(1);
+  }
+  if (!raw::codecAvailable(codec)) {
+    cerr << "codec " << raw::codecName(codec) << " is not available in this build\n";
+    exit(1);
+  }
+
+  raw::Reader reader(filenames[0]);
+  raw::CompressedWriter writer(filenames[1], codec, level);
+  raw::Header header;
+  vector<char> data;
+  size_t bytes_in = 0;
+  int num_blocks = 0;
+  while (reader.readHeader(&header)) {
+    data.resize(header.blocsize);
+    if (!reader.readData(data.data())) {
+      break;
+    }
+    raw::HeaderCards cards;
+    cards.copyFrom(header);
+    if (!writer.writeBlock(cards, data.data(), data.size())) {
+      break;
+    }
+    bytes_in += header.blocsize;
+    ++num_blocks;
+  }
+
+  if (reader.error()) {
+    cerr << "error: " << reader.errorMessage() << endl;
+    exit(1);
+  }
+  if (writer.error()) {
+    cerr << "error: " << writer.errorMessage() << endl;
+    exit(1);
+  }
+  cout << "compressed " << num_blocks << " blocks, " << bytes_in << " bytes of data\n";
+}
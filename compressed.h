@@ -0,0 +1,598 @@
+#pragma once
+
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <memory>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#ifdef RAW_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef RAW_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "checksum.h"
+#include "error_message.h"
+#include "header.h"
+#include "reader.h"
+#include "thread_pool.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+  A compressed container for raw files.
+
+  The container is laid out like a raw file, alternating headers and frames.
+  The headers are stored uncompressed, with BLOCSIZE still giving the size of
+  the uncompressed block, plus these extra cards:
+
+    ZCODEC    the codec the frame was compressed with: 'none', 'zstd', or 'lz4'
+    ZBLOCSIZ  the size of the frame in bytes
+    ZSHUFFLE  the byte-shuffle element size, or 1 for no shuffle
+
+  Each frame holds exactly one block, so any block can be found by hopping from
+  header to header and decompressed on its own.
+
+  Before compressing, the bytes are shuffled so that byte j of every ZSHUFFLE-byte
+  element is stored together. With the default of 2 this groups the real parts
+  separately from the imaginary parts, which compresses better.
+
+  zstd and lz4 are only available when RAW_HAVE_ZSTD and RAW_HAVE_LZ4 are defined,
+  which the CMake build does when it finds the libraries.
+*/
+
+namespace raw {
+
+  enum class Codec { NONE, ZSTD, LZ4 };
+
+  inline std::string codecName(Codec codec) {
+    switch (codec) {
+    case Codec::ZSTD:
+      return "zstd";
+    case Codec::LZ4:
+      return "lz4";
+    default:
+      return "none";
+    }
+  }
+
+  // Returns whether the name was a codec we know about.
+  inline bool parseCodec(const std::string& name, Codec* codec) {
+    if (name == "none") {
+      *codec = Codec::NONE;
+    } else if (name == "zstd") {
+      *codec = Codec::ZSTD;
+    } else if (name == "lz4") {
+      *codec = Codec::LZ4;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Whether this build can compress and decompress with the codec.
+  inline bool codecAvailable(Codec codec) {
+    switch (codec) {
+    case Codec::NONE:
+      return true;
+    case Codec::ZSTD:
+#ifdef RAW_HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    case Codec::LZ4:
+#ifdef RAW_HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+    }
+    return false;
+  }
+
+  // The codec that compresses best among the ones in this build.
+  inline Codec bestCodec() {
+    if (codecAvailable(Codec::ZSTD)) {
+      return Codec::ZSTD;
+    }
+    if (codecAvailable(Codec::LZ4)) {
+      return Codec::LZ4;
+    }
+    return Codec::NONE;
+  }
+
+  // Stores byte j of each typesize-byte element of in contiguously in out.
+  // Any bytes past the last whole element are copied as-is.
+  inline void shuffleBytes(const char* in, char* out, size_t size, int typesize) {
+    size_t n = size / typesize;
+    for (int j = 0; j < typesize; ++j) {
+      char* dest = out + j * n;
+      for (size_t i = 0; i < n; ++i) {
+        dest[i] = in[i * typesize + j];
+      }
+    }
+    memcpy(out + n * typesize, in + n * typesize, size - n * typesize);
+  }
+
+  // The inverse of shuffleBytes.
+  inline void unshuffleBytes(const char* in, char* out, size_t size, int typesize) {
+    size_t n = size / typesize;
+    for (int j = 0; j < typesize; ++j) {
+      const char* source = in + j * n;
+      for (size_t i = 0; i < n; ++i) {
+        out[i * typesize + j] = source[i];
+      }
+    }
+    memcpy(out + n * typesize, in + n * typesize, size - n * typesize);
+  }
+
+  // Compresses size bytes of data into frame.
+  // scratch is working space, which can be reused across calls to avoid allocation.
+  // Returns whether it worked.
+  inline bool encodeFrame(Codec codec, int level, int typesize, const char* data, size_t size,
+                          std::vector<char>* frame, std::vector<char>* scratch) {
+    const char* source = data;
+    if (typesize > 1) {
+      scratch->resize(size);
+      shuffleBytes(data, scratch->data(), size, typesize);
+      source = scratch->data();
+    }
+
+    switch (codec) {
+    case Codec::NONE:
+      frame->assign(source, source + size);
+      return true;
+
+    case Codec::ZSTD:
+#ifdef RAW_HAVE_ZSTD
+      {
+        frame->resize(ZSTD_compressBound(size));
+        size_t n = ZSTD_compress(frame->data(), frame->size(), source, size, level);
+        if (ZSTD_isError(n)) {
+          return false;
+        }
+        frame->resize(n);
+        return true;
+      }
+#else
+      return false;
+#endif
+
+    case Codec::LZ4:
+#ifdef RAW_HAVE_LZ4
+      {
+        frame->resize(LZ4_compressBound(size));
+        int n = LZ4_compress_default(source, frame->data(), size, frame->size());
+        if (n <= 0) {
+          return false;
+        }
+        frame->resize(n);
+        return true;
+      }
+#else
+      return false;
+#endif
+    }
+    return false;
+  }
+
+  // Decompresses a frame into size bytes of out.
+  // scratch is working space, which can be reused across calls to avoid allocation.
+  // Returns whether it worked.
+  inline bool decodeFrame(Codec codec, int typesize, const char* frame, size_t frame_size,
+                          char* out, size_t size, std::vector<char>* scratch) {
+    char* dest = out;
+    if (typesize > 1) {
+      scratch->resize(size);
+      dest = scratch->data();
+    }
+
+    bool ok = false;
+    switch (codec) {
+    case Codec::NONE:
+      ok = (frame_size == size);
+      if (ok) {
+        memcpy(dest, frame, size);
+      }
+      break;
+
+    case Codec::ZSTD:
+#ifdef RAW_HAVE_ZSTD
+      {
+        size_t n = ZSTD_decompress(dest, size, frame, frame_size);
+        ok = !ZSTD_isError(n) && n == size;
+      }
+#endif
+      break;
+
+    case Codec::LZ4:
+#ifdef RAW_HAVE_LZ4
+      ok = (int) size == LZ4_decompress_safe(frame, dest, frame_size, size);
+#endif
+      break;
+    }
+
+    if (ok && typesize > 1) {
+      unshuffleBytes(dest, out, size, typesize);
+    }
+    return ok;
+  }
+
+  /*
+    Writes a compressed container, one block at a time.
+  */
+  class CompressedWriter {
+  private:
+    Writer writer;
+    Codec codec;
+    int level;
+    std::vector<char> frame;
+    std::vector<char> scratch;
+
+    // Errors from compression. Errors from writing are kept by the writer.
+    ErrorMessage err = ErrorMessage();
+
+  public:
+    // level is passed to the codec. It is ignored for Codec::NONE.
+    CompressedWriter(const std::string& filename, Codec codec, int level = 3)
+      : writer(filename), codec(codec), level(level) {}
+
+    CompressedWriter(const CompressedWriter&) = delete;
+    CompressedWriter& operator=(CompressedWriter&) = delete;
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used || writer.error();
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err.used ? std::string(err) : writer.errorMessage();
+    }
+
+    // Turns on the DATACRC card, holding the CRC32C of each block's uncompressed data.
+    void writeChecksums(bool on) {
+      writer.writeChecksums(on);
+    }
+
+    // Compresses a block and writes it with its header.
+    // typesize is the byte-shuffle element size.
+    // Returns whether the write was successful.
+    bool writeBlock(HeaderCards cards, const char* data, size_t size, int typesize = 2) {
+      if (error()) {
+        return false;
+      }
+      if (!codecAvailable(codec)) {
+        err << "codec " << codecName(codec) << " is not available in this build";
+        return false;
+      }
+      if (!encodeFrame(codec, level, typesize, data, size, &frame, &scratch)) {
+        err << "could not compress block with " << codecName(codec);
+        return false;
+      }
+      if (writer.writesChecksums()) {
+        cards.set("DATACRC", (long) crc32c(data, size));
+      }
+      cards.set("ZCODEC", codecName(codec));
+      cards.set("ZBLOCSIZ", frame.size());
+      cards.set("ZSHUFFLE", typesize);
+      return writer.writeFrame(std::move(cards), size, frame.data(), frame.size());
+    }
+  };
+
+  /*
+    Reads a compressed container, with the same readHeader, readData and readBand
+    methods as Reader.
+
+    Frames are read and decompressed on a pool of worker threads, up to
+    `lookahead` blocks ahead of the block the caller is on, so by the time the
+    caller asks for a block it is usually ready.
+
+    header->data_offset is the offset of the compressed frame in the file.
+  */
+  class CompressedReader {
+  private:
+    // What happened to a frame on its worker thread.
+    enum FrameStatus {
+      FRAME_OK,
+      FRAME_UNREADABLE,
+      FRAME_BAD_CHECKSUM,
+    };
+
+    // Where one block is, and its decompressed data once that's ready.
+    struct Frame {
+      off_t header_offset;
+      off_t frame_offset;
+      size_t frame_size;
+      size_t blocsize;
+      std::shared_ptr<std::vector<char> > data;
+      std::shared_future<FrameStatus> ready;
+    };
+
+    int fdin;
+
+    // How many blocks to decompress ahead.
+    int lookahead;
+
+    // Whether workers check decompressed data against DATACRC cards.
+    bool verify_checksums = false;
+
+    // How many headers have already been read from this file
+    int headers_read = 0;
+
+    // The offset of the next header that hasn't been scheduled yet.
+    off_t scan_offset = 0;
+    bool scan_done = false;
+
+    // Why scanning stopped, if it wasn't the end of the file.
+    std::string scan_error;
+
+    // For reading headers ahead of the caller.
+    Header scan_header;
+
+    // Frames that are scheduled but not yet handed to the caller.
+    std::deque<Frame> pending;
+
+    // The block the caller is on.
+    Frame current;
+    bool have_current = false;
+    bool current_consumed = false;
+
+    // Decompressed buffers that can be reused.
+    std::vector<std::shared_ptr<std::vector<char> > > spare;
+
+    // For counting missing blocks. See setMissingBlocks.
+    int64_t pktidx = 0;
+    int64_t pktidx_step = 0;
+
+    // Once err is used, the reader is in "error state".
+    ErrorMessage err = ErrorMessage();
+
+    ThreadPool pool;
+
+    // Reads the header at scan_offset and schedules its frame for decompression.
+    void scanOne() {
+      Header* h = &scan_header;
+      ssize_t n = pread(fdin, h->buffer, MAX_RAW_HEADER_SIZE, scan_offset);
+      if (n < 0) {
+        scan_error = "error reading header";
+        scan_done = true;
+        return;
+      }
+      if (n < 80) {
+        scan_done = true;
+        return;
+      }
+      rawspec_raw_parse_header(h);
+      int hdr_size = rawspec_raw_header_size(h->buffer, n, h->directio);
+      if (hdr_size == 0 || !rawspec_raw_check_header(h)) {
+        scan_error = "bad header at offset " + std::to_string(scan_offset);
+        scan_done = true;
+        return;
+      }
+      Codec codec;
+      if (!parseCodec(h->getString("ZCODEC"), &codec)) {
+        scan_error = "missing or unknown ZCODEC at offset " + std::to_string(scan_offset);
+        scan_done = true;
+        return;
+      }
+      if (!codecAvailable(codec)) {
+        scan_error = "codec " + codecName(codec) + " is not available in this build";
+        scan_done = true;
+        return;
+      }
+
+      if (h->getString("ZBLOCSIZ").empty()) {
+        scan_error = "ZBLOCSIZ missing at offset " + std::to_string(scan_offset);
+        scan_done = true;
+        return;
+      }
+
+      Frame frame;
+      frame.header_offset = scan_offset;
+      frame.frame_offset = scan_offset + hdr_size;
+      frame.frame_size = h->getUnsignedLong("ZBLOCSIZ", 0);
+      frame.blocsize = h->blocsize;
+      int typesize = h->getInt("ZSHUFFLE", 1);
+      if (spare.empty()) {
+        frame.data = std::make_shared<std::vector<char> >();
+      } else {
+        frame.data = spare.back();
+        spare.pop_back();
+      }
+      scan_offset = frame.frame_offset + frame.frame_size;
+
+      int fd = fdin;
+      auto data = frame.data;
+      off_t frame_offset = frame.frame_offset;
+      size_t frame_size = frame.frame_size;
+      size_t blocsize = frame.blocsize;
+      long datacrc = verify_checksums ? h->datacrc : -1;
+      frame.ready = pool.submit([fd, data, frame_offset, frame_size, blocsize, codec,
+                                 typesize, datacrc]() {
+        std::vector<char> compressed(frame_size);
+        if (!pread_fully(fd, compressed.data(), frame_size, frame_offset)) {
+          return FRAME_UNREADABLE;
+        }
+        std::vector<char> scratch;
+        data->resize(blocsize);
+        if (!decodeFrame(codec, typesize, compressed.data(), frame_size,
+                         data->data(), blocsize, &scratch)) {
+          return FRAME_UNREADABLE;
+        }
+        if (datacrc >= 0 && crc32c(data->data(), blocsize) != datacrc) {
+          return FRAME_BAD_CHECKSUM;
+        }
+        return FRAME_OK;
+      }).share();
+      pending.push_back(std::move(frame));
+    }
+
+    // Waits for the current block to be decompressed.
+    bool waitForCurrent() {
+      if (!have_current) {
+        err << "no current block to read";
+        return false;
+      }
+      FrameStatus status = current.ready.get();
+      if (status == FRAME_UNREADABLE) {
+        err << "could not decompress block #" << headers_read << " of " << filename;
+        return false;
+      }
+      if (status == FRAME_BAD_CHECKSUM) {
+        err << "checksum mismatch in block #" << headers_read << " of " << filename;
+        return false;
+      }
+      return true;
+    }
+
+  public:
+    std::string filename;
+
+    // num_threads is how many blocks can be decompressed at once.
+    // lookahead is how many blocks to decompress ahead of the caller, which bounds
+    // the memory used to about lookahead times the block size.
+    CompressedReader(const std::string& filename, int num_threads = defaultNumThreads(),
+                     int lookahead = 0)
+      : lookahead(lookahead > 0 ? lookahead : 2 * num_threads),
+        pool(num_threads), filename(filename) {
+      fdin = open(filename.c_str(), O_RDONLY);
+      if (fdin < 0) {
+        err << "could not open " << filename;
+      }
+    }
+
+    CompressedReader(const CompressedReader&) = delete;
+    CompressedReader& operator=(CompressedReader&) = delete;
+
+    ~CompressedReader() {
+      // Worker threads may still be reading from fdin
+      for (auto& frame : pending) {
+        frame.ready.wait();
+      }
+      if (have_current) {
+        current.ready.wait();
+      }
+      if (fdin >= 0) {
+        close(fdin);
+      }
+    }
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used;
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err;
+    }
+
+    // Turns on checking each block against its DATACRC card, if it has one.
+    // The check runs on the worker threads as blocks are decompressed, and a
+    // mismatch makes readData or readBand fail with an error.
+    // Call this before the first readHeader, since blocks are decompressed ahead.
+    void verifyChecksums(bool on) {
+      verify_checksums = on;
+    }
+
+    // Reads the next header.
+    // Returns whether the read was successful.
+    // If readHeader returns false, it can either be an error, or we reached the end of
+    // the file. Callers should check error() to see if there was an error.
+    bool readHeader(Header* header) {
+      if (error()) {
+        return false;
+      }
+
+      if (have_current) {
+        current.ready.wait();
+        if (current.data.use_count() == 1) {
+          spare.push_back(std::move(current.data));
+        }
+        have_current = false;
+      }
+
+      while ((int) pending.size() < lookahead && !scan_done) {
+        scanOne();
+      }
+      if (pending.empty()) {
+        if (!scan_error.empty()) {
+          err << scan_error << " in " << filename;
+        }
+        return false;
+      }
+      current = std::move(pending.front());
+      pending.pop_front();
+      have_current = true;
+      current_consumed = false;
+
+      ssize_t n = pread(fdin, header->buffer, MAX_RAW_HEADER_SIZE, current.header_offset);
+      if (n < 80) {
+        err << "error reading block header #" << (headers_read + 1) << " from " << filename;
+        return false;
+      }
+      rawspec_raw_parse_header(header);
+      if (!rawspec_raw_check_header(header)) {
+        err << "error reading block header #" << (headers_read + 1) << " from " << filename;
+        return false;
+      }
+      header->hdr_size = rawspec_raw_header_size(header->buffer, n, 0);
+      header->data_offset = current.frame_offset;
+      if (!setBlockDimensions(header, err)) {
+        return false;
+      }
+      setMissingBlocks(header, headers_read, pktidx, &pktidx_step);
+      pktidx = header->pktidx;
+      ++headers_read;
+
+      if (!scan_done) {
+        scanOne();
+      }
+      return true;
+    }
+
+    // Reads all data from the current block into the buffer.
+    // Returns whether the read was successful.
+    bool readData(char* buffer) {
+      if (error()) {
+        return false;
+      }
+      if (current_consumed) {
+        err << "cannot readData when data from this block has already been read";
+        return false;
+      }
+      if (!waitForCurrent()) {
+        return false;
+      }
+      memcpy(buffer, current.data->data(), current.blocsize);
+      current_consumed = true;
+      return true;
+    }
+
+    // Reads a subset of the data in the current block, defined by a frequency subband,
+    // with the same layout as Reader::readBand.
+    // Returns whether the read succeeded.
+    bool readBand(const Header& header, int band, int num_bands, char* buffer) {
+      if (error() || !waitForCurrent()) {
+        return false;
+      }
+      assert(0 == header.num_channels % num_bands);
+      assert(band < num_bands);
+      size_t band_bytes = (size_t) header.num_channels / num_bands * header.num_timesteps *
+        header.npol * 2;
+      for (int antenna = 0; antenna < header.nants; ++antenna) {
+        memcpy(buffer + antenna * band_bytes,
+               current.data->data() + (antenna * num_bands + band) * band_bytes, band_bytes);
+      }
+      return true;
+    }
+  };
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <complex>
+#include <stdint.h>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512VNNI__)
+#include <immintrin.h>
+#endif
+
+#include "header.h"
+#include "thread_pool.h"
+
+/*
+  Cross-correlating antennas.
+
+  The data is already channelized, so this is the X half of an FX correlator:
+  for every channel, every pair of antennas i <= j and every pair of
+  polarizations, it sums x_i * conj(x_j) over time. Those sums are the
+  visibilities used for calibration.
+
+  Each channel is processed a tile of timesteps at a time. A tile of every
+  antenna and polarization is unpacked into int16 arrays, small enough to stay
+  in cache while every pair is computed from it. Each input gets two of them:
+  x holds (re, im) for each timestep, and y holds (im, -re). Then for a pair
+  (a, b), re(x_a * conj(x_b)) is the dot product of x_a with x_b and im is the
+  dot product of y_a with x_b, which is exactly what the pairwise int16
+  multiply-add instructions compute. Those are used with AVX-512 VNNI or AVX2
+  when the library is compiled with them enabled, as with RAW_NATIVE. Only
+  pairs with i <= j are computed, since the rest follow from Hermitian
+  symmetry.
+*/
+
+namespace raw {
+
+  class Correlator {
+  private:
+    // Timesteps per tile.
+    static const int TILE = 256;
+
+    int nants = 0;
+    int num_channels = 0;
+    int npol = 0;
+    int64_t integrated = 0;
+    ThreadPool* pool;
+
+    // Integer sums for each channel and input pair a <= b, where an input is one
+    // antenna and polarization, as (re, im). Exact, however long the integration.
+    std::vector<int64_t> sums;
+
+    int numInputs() const {
+      return nants * npol;
+    }
+
+    int numPairs() const {
+      return numInputs() * (numInputs() + 1) / 2;
+    }
+
+    // The index of input pair (a, b) for a <= b.
+    int pairIndex(int a, int b) const {
+      return a * numInputs() - a * (a - 1) / 2 + (b - a);
+    }
+
+    // The dot products of x_a with x_b and of y_a with x_b over n int16 values.
+    static void pairSumsScalar(const int16_t* xa, const int16_t* ya, const int16_t* xb, int n,
+                               int32_t* sum_re, int32_t* sum_im) {
+      int32_t re = 0;
+      int32_t im = 0;
+      for (int k = 0; k < n; ++k) {
+        re += xa[k] * xb[k];
+        im += ya[k] * xb[k];
+      }
+      *sum_re += re;
+      *sum_im += im;
+    }
+
+#ifdef __AVX512VNNI__
+    static void pairSumsVNNI(const int16_t* xa, const int16_t* ya, const int16_t* xb, int n,
+                             int32_t* sum_re, int32_t* sum_im) {
+      __m512i re = _mm512_setzero_si512();
+      __m512i im = _mm512_setzero_si512();
+      int vector_n = n / 32 * 32;
+      for (int k = 0; k < vector_n; k += 32) {
+        __m512i b = _mm512_loadu_si512(xb + k);
+        re = _mm512_dpwssd_epi32(re, _mm512_loadu_si512(xa + k), b);
+        im = _mm512_dpwssd_epi32(im, _mm512_loadu_si512(ya + k), b);
+      }
+      // Summed through memory, since _mm512_reduce_add_epi32 trips
+      // -Wmaybe-uninitialized in some versions of gcc
+      alignas(64) int32_t lanes[2][16];
+      _mm512_store_si512(lanes[0], re);
+      _mm512_store_si512(lanes[1], im);
+      for (int j = 0; j < 16; ++j) {
+        *sum_re += lanes[0][j];
+        *sum_im += lanes[1][j];
+      }
+      pairSumsScalar(xa + vector_n, ya + vector_n, xb + vector_n, n - vector_n,
+                     sum_re, sum_im);
+    }
+#endif
+
+#ifdef __AVX2__
+    static int32_t horizontalSum(__m256i v) {
+      __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+      s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+      s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+      return _mm_cvtsi128_si32(s);
+    }
+
+    static void pairSumsAVX2(const int16_t* xa, const int16_t* ya, const int16_t* xb, int n,
+                             int32_t* sum_re, int32_t* sum_im) {
+      __m256i re = _mm256_setzero_si256();
+      __m256i im = _mm256_setzero_si256();
+      int vector_n = n / 16 * 16;
+      for (int k = 0; k < vector_n; k += 16) {
+        __m256i b = _mm256_loadu_si256((const __m256i*) (xb + k));
+        re = _mm256_add_epi32(re, _mm256_madd_epi16(
+                                _mm256_loadu_si256((const __m256i*) (xa + k)), b));
+        im = _mm256_add_epi32(im, _mm256_madd_epi16(
+                                _mm256_loadu_si256((const __m256i*) (ya + k)), b));
+      }
+      *sum_re += horizontalSum(re);
+      *sum_im += horizontalSum(im);
+      pairSumsScalar(xa + vector_n, ya + vector_n, xb + vector_n, n - vector_n,
+                     sum_re, sum_im);
+    }
+#endif
+
+    // Adds the products of one input pair over a tile to sum_re and sum_im.
+    // n is twice the number of timesteps. The int32 sums can't overflow within a
+    // tile, since each timestep adds at most 2 * 128 * 128.
+    static void pairSums(const int16_t* xa, const int16_t* ya, const int16_t* xb, int n,
+                         int32_t* sum_re, int32_t* sum_im) {
+#if defined(__AVX512VNNI__)
+      pairSumsVNNI(xa, ya, xb, n, sum_re, sum_im);
+#elif defined(__AVX2__)
+      pairSumsAVX2(xa, ya, xb, n, sum_re, sum_im);
+#else
+      pairSumsScalar(xa, ya, xb, n, sum_re, sum_im);
+#endif
+    }
+
+    // Correlates channels [first, last) of a block.
+    void correlateChannels(const char* data, int num_timesteps, int first, int last) {
+      int n = numInputs();
+      size_t row_bytes = (size_t) num_timesteps * npol * 2;
+      std::vector<int16_t> xs(n * TILE * 2);
+      std::vector<int16_t> ys(n * TILE * 2);
+
+      for (int channel = first; channel < last; ++channel) {
+        int64_t* channel_sums = sums.data() + (size_t) channel * numPairs() * 2;
+        for (int t0 = 0; t0 < num_timesteps; t0 += TILE) {
+          int steps = (num_timesteps - t0 < TILE) ? num_timesteps - t0 : TILE;
+
+          // Unpack the tile, one row per input.
+          for (int antenna = 0; antenna < nants; ++antenna) {
+            const int8_t* row = (const int8_t*) data +
+              ((size_t) antenna * num_channels + channel) * row_bytes + (size_t) t0 * npol * 2;
+            for (int pol = 0; pol < npol; ++pol) {
+              int16_t* x = xs.data() + (antenna * npol + pol) * TILE * 2;
+              int16_t* y = ys.data() + (antenna * npol + pol) * TILE * 2;
+              for (int t = 0; t < steps; ++t) {
+                int16_t re = row[(t * npol + pol) * 2];
+                int16_t im = row[(t * npol + pol) * 2 + 1];
+                x[2 * t] = re;
+                x[2 * t + 1] = im;
+                y[2 * t] = im;
+                y[2 * t + 1] = -re;
+              }
+            }
+          }
+
+          for (int a = 0; a < n; ++a) {
+            const int16_t* xa = xs.data() + a * TILE * 2;
+            const int16_t* ya = ys.data() + a * TILE * 2;
+            for (int b = a; b < n; ++b) {
+              int32_t sum_re = 0;
+              int32_t sum_im = 0;
+              pairSums(xa, ya, xs.data() + b * TILE * 2, steps * 2, &sum_re, &sum_im);
+              int64_t* s = channel_sums + pairIndex(a, b) * 2;
+              s[0] += sum_re;
+              s[1] += sum_im;
+            }
+          }
+        }
+      }
+    }
+
+  public:
+    // Channels are correlated in parallel on the pool, if one is provided.
+    explicit Correlator(ThreadPool* pool = nullptr) : pool(pool) {}
+
+    // The number of antenna pairs i <= j, including each antenna with itself.
+    static int numBaselines(int nants) {
+      return nants * (nants + 1) / 2;
+    }
+
+    // The index of baseline (i, j) for i <= j, in the order (0, 0), (0, 1), ...,
+    // (0, nants - 1), (1, 1), and so on.
+    static int baselineIndex(int nants, int i, int j) {
+      return i * nants - i * (i - 1) / 2 + (j - i);
+    }
+
+    // How many timesteps have been integrated since the last reset.
+    int64_t integratedTimesteps() const {
+      return integrated;
+    }
+
+    void reset() {
+      std::fill(sums.begin(), sums.end(), 0);
+      integrated = 0;
+    }
+
+    // Adds a block, or a readBand band, to the integration.
+    // Returns false without adding it if its shape doesn't match what has already
+    // been integrated.
+    bool add(const BlockShape& shape, const char* data) {
+      if (integrated > 0 && (shape.nants != nants || shape.num_channels != num_channels ||
+                             shape.npol != npol)) {
+        return false;
+      }
+      if (integrated == 0) {
+        nants = shape.nants;
+        num_channels = shape.num_channels;
+        npol = shape.npol;
+        sums.assign((size_t) num_channels * numPairs() * 2, 0);
+      }
+      forRanges(pool, num_channels, [&](int first, int last) {
+        correlateChannels(data, shape.num_timesteps, first, last);
+      });
+      integrated += shape.num_timesteps;
+      return true;
+    }
+
+    bool add(const Header& header, const char* data) {
+      return add(BlockShape(header), data);
+    }
+
+    /*
+      The mean of x_i * conj(x_j) over the integrated timesteps.
+
+      out is resized and indexed [channel][baseline][pol_i][pol_j], with baselines
+      numbered by baselineIndex.
+    */
+    void visibilities(std::vector<std::complex<float> >* out) const {
+      int baselines = numBaselines(nants);
+      out->assign((size_t) num_channels * baselines * npol * npol, 0);
+      if (integrated == 0) {
+        return;
+      }
+      double scale = 1.0 / integrated;
+      for (int channel = 0; channel < num_channels; ++channel) {
+        const int64_t* channel_sums = sums.data() + (size_t) channel * numPairs() * 2;
+        for (int i = 0; i < nants; ++i) {
+          for (int j = i; j < nants; ++j) {
+            std::complex<float>* v = out->data() +
+              ((size_t) channel * baselines + baselineIndex(nants, i, j)) * npol * npol;
+            for (int p = 0; p < npol; ++p) {
+              for (int q = 0; q < npol; ++q) {
+                int a = i * npol + p;
+                int b = j * npol + q;
+                if (a <= b) {
+                  const int64_t* s = channel_sums + pairIndex(a, b) * 2;
+                  v[p * npol + q] = std::complex<float>(s[0] * scale, s[1] * scale);
+                } else {
+                  // Only happens for an antenna with itself, where (b, a) was computed
+                  const int64_t* s = channel_sums + pairIndex(b, a) * 2;
+                  v[p * npol + q] = std::complex<float>(s[0] * scale, -s[1] * scale);
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  };
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+
+#include "header.h"
+#include "thread_pool.h"
+
+/*
+  Reducing the time resolution of a stream of blocks.
+
+  A Decimator combines every factor consecutive timesteps into one output
+  sample, either by integrating power or by averaging voltages. The int8 data
+  is decoded as it is accumulated, so no full-resolution float copy of a block
+  is ever made.
+
+  The timesteps that don't fill a whole output sample at the end of a block are
+  carried over into the next block, so the output is the same however the
+  input is split into blocks.
+*/
+
+namespace raw {
+
+  enum class DecimateMode {
+    // Sums re^2 + im^2 over the timesteps. Output is one float per sample.
+    POWER,
+
+    // Averages re and im over the timesteps. Output is two floats per sample,
+    // re then im.
+    VOLTAGE,
+  };
+
+  /*
+    The typical workflow:
+
+      raw::Reader reader(filename);
+      raw::Header header;
+      raw::Decimator decimator(64, raw::DecimateMode::POWER);
+      std::vector<char> data;
+      std::vector<float> output;
+      while (reader.readHeader(&header)) {
+        data.resize(header.blocsize);
+        reader.readData(data.data());
+        int n = decimator.process(header, data.data(), &output);
+        handleOutput(output, n);
+      }
+  */
+  class Decimator {
+  private:
+    int factor;
+    DecimateMode mode;
+    bool sum_pols;
+    ThreadPool* pool;
+
+    // The shape of the blocks the partial sums came from.
+    int nants = 0;
+    int num_channels = 0;
+    int npol = 0;
+
+    // Sums for the output sample in progress, indexed [antenna][channel][pol][component].
+    std::vector<float> partial;
+
+    // How many timesteps are already in partial.
+    int partial_count = 0;
+
+    int components() const {
+      return mode == DecimateMode::POWER ? 1 : 2;
+    }
+
+    // Adds steps timesteps from row into sums, which has npol * components() entries.
+    void accumulate(const int8_t* row, int steps, float* sums) const {
+      if (mode == DecimateMode::POWER) {
+        for (int t = 0; t < steps; ++t) {
+          for (int pol = 0; pol < npol; ++pol) {
+            int re = row[0];
+            int im = row[1];
+            sums[pol] += (float) (re * re + im * im);
+            row += 2;
+          }
+        }
+      } else {
+        int width = 2 * npol;
+        for (int t = 0; t < steps; ++t) {
+          for (int i = 0; i < width; ++i) {
+            sums[i] += row[i];
+          }
+          row += width;
+        }
+      }
+    }
+
+    // Writes out one finished sample from sums and clears sums.
+    void finish(float* sums, float* out) const {
+      int width = npol * components();
+      if (mode == DecimateMode::POWER && sum_pols) {
+        float total = 0;
+        for (int pol = 0; pol < npol; ++pol) {
+          total += sums[pol];
+        }
+        out[0] = total;
+      } else {
+        float scale = (mode == DecimateMode::VOLTAGE) ? 1.0f / factor : 1.0f;
+        for (int i = 0; i < width; ++i) {
+          out[i] = sums[i] * scale;
+        }
+      }
+      std::fill(sums, sums + width, 0.0f);
+    }
+
+  public:
+    // sum_pols adds the polarizations together, and only applies to POWER.
+    // Rows of each block are processed in parallel on the pool, if one is provided.
+    Decimator(int factor, DecimateMode mode = DecimateMode::POWER, bool sum_pols = false,
+              ThreadPool* pool = nullptr)
+      : factor(factor), mode(mode), sum_pols(sum_pols && mode == DecimateMode::POWER),
+        pool(pool) {
+      assert(factor > 0);
+    }
+
+    // The number of floats in each output sample.
+    int outputWidth() const {
+      return (sum_pols ? 1 : npol) * components();
+    }
+
+    // How many timesteps are waiting for the next block to finish a sample.
+    int pending() const {
+      return partial_count;
+    }
+
+    // Drops any partially accumulated sample.
+    void reset() {
+      std::fill(partial.begin(), partial.end(), 0.0f);
+      partial_count = 0;
+    }
+
+    /*
+      Decimates one block, returning the number of output timesteps it completed.
+
+      output is resized and indexed [antenna][channel][time][pol][component], where
+      there are outputWidth() floats per time and the pol index is missing when
+      polarizations are summed.
+
+      A partial sample is dropped rather than carried across a gap in the data,
+      meaning a block with missing_blocks set, or a change in the block dimensions.
+    */
+    int process(const Header& header, const char* data, std::vector<float>* output) {
+      if (header.nants != nants || header.num_channels != num_channels ||
+          (int) header.npol != npol) {
+        nants = header.nants;
+        num_channels = header.num_channels;
+        npol = header.npol;
+        partial.assign((size_t) nants * num_channels * npol * components(), 0.0f);
+        partial_count = 0;
+      } else if (header.missing_blocks > 0) {
+        reset();
+      }
+
+      int num_timesteps = header.num_timesteps;
+      int num_out = (partial_count + num_timesteps) / factor;
+      int rows = nants * num_channels;
+      int out_width = outputWidth();
+      int sums_width = npol * components();
+      size_t row_bytes = (size_t) num_timesteps * npol * 2;
+      output->resize((size_t) rows * num_out * out_width);
+
+      int start_count = partial_count;
+      forRanges(pool, rows, [&](int first, int last) {
+        for (int r = first; r < last; ++r) {
+          const int8_t* row = (const int8_t*) data + r * row_bytes;
+          float* sums = partial.data() + (size_t) r * sums_width;
+          float* out = output->data() + (size_t) r * num_out * out_width;
+          int count = start_count;
+          int t = 0;
+          while (t < num_timesteps) {
+            int steps = std::min(factor - count, num_timesteps - t);
+            accumulate(row + (size_t) t * npol * 2, steps, sums);
+            t += steps;
+            count += steps;
+            if (count == factor) {
+              finish(sums, out);
+              out += out_width;
+              count = 0;
+            }
+          }
+        }
+      });
+      partial_count = (partial_count + num_timesteps) % factor;
+      return num_out;
+    }
+  };
+}
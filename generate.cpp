@@ -0,0 +1,90 @@
+#include <iostream>
+#include <set>
+#include <string.h>
+
+#include "raw.h"
+
+using namespace std;
+
+void usage() {
+  cerr << "usage: generate <file.raw> [--nants N] [--obsnchan N] [--npol N] [--nbits N]\n"
+       << "                [--blocsize BYTES] [--blocks N] [--gap-every N]\n"
+       << "                [--piperblk N] [--seed N] [--directio] [--crc]\n";
+}
+
+// Writes a synthetic raw file, for testing and benchmarking.
+int main(int argc, char* argv[]) {
+  raw::SyntheticOptions options;
+  string filename;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    if (arg == "--directio") {
+      options.directio = true;
+      continue;
+    }
+    if (arg == "--crc") {
+      options.checksums = true;
+      continue;
+    }
+    if (arg == "--help") {
+      usage();
+      exit(0);
+    }
+    if (arg.size() > 2 && arg.substr(0, 2) == "--") {
+      static const set<string> value_flags = {
+        "nants", "obsnchan", "npol", "nbits", "blocsize", "blocks", "gap-every",
+        "piperblk", "seed"
+      };
+      string flag = arg.substr(2);
+      if (value_flags.count(flag) == 0) {
+        cerr << "unknown flag: " << arg << endl;
+        usage();
+        exit(1);
+      }
+      if (i + 1 >= argc) {
+        cerr << "missing value for " << arg << endl;
+        usage();
+        exit(1);
+      }
+      long value = strtol(argv[++i], NULL, 0);
+      if (flag == "nants") {
+        options.nants = value;
+      } else if (flag == "obsnchan") {
+        options.obsnchan = value;
+      } else if (flag == "npol") {
+        options.npol = value;
+      } else if (flag == "nbits") {
+        options.nbits = value;
+      } else if (flag == "blocsize") {
+        options.blocsize = value;
+      } else if (flag == "blocks") {
+        options.num_blocks = value;
+      } else if (flag == "gap-every") {
+        options.gap_every = value;
+      } else if (flag == "piperblk") {
+        options.piperblk = value;
+      } else if (flag == "seed") {
+        options.seed = value;
+      }
+      continue;
+    }
+    if (!filename.empty()) {
+      filename.clear();
+      break;
+    }
+    filename = arg;
+  }
+
+  if (filename.empty()) {
+    usage();
+    exit(1);
+  }
+
+  string error_message;
+  if (!raw::writeSyntheticFile(filename, options, &error_message)) {
+    cerr << "error: " << error_message << endl;
+    exit(1);
+  }
+  cout << "wrote " << options.num_blocks << " blocks to " << filename << endl;
+}
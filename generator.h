@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "error_message.h"
+#include "writer.h"
+
+// Generates synthetic .raw files, so that tests and benchmarks can run
+// without access to real recordings.
+
+namespace raw {
+
+  struct SyntheticOptions {
+    // The "NANTS" header.
+    int nants = 1;
+
+    // The "OBSNCHAN" header. This counts every antenna's channels, so it must be
+    // divisible by nants.
+    int obsnchan = 64;
+
+    // The "NPOL" header.
+    int npol = 2;
+
+    // The "NBITS" header.
+    int nbits = 8;
+
+    // The "OBSBW" header, in MHz. Negative means the channels are stored from the
+    // highest frequency down.
+    double obsbw = 187.5;
+
+    // The "BLOCSIZE" header, in bytes. Must be a whole number of timesteps.
+    size_t blocsize = 64 * 2 * 2 * 1024;
+
+    // Whether to pad headers for O_DIRECT.
+    bool directio = false;
+
+    // Whether to write a DATACRC card for each block.
+    bool checksums = false;
+
+    // The number of blocks actually written to the file.
+    int num_blocks = 16;
+
+    // If this is positive, the PKTIDX sequence skips a block after every
+    // gap_every blocks that are written, as if the recorder dropped it.
+    int gap_every = 0;
+
+    // The "PIPERBLK" header. PKTIDX advances by this much per block.
+    int piperblk = 8192;
+
+    // Seeds the pseudorandom data.
+    uint32_t seed = 1;
+
+    // The number of bytes in each timestep, across all antennas and channels.
+    size_t bytesPerTimestep() const {
+      return 2 * (size_t) npol * obsnchan * nbits / 8;
+    }
+
+    // The PKTIDX of the nth block that is written.
+    long pktidx(int block) const {
+      long skipped = (gap_every > 0) ? block / gap_every : 0;
+      return (block + skipped) * (long) piperblk;
+    }
+
+    // The number of blocks that the PKTIDX gaps leave out.
+    int numMissingBlocks() const {
+      return (gap_every > 0) ? (num_blocks - 1) / gap_every : 0;
+    }
+  };
+
+  // Fills buffer with the data for one block of a synthetic file.
+  // This is a deterministic function of the options and block number, so readers
+  // can check what they got.
+  // The data is noise plus a tone in channel 1 of each antenna, which makes
+  // dimension mixups visible.
+  inline void syntheticData(const SyntheticOptions& options, int block, char* buffer) {
+    uint32_t state = options.seed * 2654435761u + block * 40503u + 1;
+    for (size_t i = 0; i < options.blocsize; ++i) {
+      // xorshift32
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      buffer[i] = (char) (state >> 24) / 8;
+    }
+
+    int channels = options.obsnchan / options.nants;
+    size_t timesteps = options.blocsize / options.bytesPerTimestep();
+    if (channels < 2 || options.nbits != 8) {
+      return;
+    }
+    for (int antenna = 0; antenna < options.nants; ++antenna) {
+      char* row = buffer + (antenna * channels + 1) * timesteps * options.npol * 2;
+      for (size_t t = 0; t < timesteps; ++t) {
+        for (int pol = 0; pol < options.npol; ++pol) {
+          row[(t * options.npol + pol) * 2] += 64;
+        }
+      }
+    }
+  }
+
+  // The header cards for one block of a synthetic file.
+  inline HeaderCards syntheticHeader(const SyntheticOptions& options, int block) {
+    HeaderCards cards;
+    cards.set("TELESCOP", "SYNTHETIC");
+    cards.set("SRC_NAME", "SYNTH_SRC");
+    cards.set("NPOL", options.npol);
+    cards.set("OBSNCHAN", options.obsnchan);
+    cards.set("NANTS", options.nants);
+    cards.set("NBITS", options.nbits);
+    cards.set("OBSFREQ", 1500.0);
+    cards.set("OBSBW", options.obsbw);
+    cards.set("CHAN_BW", options.obsbw / (options.obsnchan / options.nants));
+    cards.set("TBIN", 0.000341333);
+    cards.set("RA_STR", "04:08:00.0000");
+    cards.set("DEC_STR", "-15:00:00.0000");
+    cards.set("STT_IMJD", 59711);
+    cards.set("STT_SMJD", 53086);
+    cards.set("SYNCTIME", 1652363000L);
+    cards.set("PIPERBLK", options.piperblk);
+    cards.set("PKTIDX", options.pktidx(block));
+    cards.set("BEAM_ID", -1);
+    return cards;
+  }
+
+  // Writes a synthetic .raw file.
+  // Returns whether it worked. If it didn't, the error is written to error_message.
+  inline bool writeSyntheticFile(const std::string& filename, const SyntheticOptions& options,
+                                 std::string* error_message = nullptr) {
+    ErrorMessage err;
+    if (options.nants <= 0 || options.obsnchan % options.nants != 0) {
+      err << "obsnchan " << options.obsnchan << " is not divisible by nants " << options.nants;
+    } else if (options.obsnchan <= 0 || options.npol <= 0 || options.nbits <= 0) {
+      err << "obsnchan, npol and nbits must be positive";
+    } else if (options.bytesPerTimestep() == 0) {
+      err << "a timestep of " << options.obsnchan << " channels, " << options.npol
+          << " pols and " << options.nbits << " bits is less than a byte";
+    } else if (options.blocsize == 0) {
+      err << "blocsize must be positive";
+    } else if (options.num_blocks < 0) {
+      err << "the number of blocks must not be negative";
+    } else if (options.blocsize % options.bytesPerTimestep() != 0) {
+      err << "blocsize " << options.blocsize << " is not divisible by "
+          << options.bytesPerTimestep();
+    } else {
+      Writer writer(filename, options.directio);
+      writer.writeChecksums(options.checksums);
+      std::vector<char> data(options.blocsize);
+      for (int block = 0; block < options.num_blocks; ++block) {
+        syntheticData(options, block, data.data());
+        if (!writer.writeBlock(syntheticHeader(options, block), data.data(), data.size())) {
+          break;
+        }
+      }
+      if (writer.error()) {
+        err << writer.errorMessage();
+      }
+    }
+    if (err.used && error_message != nullptr) {
+      *error_message = err;
+    }
+    return !err.used;
+  }
+}
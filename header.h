@@ -75,6 +75,16 @@ namespace raw {
     // This is an index that counts up through the file, to let us detect missing blocks.
     long pktidx;
 
+    // The number of blocks that were skipped between the previous header and this one,
+    // as detected by a jump in PKTIDX. Zero for the first header.
+    // This isn't a FITS header; it is calculated by the Reader.
+    int missing_blocks;
+
+    // The "DATACRC" FITS header.
+    // The CRC32C of the data block, as written by a Writer with checksums on.
+    // -1 when it isn't present. See checksum.h.
+    long datacrc;
+
     // The "OBSFREQ" FITS header.
     // This is the center frequency of the entire range of frequencies
     // stored in the file, in MHz.
@@ -233,4 +243,29 @@ namespace raw {
     }
   };
 
+  // The dimensions of data in the data[antenna][channel][time][pol] layout.
+  struct BlockShape {
+    int nants;
+    int num_channels;
+    int num_timesteps;
+    int npol;
+
+    BlockShape(int nants, int num_channels, int num_timesteps, int npol)
+      : nants(nants), num_channels(num_channels), num_timesteps(num_timesteps), npol(npol) {}
+
+    // The shape of a whole block.
+    explicit BlockShape(const Header& header)
+      : BlockShape(header.nants, header.num_channels, header.num_timesteps, header.npol) {}
+
+    // The shape of what readBand returns.
+    static BlockShape forBand(const Header& header, int num_bands) {
+      return BlockShape(header.nants, header.num_channels / num_bands, header.num_timesteps,
+                        header.npol);
+    }
+
+    // The number of complex values in one antenna and channel.
+    size_t rowSize() const {
+      return (size_t) num_timesteps * npol;
+    }
+  };
 }
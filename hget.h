@@ -940,9 +940,9 @@ typedef unsigned long long uint8;
   //                   the n'th token in the value is returned.
   //                   (the first 8 characters must be unique) */
   {
-    // Since we return cval (via value), it must be static (but that doesn't
-    // make it thread safe).
-    static char cval[80];
+    // Since we return cval (via value), it must be static. It is thread_local so
+    // that headers can be parsed on several threads at once.
+    static thread_local char cval[80];
     char *value;
     char cwhite[2];
     char squot[2], dquot[2], lbracket[2], rbracket[2], slash[2], comma[2];
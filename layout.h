@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+#include "block_view.h"
+#include "header.h"
+
+/*
+  Index math for the data[antenna][channel][time][pol] layout, with the
+  polarization count and sample size fixed at compile time.
+
+  With NPOL known, the stride between timesteps is a constant, so a loop over
+  time and polarization can be fully unrolled and vectorized. Use withLayout
+  to pick the right specialization for a header at runtime:
+
+    raw::withLayout(header, [&](auto layout) {
+      for (int t = 0; t < layout.num_timesteps; ++t) {
+        for (int pol = 0; pol < layout.npol; ++pol) {
+          raw::Sample s = layout.at(data, antenna, channel, t, pol);
+          ...
+        }
+      }
+    });
+*/
+
+namespace raw {
+
+  template<int NPOL, int NBITS = 8>
+  struct BlockLayout {
+    static_assert(NPOL == 1 || NPOL == 2, "npol must be 1 or 2");
+    static_assert(NBITS == 8, "only 8-bit samples are supported");
+
+    static constexpr int npol = NPOL;
+    static constexpr int nbits = NBITS;
+
+    // Bytes in one complex sample, and in one timestep of every polarization.
+    static constexpr size_t sample_bytes = 2 * NBITS / 8;
+    static constexpr size_t timestep_bytes = NPOL * sample_bytes;
+
+    int nants;
+    int num_channels;
+    int num_timesteps;
+
+    explicit BlockLayout(const BlockShape& shape)
+      : nants(shape.nants), num_channels(shape.num_channels),
+        num_timesteps(shape.num_timesteps) {}
+
+    explicit BlockLayout(const Header& header) : BlockLayout(BlockShape(header)) {}
+
+    // Bytes in all the timesteps of one antenna and channel.
+    size_t rowBytes() const {
+      return num_timesteps * timestep_bytes;
+    }
+
+    // The byte offset of data[antenna][channel][t][pol].
+    size_t offset(int antenna, int channel, int t, int pol) const {
+      return ((size_t) antenna * num_channels + channel) * rowBytes() + t * timestep_bytes +
+        pol * sample_bytes;
+    }
+
+    // The start of the row for one antenna and channel.
+    const int8_t* row(const char* data, int antenna, int channel) const {
+      return (const int8_t*) data + ((size_t) antenna * num_channels + channel) * rowBytes();
+    }
+
+    // The value of data[antenna][channel][t][pol].
+    Sample at(const char* data, int antenna, int channel, int t, int pol) const {
+      const char* p = data + offset(antenna, channel, t, pol);
+      return Sample{(int8_t) p[0], (int8_t) p[1]};
+    }
+  };
+
+  template<int NPOL, int NBITS>
+  constexpr int BlockLayout<NPOL, NBITS>::npol;
+
+  template<int NPOL, int NBITS>
+  constexpr int BlockLayout<NPOL, NBITS>::nbits;
+
+  template<int NPOL, int NBITS>
+  constexpr size_t BlockLayout<NPOL, NBITS>::sample_bytes;
+
+  template<int NPOL, int NBITS>
+  constexpr size_t BlockLayout<NPOL, NBITS>::timestep_bytes;
+
+  // Calls f with the BlockLayout that matches the shape's npol and nbits.
+  // Returns false without calling f if there's no specialization for them.
+  template<typename F>
+  bool withLayout(const BlockShape& shape, int nbits, F&& f) {
+    if (nbits != 8) {
+      return false;
+    }
+    switch (shape.npol) {
+    case 1:
+      f(BlockLayout<1>(shape));
+      return true;
+    case 2:
+      f(BlockLayout<2>(shape));
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  template<typename F>
+  bool withLayout(const Header& header, F&& f) {
+    return withLayout(BlockShape(header), header.nbits, std::forward<F>(f));
+  }
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_reader.h"
+#include "error_message.h"
+#include "header.h"
+#include "reader.h"
+
+/*
+  Reading several recordings of the same time span together, such as the
+  beams of a multi-beam receiver or the subbands written by different compute
+  nodes, one block of each at a time.
+
+  Each stream is read ahead on its own I/O thread, into a small queue of block
+  buffers, so the streams are read concurrently. Blocks are matched up by
+  PKTIDX. A stream that skipped a block, because its recorder dropped it, is
+  handled according to require_all:
+
+    - true: times that any stream is missing are skipped, and the other
+      streams' blocks for them are dropped.
+    - false: every time that any stream has is returned, with nullptr for the
+      streams that don't have it.
+
+    raw::MultiStreamReader reader(filenames);
+    std::vector<const raw::AsyncBlock*> blocks;
+    while (reader.next(&blocks)) {
+      // blocks[i] is stream i's block at reader.pktidx()
+    }
+    if (reader.error()) { ... }
+*/
+
+namespace raw {
+
+  class MultiStreamReader {
+  private:
+    typedef std::unique_ptr<AsyncBlock, AlignedDelete<AsyncBlock> > BlockPtr;
+
+    struct Stream {
+      Reader reader;
+      std::thread thread;
+      std::mutex mutex;
+      std::condition_variable changed;
+
+      // Blocks that have been read and not yet matched up.
+      std::deque<BlockPtr> ready;
+
+      // Buffers free for the I/O thread to read into.
+      std::vector<BlockPtr> spare;
+
+      // Whether the I/O thread has hit the end of the file or an error.
+      bool done = false;
+
+      // Tells the I/O thread to exit.
+      bool stopping = false;
+
+      // The block handed to the caller by the last next, if any.
+      BlockPtr current;
+
+      // Blocks dropped because other streams didn't have their time.
+      int dropped = 0;
+
+      explicit Stream(const std::string& filename) : reader(filename) {}
+    };
+
+    std::vector<std::unique_ptr<Stream> > streams;
+    bool require_all;
+    long current_pktidx = -1;
+
+    // Once err is used, the reader is in "error state".
+    ErrorMessage err = ErrorMessage();
+
+    // Runs on a stream's I/O thread.
+    void readAhead(Stream* s) {
+      while (true) {
+        BlockPtr block;
+        {
+          std::unique_lock<std::mutex> lock(s->mutex);
+          s->changed.wait(lock, [&]() { return s->stopping || !s->spare.empty(); });
+          if (s->stopping) {
+            break;
+          }
+          block = std::move(s->spare.back());
+          s->spare.pop_back();
+        }
+
+        bool ok = s->reader.readHeader(&block->header);
+        if (ok) {
+          block->data.resize(block->header.blocsize);
+          ok = s->reader.readData(block->data.data());
+        }
+
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (!ok) {
+          s->done = true;
+          s->changed.notify_all();
+          return;
+        }
+        s->ready.push_back(std::move(block));
+        s->changed.notify_all();
+      }
+      std::lock_guard<std::mutex> lock(s->mutex);
+      s->done = true;
+    }
+
+    // Waits until a stream has a block ready or is done.
+    // Returns whether it has another block, and if so sets pktidx to its PKTIDX.
+    bool peek(Stream* s, long* pktidx) {
+      std::unique_lock<std::mutex> lock(s->mutex);
+      s->changed.wait(lock, [&]() { return s->done || !s->ready.empty(); });
+      if (s->ready.empty()) {
+        return false;
+      }
+      *pktidx = s->ready.front()->header.pktidx;
+      return true;
+    }
+
+    // Takes the next block from a stream's queue.
+    BlockPtr take(Stream* s) {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      BlockPtr block = std::move(s->ready.front());
+      s->ready.pop_front();
+      return block;
+    }
+
+    // Hands a buffer back to a stream's I/O thread.
+    void recycle(Stream* s, BlockPtr block) {
+      if (block == nullptr) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(s->mutex);
+      s->spare.push_back(std::move(block));
+      s->changed.notify_all();
+    }
+
+    // Checks whether any stream stopped with an error, recording the first one.
+    bool checkErrors() {
+      for (auto& s : streams) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (s->done && s->ready.empty() && s->reader.error()) {
+          err << s->reader.errorMessage();
+          return true;
+        }
+      }
+      return false;
+    }
+
+  public:
+    // Starts reading every file on its own thread.
+    // queue_depth is how many blocks each stream reads ahead, and is at least 1,
+    // since a stream with no buffer to read into would never produce a block.
+    MultiStreamReader(const std::vector<std::string>& filenames, bool require_all = true,
+                      int queue_depth = 2)
+      : require_all(require_all) {
+      queue_depth = std::max(queue_depth, 1);
+      for (auto& filename : filenames) {
+        streams.emplace_back(new Stream(filename));
+        Stream* s = streams.back().get();
+        for (int i = 0; i < queue_depth; ++i) {
+          s->spare.push_back(makeAligned<AsyncBlock>());
+        }
+      }
+      for (auto& s : streams) {
+        Stream* p = s.get();
+        s->thread = std::thread([this, p]() { readAhead(p); });
+      }
+    }
+
+    MultiStreamReader(const MultiStreamReader&) = delete;
+    MultiStreamReader& operator=(MultiStreamReader&) = delete;
+
+    ~MultiStreamReader() {
+      for (auto& s : streams) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->stopping = true;
+        s->changed.notify_all();
+      }
+      for (auto& s : streams) {
+        s->thread.join();
+      }
+    }
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used;
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err;
+    }
+
+    int numStreams() const {
+      return streams.size();
+    }
+
+    // The PKTIDX of the blocks from the last next.
+    long pktidx() const {
+      return current_pktidx;
+    }
+
+    // How many blocks of a stream were dropped because another stream was missing
+    // their time. Always zero when require_all is false.
+    int dropped(int stream) const {
+      return streams[stream]->dropped;
+    }
+
+    // Gets the next set of time-aligned blocks, one per stream in the order the
+    // files were given. The blocks are valid until the next call.
+    // Returns false at the end of the data or on an error. Check error() to tell
+    // which.
+    bool next(std::vector<const AsyncBlock*>* blocks) {
+      if (error()) {
+        return false;
+      }
+      for (auto& s : streams) {
+        recycle(s.get(), std::move(s->current));
+      }
+
+      while (true) {
+        // Find the range of times at the front of the streams.
+        std::vector<long> fronts(streams.size());
+        std::vector<bool> has_block(streams.size());
+        bool any_block = false;
+        bool all_blocks = true;
+        long lowest = 0;
+        long highest = 0;
+        for (size_t i = 0; i < streams.size(); ++i) {
+          has_block[i] = peek(streams[i].get(), &fronts[i]);
+          if (!has_block[i]) {
+            all_blocks = false;
+            continue;
+          }
+          lowest = (!any_block || fronts[i] < lowest) ? fronts[i] : lowest;
+          highest = (!any_block || fronts[i] > highest) ? fronts[i] : highest;
+          any_block = true;
+        }
+        if (checkErrors()) {
+          return false;
+        }
+        if (!any_block || (require_all && !all_blocks)) {
+          return false;
+        }
+
+        if (require_all && lowest != highest) {
+          // Drop the blocks that are behind, since some stream lacks their time.
+          for (size_t i = 0; i < streams.size(); ++i) {
+            if (fronts[i] < highest) {
+              recycle(streams[i].get(), take(streams[i].get()));
+              ++streams[i]->dropped;
+            }
+          }
+          continue;
+        }
+
+        current_pktidx = lowest;
+        blocks->assign(streams.size(), nullptr);
+        for (size_t i = 0; i < streams.size(); ++i) {
+          if (has_block[i] && fronts[i] == lowest) {
+            streams[i]->current = take(streams[i].get());
+            (*blocks)[i] = streams[i]->current.get();
+          }
+        }
+        return true;
+      }
+    }
+  };
+}
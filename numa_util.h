@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <fcntl.h>
+#include <functional>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Helpers for placing threads and buffers on particular NUMA nodes.
+//
+// These talk to the kernel directly, through sysfs and the mbind/getcpu syscalls,
+// so that we don't pick up a dependency on libnuma. On a machine with a single
+// node, or one where the NUMA information isn't available, everything here
+// degrades to a no-op that reports success.
+
+namespace raw {
+  namespace numa {
+    // Values from linux/mempolicy.h, which isn't always installed.
+    const int MPOL_PREFERRED_MODE = 1;
+    const int MPOL_BIND_MODE = 2;
+    const unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+
+    // Parses a sysfs cpu list like "0-3,8-11" into a list of cpu numbers.
+    inline std::vector<int> parseCpuList(const std::string& text) {
+      std::vector<int> cpus;
+      size_t pos = 0;
+      while (pos < text.size()) {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos) {
+          end = text.size();
+        }
+        std::string range = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (range.empty() || range[0] < '0' || range[0] > '9') {
+          continue;
+        }
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = (dash == std::string::npos) ? first : atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu) {
+          cpus.push_back(cpu);
+        }
+      }
+      return cpus;
+    }
+
+    // Reads a small sysfs file into a string. Returns "" if it doesn't exist.
+    inline std::string readSysfs(const std::string& path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return "";
+      }
+      char buf[4096];
+      ssize_t n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      if (n <= 0) {
+        return "";
+      }
+      buf[n] = '\0';
+      return std::string(buf);
+    }
+
+    // The ids of the online NUMA nodes, in order. They needn't be contiguous, as
+    // on a machine with nodes 0 and 2.
+    // This is just node 0 when the kernel doesn't expose any NUMA information.
+    inline const std::vector<int>& onlineNodes() {
+      static const std::vector<int> answer = []() {
+        std::vector<int> nodes = parseCpuList(readSysfs("/sys/devices/system/node/online"));
+        return nodes.empty() ? std::vector<int>(1, 0) : nodes;
+      }();
+      return answer;
+    }
+
+    // The number of NUMA nodes on this machine.
+    inline int numNodes() {
+      return onlineNodes().size();
+    }
+
+    // The id of the node that the index-th of a list of per-node tasks or buffer
+    // groups goes on. Indexes past the last node wrap around.
+    inline int nodeId(int index) {
+      const std::vector<int>& nodes = onlineNodes();
+      return nodes[index % nodes.size()];
+    }
+
+    // The cpus that belong to a node. Empty if we don't know.
+    inline std::vector<int> nodeCpus(int node) {
+      return parseCpuList(readSysfs("/sys/devices/system/node/node" +
+                                    std::to_string(node) + "/cpulist"));
+    }
+
+    // The node that the calling thread is currently running on.
+    inline int currentNode() {
+      unsigned cpu = 0;
+      unsigned node = 0;
+      if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+      }
+      return node;
+    }
+
+    // Restricts the calling thread to the cpus of the given node.
+    // Returns whether it worked. On single-node machines this does nothing.
+    inline bool bindThreadToNode(int node) {
+      if (numNodes() <= 1) {
+        return true;
+      }
+      std::vector<int> cpus = nodeCpus(node);
+      if (cpus.empty()) {
+        return false;
+      }
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+      }
+      return 0 == sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    // Sets the memory policy of [addr, addr + length) so its pages live on the node.
+    // addr must be page-aligned. Pages that are already resident get migrated.
+    // Returns whether it worked. On single-node machines this does nothing.
+    inline bool placeOnNode(void* addr, size_t length, int node) {
+      if (numNodes() <= 1 || length == 0) {
+        return true;
+      }
+      const std::vector<int>& nodes = onlineNodes();
+      if (std::find(nodes.begin(), nodes.end(), node) == nodes.end()) {
+        return false;
+      }
+      std::vector<unsigned long> mask((nodes.back() + 64) / 64, 0);
+      mask[node / 64] |= 1UL << (node % 64);
+      long rc = syscall(SYS_mbind, addr, length, MPOL_BIND_MODE, mask.data(),
+                        mask.size() * 64 + 1, MPOL_MF_MOVE_FLAG);
+      return rc == 0;
+    }
+
+    // Writes one byte per page so that the pages get faulted in.
+    // With the default first-touch policy they land on the node of the calling thread.
+    inline void firstTouch(char* addr, size_t length) {
+      size_t page = sysconf(_SC_PAGESIZE);
+      for (size_t i = 0; i < length; i += page) {
+        addr[i] = 0;
+      }
+    }
+
+    /*
+      A page-aligned buffer whose memory lives on a specific NUMA node.
+
+      The memory is mapped, bound to the node, and then touched, so it is
+      resident on that node before any I/O happens into it. Use node = -1 to just
+      get a page-aligned buffer that is first-touched by the calling thread.
+    */
+    class NodeBuffer {
+    private:
+      char* ptr = nullptr;
+      size_t length = 0;
+
+    public:
+      int node = -1;
+
+      NodeBuffer() {}
+
+      NodeBuffer(size_t size, int node) : node(node) {
+        if (size == 0) {
+          return;
+        }
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+          return;
+        }
+        ptr = (char*) p;
+        length = size;
+        if (node >= 0) {
+          placeOnNode(ptr, length, node);
+        }
+        firstTouch(ptr, length);
+      }
+
+      NodeBuffer(const NodeBuffer&) = delete;
+      NodeBuffer& operator=(const NodeBuffer&) = delete;
+
+      NodeBuffer(NodeBuffer&& other) {
+        *this = std::move(other);
+      }
+
+      NodeBuffer& operator=(NodeBuffer&& other) {
+        std::swap(ptr, other.ptr);
+        std::swap(length, other.length);
+        std::swap(node, other.node);
+        return *this;
+      }
+
+      ~NodeBuffer() {
+        if (ptr != nullptr) {
+          munmap(ptr, length);
+        }
+      }
+
+      char* data() const {
+        return ptr;
+      }
+
+      size_t size() const {
+        return length;
+      }
+    };
+
+    // Runs tasks[i] on a thread bound to node nodeId(i), one thread per list, and
+    // waits for them all. Returns whether every task succeeded.
+    inline bool runOnNodes(const std::vector<std::vector<std::function<bool()> > >& tasks) {
+      std::vector<char> ok(tasks.size(), 1);
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < tasks.size(); ++i) {
+        threads.emplace_back([&tasks, &ok, i]() {
+          bindThreadToNode(nodeId(i));
+          for (auto& t : tasks[i]) {
+            if (!t()) {
+              ok[i] = 0;
+            }
+          }
+        });
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+      for (char x : ok) {
+        if (!x) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+}
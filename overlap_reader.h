@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <assert.h>
+#include <memory>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "async_reader.h"
+#include "header.h"
+#include "reader.h"
+
+/*
+  Reading blocks with overlap, for FFT and filterbank stages that need the last
+  few timesteps of the previous block along with each new one.
+
+  Each row of the data, meaning every timestep of one antenna and channel, has
+  the last `overlap` timesteps of the previous block in front of the block's
+  own timesteps:
+
+    data[antenna][channel][overlap + num_timesteps][pol]
+
+  The block is read straight into place behind the history with one preadv,
+  and only the history itself is copied, from the other of two buffers that
+  are reused for the whole file.
+
+    raw::OverlapReader reader(filename, 1023);
+    while (reader.next()) {
+      raw::BlockShape shape = reader.shape();
+      // shape.num_timesteps includes the overlap
+      filter(shape, reader.data());
+    }
+    if (reader.error()) { ... }
+*/
+
+namespace raw {
+
+  class OverlapReader {
+  private:
+    Reader reader;
+    int overlap;
+    std::unique_ptr<Header, AlignedDelete<Header> > current_header;
+
+    // The current and previous windows. Swapped on each block.
+    std::vector<char> buffers[2];
+    int current = 0;
+
+    // Whether there is a previous window, and its shape.
+    bool have_previous = false;
+    int previous_nants = 0;
+    int previous_num_channels = 0;
+    int previous_num_timesteps = 0;
+    int previous_npol = 0;
+
+    // How many of the history timesteps in the current window hold data.
+    int history = 0;
+
+  public:
+    // overlap is how many timesteps of history each block carries.
+    OverlapReader(const std::string& filename, int overlap)
+      : reader(filename), overlap(overlap), current_header(makeAligned<Header>()) {
+      assert(overlap >= 0);
+    }
+
+    OverlapReader(const OverlapReader&) = delete;
+    OverlapReader& operator=(OverlapReader&) = delete;
+
+    // Whether we have run into an error
+    bool error() {
+      return reader.error();
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return reader.errorMessage();
+    }
+
+    // Turns on checking blocks against their DATACRC cards, like Reader's.
+    void verifyChecksums(bool on) {
+      reader.verifyChecksums(on);
+    }
+
+    // Reads the next block into the window.
+    // Returns false at the end of the file or on an error. Check error() to tell
+    // which.
+    bool next() {
+      if (error() || !reader.readHeader(current_header.get())) {
+        return false;
+      }
+      const Header& h = *current_header;
+      size_t timestep_bytes = h.npol * 2;
+      size_t history_bytes = overlap * timestep_bytes;
+      size_t row_stride = history_bytes + h.num_timesteps * timestep_bytes;
+      int rows = h.nants * h.num_channels;
+
+      current = 1 - current;
+      std::vector<char>& window = buffers[current];
+      window.resize(rows * row_stride);
+      if (!reader.readData(window.data() + history_bytes, row_stride)) {
+        have_previous = false;
+        return false;
+      }
+
+      // The history carries on from the previous window if nothing was dropped
+      // in between and the shape is the same.
+      bool continuous = have_previous && h.missing_blocks == 0 &&
+        h.nants == previous_nants && h.num_channels == previous_num_channels &&
+        (int) h.npol == previous_npol;
+      if (continuous) {
+        // The last overlap timesteps of each previous row, which may reach back
+        // into its own history when overlap is more than a block.
+        const std::vector<char>& previous = buffers[1 - current];
+        size_t previous_stride = history_bytes + previous_num_timesteps * timestep_bytes;
+        for (int r = 0; r < rows; ++r) {
+          memcpy(window.data() + r * row_stride,
+                 previous.data() + (r + 1) * previous_stride - history_bytes, history_bytes);
+        }
+        history = std::min(overlap, history + previous_num_timesteps);
+      } else {
+        for (int r = 0; r < rows; ++r) {
+          memset(window.data() + r * row_stride, 0, history_bytes);
+        }
+        history = 0;
+      }
+
+      have_previous = true;
+      previous_nants = h.nants;
+      previous_num_channels = h.num_channels;
+      previous_num_timesteps = h.num_timesteps;
+      previous_npol = h.npol;
+      return true;
+    }
+
+    // The header of the current block.
+    const Header& header() const {
+      return *current_header;
+    }
+
+    // The current window, indexed [antenna][channel][overlap + num_timesteps][pol].
+    const char* data() const {
+      return buffers[current].data();
+    }
+
+    // The shape of the current window, counting the overlap in num_timesteps.
+    BlockShape shape() const {
+      const Header& h = *current_header;
+      return BlockShape(h.nants, h.num_channels, overlap + h.num_timesteps, h.npol);
+    }
+
+    // How many of the overlap timesteps, counting back from the block, are real
+    // data. The ones before them are zero, as at the start of the file or after
+    // a dropped block.
+    int historyTimesteps() const {
+      return history;
+    }
+  };
+}
@@ -0,0 +1,195 @@
+"""
+Reading .raw files from Python, through the raw_c shared library.
+
+    import raw
+    with raw.Reader("guppi.0000.raw") as reader:
+        for header in reader.headers():
+            block = reader.map_data()  # int8 [antenna][channel][time][pol][re/im]
+            power = (block.astype(float) ** 2).sum(axis=(2, 4))
+
+map_data and map_band return read-only views straight into a mapping of the
+file, so no data is copied. The views keep the file open and mapped, so they
+stay valid after the reader is closed or collected. read_data and read_band copy into an array, which
+can be passed back in as out= to avoid allocating one per block.
+
+The library is found through the RAW_C_LIBRARY environment variable, or else
+as libraw_c.so on the usual library path.
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+ABI_VERSION = 2
+
+
+class Header(ctypes.Structure):
+    _fields_ = [
+        ("blocsize", ctypes.c_int64),
+        ("npol", ctypes.c_int32),
+        ("obsnchan", ctypes.c_int32),
+        ("nbits", ctypes.c_int32),
+        ("nants", ctypes.c_int32),
+        ("num_channels", ctypes.c_int32),
+        ("num_timesteps", ctypes.c_int32),
+        ("missing_blocks", ctypes.c_int32),
+        ("beam_id", ctypes.c_int32),
+        ("pktidx", ctypes.c_int64),
+        ("datacrc", ctypes.c_int64),
+        ("data_offset", ctypes.c_int64),
+        ("obsfreq", ctypes.c_double),
+        ("obsbw", ctypes.c_double),
+        ("tbin", ctypes.c_double),
+        ("ra", ctypes.c_double),
+        ("dec", ctypes.c_double),
+        ("mjd", ctypes.c_double),
+        ("_src_name", ctypes.c_char * 81),
+        ("_telescop", ctypes.c_char * 81),
+    ]
+
+    @property
+    def src_name(self):
+        return self._src_name.decode()
+
+    @property
+    def telescop(self):
+        return self._telescop.decode()
+
+    def shape(self, num_bands=1):
+        """The shape of a block, or of one of num_bands bands of it, as an array."""
+        return (self.nants, self.num_channels // num_bands, self.num_timesteps, self.npol, 2)
+
+
+class _Array(ctypes.Structure):
+    _fields_ = [
+        ("data", ctypes.c_void_p),
+        ("shape", ctypes.c_int64 * 5),
+        ("strides", ctypes.c_int64 * 5),
+    ]
+
+
+def _load():
+    lib = ctypes.CDLL(os.environ.get("RAW_C_LIBRARY", "libraw_c.so"))
+    lib.raw_abi_version.restype = ctypes.c_int
+    if lib.raw_abi_version() < ABI_VERSION:
+        raise ImportError("raw_c is older than this module")
+    lib.raw_open.restype = ctypes.c_void_p
+    lib.raw_open.argtypes = [ctypes.c_char_p]
+    lib.raw_close.argtypes = [ctypes.c_void_p]
+    lib.raw_error.restype = ctypes.c_char_p
+    lib.raw_error.argtypes = [ctypes.c_void_p]
+    lib.raw_read_header.argtypes = [ctypes.c_void_p, ctypes.POINTER(Header), ctypes.c_size_t]
+    lib.raw_get_card.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p,
+                                 ctypes.c_size_t]
+    lib.raw_read_data.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    lib.raw_read_band.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int,
+                                  ctypes.c_void_p, ctypes.c_size_t]
+    lib.raw_map_band.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int,
+                                 ctypes.POINTER(_Array)]
+    return lib
+
+
+_lib = _load()
+
+
+class _Handle:
+    """Owns a raw_c reader, closing it once nothing refers to it. The Reader and
+    the buffers under mapped arrays all refer to it."""
+
+    def __init__(self, filename):
+        self._close = _lib.raw_close
+        self.value = _lib.raw_open(os.fsencode(filename))
+
+    def __del__(self):
+        if self.value:
+            self._close(self.value)
+            self.value = None
+
+
+class Reader:
+    def __init__(self, filename):
+        self._owner = _Handle(filename)
+        self._handle = self._owner.value
+        if not self._handle:
+            raise MemoryError()
+        self.header = Header()
+
+    def close(self):
+        """Closes the file, or once the last array from map_data or map_band is
+        gone, if there are any."""
+        self._handle = None
+        self._owner = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _check(self, ok):
+        if not ok:
+            message = _lib.raw_error(self._handle)
+            raise IOError(message.decode() if message else "no data")
+
+    def read_header(self):
+        """Reads the next header into self.header, returning False at the end of the file."""
+        if _lib.raw_read_header(self._handle, ctypes.byref(self.header),
+                                ctypes.sizeof(self.header)):
+            return True
+        self._check(_lib.raw_error(self._handle) is None)
+        return False
+
+    def headers(self):
+        """Iterates over the remaining headers. Each one is self.header, updated."""
+        while self.read_header():
+            yield self.header
+
+    def card(self, key):
+        """A header card of the current block as a string, or None if it's missing."""
+        value = ctypes.create_string_buffer(81)
+        if _lib.raw_get_card(self._handle, key.encode(), value, len(value)):
+            return value.value.decode()
+        return None
+
+    def _output(self, out, num_bands):
+        shape = self.header.shape(num_bands)
+        if out is None:
+            return np.empty(shape, dtype=np.int8)
+        if out.dtype != np.int8 or out.shape != shape or not out.flags.c_contiguous:
+            raise ValueError("out must be a contiguous int8 array of shape %s" % (shape,))
+        return out
+
+    def read_data(self, out=None):
+        """Copies the current block into an int8 array."""
+        out = self._output(out, 1)
+        self._check(_lib.raw_read_data(self._handle, out.ctypes.data, out.nbytes))
+        return out
+
+    def read_band(self, band, num_bands, out=None):
+        """Copies one of num_bands frequency bands of the current block into an int8 array."""
+        out = self._output(out, num_bands)
+        self._check(_lib.raw_read_band(self._handle, band, num_bands, out.ctypes.data,
+                                       out.nbytes))
+        return out
+
+    def map_band(self, band, num_bands):
+        """A read-only view of one of num_bands bands of the current block, in the file mapping.
+        Returns None if the file can't be mapped."""
+        array = _Array()
+        if not _lib.raw_map_band(self._handle, band, num_bands, ctypes.byref(array)):
+            self._check(_lib.raw_error(self._handle) is None)
+            return None
+        shape = tuple(array.shape)
+        strides = tuple(array.strides)
+        span = sum((n - 1) * s for n, s in zip(shape, strides)) + 1
+        buffer = (ctypes.c_int8 * span).from_address(array.data)
+        buffer._owner = self._owner
+        view = np.ndarray(shape, dtype=np.int8, buffer=buffer, strides=strides)
+        view.flags.writeable = False
+        return view
+
+    def map_data(self):
+        """A read-only view of the current block, in the file mapping.
+        Returns None if the file can't be mapped."""
+        return self.map_band(0, 1)
@@ -0,0 +1,94 @@
+"""
+Tests for raw.py, run by ctest when NumPy is installed:
+
+    RAW_C_LIBRARY=build/libraw_c.so python3 python/test_raw.py build/generate
+
+It writes a synthetic file with the generate tool and checks that the copied and
+mapped reads agree with each other.
+"""
+
+import gc
+import os
+import subprocess
+import sys
+import tempfile
+
+import numpy as np
+
+import raw
+
+
+def check(condition, message):
+    if not condition:
+        print("FAILED: " + message)
+        sys.exit(1)
+
+
+def test_reader(filename):
+    print("testing python reader")
+    with raw.Reader(filename) as reader:
+        blocks = 0
+        out = None
+        last_pktidx = -1
+        for header in reader.headers():
+            check(header.shape() == (2, 8, 64, 2, 2), "python shape")
+            check(header.pktidx > last_pktidx, "python pktidx")
+            last_pktidx = header.pktidx
+            check(header.src_name == "SYNTH_SRC", "python src_name")
+            check(reader.card("TELESCOP") == "SYNTHETIC", "python card")
+            check(reader.card("NOTACARD") is None, "python missing card")
+
+            mapped = reader.map_data()
+            check(mapped is not None and not mapped.flags.writeable, "python map_data")
+            out = reader.read_data(out=out)
+            check(np.array_equal(mapped, out), "python read_data matches map_data")
+
+            for band in range(4):
+                copied = reader.read_band(band, 4)
+                expected = out[:, band * 2:(band + 1) * 2]
+                check(np.array_equal(copied, expected), "python read_band")
+                check(np.array_equal(reader.map_band(band, 4), expected), "python map_band")
+            blocks += 1
+        check(blocks == 3, "python block count")
+
+        try:
+            reader.read_data(out=np.empty(10, dtype=np.int8))
+            check(False, "python bad out")
+        except ValueError:
+            pass
+
+    # Mapped views keep the file mapped after the reader is closed and collected
+    with raw.Reader(filename) as reader:
+        reader.read_header()
+        copied = reader.read_data()
+    reader = raw.Reader(filename)
+    reader.read_header()
+    band = reader.map_band(1, 4)
+    mapped = reader.map_data()
+    reader.close()
+    del reader
+    gc.collect()
+    check(np.array_equal(mapped, copied), "python map_data after close")
+    check(np.array_equal(band, copied[:, 2:4]), "python map_band after close")
+
+    with raw.Reader("/nonexistent.raw") as reader:
+        try:
+            reader.read_header()
+            check(False, "python open error")
+        except IOError:
+            pass
+
+
+def main():
+    generate = sys.argv[1]
+    with tempfile.TemporaryDirectory() as dir:
+        filename = os.path.join(dir, "python.0000.raw")
+        subprocess.run([generate, filename, "--nants", "2", "--obsnchan", "16",
+                        "--blocsize", str(16 * 2 * 2 * 64), "--blocks", "3"],
+                       check=True, stdout=subprocess.DEVNULL)
+        test_reader(filename)
+    print("OK")
+
+
+if __name__ == "__main__":
+    main()
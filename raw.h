@@ -10,6 +10,30 @@
 
 // Just an import target to bring in all the components of the library.
 
+#include "async_reader.h"
+#include "beamformer.h"
+#include "block_cache.h"
+#include "cache_policy.h"
+#include "block_stats.h"
+#include "block_view.h"
+#include "catalog.h"
+#include "checksum.h"
+#include "compressed.h"
+#include "correlator.h"
+#include "decimator.h"
+#include "generator.h"
 #include "header.h"
+#include "layout.h"
+#include "multi_stream_reader.h"
+#include "numa_util.h"
+#include "overlap_reader.h"
 #include "reader.h"
+#include "requantizer.h"
+#include "rfi.h"
+#include "shm_ring_reader.h"
+#include "stats.h"
+#include "stream_reader.h"
+#include "thread_pool.h"
+#include "verify.h"
+#include "writer.h"
 
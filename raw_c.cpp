@@ -0,0 +1,181 @@
+#include <memory>
+#include <new>
+#include <string.h>
+#include <string>
+
+#include "raw.h"
+#include "raw_c.h"
+
+// The implementation of the C interface in raw_c.h.
+
+struct raw_reader {
+  raw::Reader reader;
+
+  // Maps the file for raw_map_data, once it's asked for.
+  std::unique_ptr<raw::BlockSource> source;
+
+  // The current header. Over-aligned, so it can't just be a member.
+  std::unique_ptr<raw::Header, raw::AlignedDelete<raw::Header> > header;
+  bool has_header = false;
+
+  // Other errors from this interface, like bad arguments.
+  raw::ErrorMessage err = raw::ErrorMessage();
+  std::string error_message;
+
+  explicit raw_reader(const char* filename)
+    : reader(filename), header(raw::makeAligned<raw::Header>()) {}
+};
+
+namespace {
+
+  // Checks that there's a current block for a data call.
+  bool checkHeader(raw_reader* r) {
+    if (!r->has_header) {
+      r->err << "raw_read_header must succeed before reading data";
+      return false;
+    }
+    return true;
+  }
+
+  // Checks that a band request divides the current block evenly.
+  bool checkBand(raw_reader* r, int band, int num_bands) {
+    if (num_bands <= 0 || band < 0 || band >= num_bands ||
+        r->header->num_channels % num_bands != 0) {
+      r->err << "band " << band << " of " << num_bands << " doesn't divide "
+             << r->header->num_channels << " channels";
+      return false;
+    }
+    return true;
+  }
+
+  void copyString(char* dest, const char* src, size_t size) {
+    strncpy(dest, src, size - 1);
+    dest[size - 1] = '\0';
+  }
+}
+
+extern "C" {
+
+  int raw_abi_version(void) {
+    return RAW_C_ABI_VERSION;
+  }
+
+  raw_reader* raw_open(const char* filename) {
+    return new (std::nothrow) raw_reader(filename);
+  }
+
+  void raw_close(raw_reader* reader) {
+    delete reader;
+  }
+
+  const char* raw_error(raw_reader* reader) {
+    if (reader->err.used) {
+      reader->error_message = reader->err;
+    } else if (reader->reader.error()) {
+      reader->error_message = reader->reader.errorMessage();
+    } else {
+      return nullptr;
+    }
+    return reader->error_message.c_str();
+  }
+
+  int raw_read_header(raw_reader* reader, raw_header* header, size_t header_size) {
+    reader->has_header = reader->reader.readHeader(reader->header.get());
+    if (!reader->has_header) {
+      return 0;
+    }
+    const raw::Header& h = *reader->header;
+    // Filled in here, so that a caller built against an older, smaller
+    // raw_header only gets the fields it knows about
+    raw_header full = raw_header();
+    raw_header* out = &full;
+    out->blocsize = h.blocsize;
+    out->npol = h.npol;
+    out->obsnchan = h.obsnchan;
+    out->nbits = h.nbits;
+    out->nants = h.nants;
+    out->num_channels = h.num_channels;
+    out->num_timesteps = h.num_timesteps;
+    out->missing_blocks = h.missing_blocks;
+    out->beam_id = h.beam_id;
+    out->pktidx = h.pktidx;
+    out->datacrc = h.datacrc;
+    out->data_offset = h.data_offset;
+    out->obsfreq = h.obsfreq;
+    out->obsbw = h.obsbw;
+    out->tbin = h.tbin;
+    out->ra = h.ra;
+    out->dec = h.dec;
+    out->mjd = h.mjd;
+    copyString(out->src_name, h.src_name, sizeof(out->src_name));
+    copyString(out->telescop, h.telescop, sizeof(out->telescop));
+    memcpy(header, &full, header_size < sizeof(full) ? header_size : sizeof(full));
+    return 1;
+  }
+
+  int raw_get_card(raw_reader* reader, const char* key, char* value, size_t size) {
+    if (!reader->has_header || size == 0) {
+      return 0;
+    }
+    char buffer[80];
+    if (libwcs::hgets(reader->header->buffer, key, sizeof(buffer), buffer) == 0) {
+      return 0;
+    }
+    copyString(value, buffer, size);
+    return 1;
+  }
+
+  int raw_read_data(raw_reader* reader, void* buffer, size_t size) {
+    if (!checkHeader(reader)) {
+      return 0;
+    }
+    if (size < reader->header->blocsize) {
+      reader->err << "buffer of " << size << " bytes is too small for a block of "
+                  << reader->header->blocsize;
+      return 0;
+    }
+    return reader->reader.readData((char*) buffer);
+  }
+
+  int raw_read_band(raw_reader* reader, int band, int num_bands, void* buffer, size_t size) {
+    if (!checkHeader(reader) || !checkBand(reader, band, num_bands)) {
+      return 0;
+    }
+    if (size < reader->header->blocsize / num_bands) {
+      reader->err << "buffer of " << size << " bytes is too small for a band of "
+                  << reader->header->blocsize / num_bands;
+      return 0;
+    }
+    return reader->reader.readBand(*reader->header, band, num_bands, (char*) buffer);
+  }
+
+  int raw_map_band(raw_reader* reader, int band, int num_bands, raw_array* out) {
+    if (!checkHeader(reader) || !checkBand(reader, band, num_bands)) {
+      return 0;
+    }
+    if (reader->source == nullptr) {
+      reader->source.reset(new raw::BlockSource(reader->reader.filename));
+    }
+    const raw::Header& h = *reader->header;
+    const char* data = reader->source->mapped(h.data_offset, h.blocsize);
+    if (data == nullptr) {
+      return 0;
+    }
+
+    int channels = h.num_channels / num_bands;
+    int64_t sample_bytes = 2;
+    int64_t timestep_bytes = h.npol * sample_bytes;
+    int64_t channel_bytes = h.num_timesteps * timestep_bytes;
+    int64_t shape[5] = {h.nants, channels, h.num_timesteps, h.npol, 2};
+    int64_t strides[5] = {h.num_channels * channel_bytes, channel_bytes, timestep_bytes,
+                          sample_bytes, 1};
+    out->data = (const int8_t*) data + band * channels * channel_bytes;
+    memcpy(out->shape, shape, sizeof(shape));
+    memcpy(out->strides, strides, sizeof(strides));
+    return 1;
+  }
+
+  int raw_map_data(raw_reader* reader, raw_array* out) {
+    return raw_map_band(reader, 0, 1, out);
+  }
+}
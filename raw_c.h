@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  A C interface to the reader, for use from C or from other languages through
+  an FFI such as Python's ctypes. It is built into the raw_c shared library.
+  See python/raw.py for a NumPy wrapper.
+
+    raw_reader* reader = raw_open(filename);
+    raw_header header;
+    while (raw_read_header(reader, &header, sizeof(header))) {
+      raw_array block;
+      if (raw_map_data(reader, &block)) {
+        // block.data has block.shape, with block.strides in bytes
+      }
+    }
+    if (raw_error(reader)) { ... }
+    raw_close(reader);
+
+  Only fixed-width types cross the interface. raw_header is only ever added to
+  at the end, and the caller passes its own sizeof(raw_header) to
+  raw_read_header, which fills in no more than that. So code compiled against
+  one version keeps working with later ones, which leave the newer fields out.
+  raw_array is fixed. RAW_C_ABI_VERSION increases whenever something is added.
+*/
+
+#define RAW_C_ABI_VERSION 2
+
+// The library is built with hidden visibility, so these are the only symbols
+// it exports.
+#define RAW_C_EXPORT __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef struct raw_reader raw_reader;
+
+  // The fields of one block's header. See Header for what they mean.
+  typedef struct raw_header {
+    int64_t blocsize;
+    int32_t npol;
+    int32_t obsnchan;
+    int32_t nbits;
+    int32_t nants;
+    int32_t num_channels;
+    int32_t num_timesteps;
+    int32_t missing_blocks;
+    int32_t beam_id;
+    int64_t pktidx;
+    int64_t datacrc;
+    int64_t data_offset;
+    double obsfreq;
+    double obsbw;
+    double tbin;
+    double ra;
+    double dec;
+    double mjd;
+    char src_name[81];
+    char telescop[81];
+  } raw_header;
+
+  // Int8 data in the data[antenna][channel][time][pol][re/im] layout.
+  // Strides are in bytes, like NumPy's. This struct never changes.
+  typedef struct raw_array {
+    const int8_t* data;
+    int64_t shape[5];
+    int64_t strides[5];
+  } raw_array;
+
+  // The RAW_C_ABI_VERSION that the library was built with.
+  RAW_C_EXPORT int raw_abi_version(void);
+
+  // Opens a .raw file. Returns NULL only if memory runs out. A file that can't
+  // be opened is reported as an error by the first raw_read_header.
+  RAW_C_EXPORT raw_reader* raw_open(const char* filename);
+
+  RAW_C_EXPORT void raw_close(raw_reader* reader);
+
+  // The error message, or NULL if there hasn't been an error.
+  // Valid until the next call with this reader.
+  RAW_C_EXPORT const char* raw_error(raw_reader* reader);
+
+  // Reads the next header, skipping any unread data of the current block.
+  // header_size is sizeof(raw_header) as the caller was compiled, and only that
+  // many bytes of header are written.
+  // Returns 1 if there was one, and 0 at the end of the file or on an error.
+  RAW_C_EXPORT int raw_read_header(raw_reader* reader, raw_header* header,
+                                   size_t header_size);
+
+  // Gets a header card of the current block as a string, for the cards that
+  // raw_header doesn't have. Returns 0 if the card isn't present.
+  RAW_C_EXPORT int raw_get_card(raw_reader* reader, const char* key, char* value,
+                                size_t size);
+
+  // Copies the current block's data into buffer, which must hold size >= blocsize
+  // bytes. Returns 1 on success.
+  RAW_C_EXPORT int raw_read_data(raw_reader* reader, void* buffer, size_t size);
+
+  // Copies one of num_bands equal frequency bands of the current block into
+  // buffer, which must hold size >= blocsize / num_bands bytes.
+  // The band is laid out like a block with num_channels / num_bands channels.
+  // Returns 1 on success.
+  RAW_C_EXPORT int raw_read_band(raw_reader* reader, int band, int num_bands, void* buffer,
+                                 size_t size);
+
+  // Points out at the current block's data in a read-only mapping of the file,
+  // without copying. Valid until raw_close.
+  // Returns 0 if the file can't be mapped, in which case use raw_read_data.
+  RAW_C_EXPORT int raw_map_data(raw_reader* reader, raw_array* out);
+
+  // Like raw_map_data for one band. The band isn't contiguous, so the antenna
+  // stride is larger than the band's own size.
+  RAW_C_EXPORT int raw_map_band(raw_reader* reader, int band, int num_bands,
+                                raw_array* out);
+
+#ifdef __cplusplus
+}
+#endif
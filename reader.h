@@ -1,20 +1,145 @@
 #pragma once
 
+#include <algorithm>
 #include <fcntl.h>
 #include <functional>
+#include <math.h>
+#include <memory>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <utility>
 #include <vector> 
 
+#include "block_cache.h"
+#include "cache_policy.h"
+#include "checksum.h"
 #include "error_message.h"
 #include "header.h"
+#include "numa_util.h"
+#include "stats.h"
 #include "util.h"
 
 namespace raw {
 
+  // Fills in the header fields that are derived from the block dimensions, checking
+  // that the dimensions are ones we can handle.
+  // Returns whether they are. If not, the problem is written to err.
+  inline bool setBlockDimensions(Header* header, ErrorMessage& err) {
+    // Verify that obsnchan is divisible by nants
+    if (header->obsnchan % header->nants != 0) {
+      err << "bad obsnchan/nants: " << header->obsnchan << " % " << header->nants
+          << " != 0";
+      return false;
+    }
+    header->num_channels = header->obsnchan / header->nants;
+
+    if (header->nbits != 8) {
+      err << "the raw library can currently only handle nbits = 8";
+      return false;
+    }
+
+    // Validate block dimensions.
+    // The 2 is because we store both real and complex values.
+    int bits_per_timestep = 2 * header->npol * header->obsnchan * header->nbits;
+    int bytes_per_timestep = bits_per_timestep / 8;
+    if (header->blocsize % bytes_per_timestep != 0) {
+      err << "invalid block dimensions: blocsize " << header->blocsize
+          << " is not divisible by " << bytes_per_timestep;
+      return false;
+    }
+
+    header->num_timesteps = header->blocsize / bytes_per_timestep;
+    return true;
+  }
+
+  // Sets header->missing_blocks from the jump in PKTIDX since the previous header.
+  // pktidx_step is how much PKTIDX advances per block. It is taken from PIPERBLK
+  // when that's present, otherwise from the first two blocks, so it should start
+  // out as 0 and be passed back in for each subsequent header.
+  inline void setMissingBlocks(Header* header, int headers_read, int64_t previous_pktidx,
+                               int64_t* pktidx_step) {
+    header->missing_blocks = 0;
+    if (headers_read == 0) {
+      long piperblk = header->getUnsignedInt("PIPERBLK", UNSIGNED_INT_NOT_PRESENT);
+      if (piperblk != UNSIGNED_INT_NOT_PRESENT && piperblk > 0) {
+        *pktidx_step = piperblk;
+      }
+    } else {
+      int64_t diff = header->pktidx - previous_pktidx;
+      if (*pktidx_step == 0 && diff > 0) {
+        *pktidx_step = diff;
+      }
+      if (*pktidx_step > 0 && diff > *pktidx_step) {
+        header->missing_blocks = diff / *pktidx_step - 1;
+      }
+    }
+  }
+
+  // The next file in a recording sequence, like foo.0001.raw after foo.0000.raw.
+  // Returns "" if the filename doesn't end in a .NNNN.raw sequence number.
+  inline std::string nextSequenceFilename(const std::string& filename) {
+    const std::string suffix = ".raw";
+    if (filename.size() < 10 ||
+        filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) != 0) {
+      return "";
+    }
+    size_t dot = filename.size() - suffix.size() - 5;
+    if (filename[dot] != '.') {
+      return "";
+    }
+    std::string digits = filename.substr(dot + 1, 4);
+    for (char c : digits) {
+      if (c < '0' || c > '9') {
+        return "";
+      }
+    }
+    char next[16];
+    snprintf(next, sizeof(next), "%04d", atoi(digits.c_str()) + 1);
+    if (strlen(next) != 4) {
+      return "";
+    }
+    return filename.substr(0, dot + 1) + next + suffix;
+  }
+
+  // A stretch of a TimeSeries that no block covered, in timesteps from its start.
+  struct TimeGap {
+    int64_t first;
+    int64_t count;
+  };
+
+  /*
+    The data of one antenna and a range of its channels over a span of time,
+    as returned by Reader::readTimeRange.
+  */
+  struct TimeSeries {
+    // The unix time of the first timestep.
+    double start_time = 0;
+
+    // Seconds per timestep.
+    double tbin = 0;
+
+    int num_channels = 0;
+    int num_timesteps = 0;
+    int npol = 0;
+
+    // Indexed [channel][time][pol], two bytes per value like block data, so each
+    // channel is one contiguous time series.
+    std::vector<char> data;
+
+    // The stretches missing from the file, which are zero in data.
+    std::vector<TimeGap> gaps;
+  };
+
+  class BlockList;
+  class BlockSource;
+  class BlockStream;
+  class BlockView;
+
   class Reader {
 
   private:
@@ -36,22 +161,99 @@ namespace raw {
     // Set to 0 before we have read any blocks
     int64_t pktidx = 0;
 
+    // How much pktidx advances per block.
+    // Taken from PIPERBLK when it's present, otherwise from the first two blocks.
+    // Set to 0 until we know it.
+    int64_t pktidx_step = 0;
+
+    // The DATACRC of the current block, or -1 if it has none.
+    long current_datacrc = -1;
+
+    // Whether readData checks blocks against their DATACRC.
+    bool verify_checksums = false;
+
+    // Whether reads put the channels of negative-OBSBW blocks in ascending
+    // frequency order.
+    bool ascending_frequency = false;
+
+    // Where readBand keeps the bands it reads, or nullptr to read every time.
+    BlockCache* cache = nullptr;
+
+    // How sequential reading uses the page cache.
+    PageCacheAdvisor page_cache;
+
+    // The dimensions of the current block, for reversing its channels in readData.
+    int current_nants = 0;
+    int current_num_channels = 0;
+    bool current_reversed = false;
+
     // Once err is used, the reader is in "error state".
     ErrorMessage err = ErrorMessage();
+
+#ifdef RAW_STATS
+    // Counters for the I/O and parsing we have done.
+    // Mutable because the const band-reading methods also count their reads.
+    mutable Stats io_stats;
+#endif
+
+    // How long to wait for a file to grow in follow mode, in milliseconds.
+    // Negative when we aren't in follow mode.
+    int follow_timeout_ms = -1;
+
+    // The inotify descriptor and watches for follow mode.
+    // Mutable because the const band-reading methods also wait for data.
+    mutable int inotify_fd = -1;
+    mutable int file_watch = -1;
+    mutable bool timed_out = false;
+
+    // Scratch space for checking whether a header has been completely written.
+    std::vector<char> follow_buffer;
+
+    // Where each block is, for readTimeRange. Built by its first call.
+    struct IndexedBlock {
+      off_t data_offset;
+      int nants;
+      int num_channels;
+      int num_timesteps;
+      int npol;
+
+      // Kept so readTimeRange can honor ascendingFrequency, which may change
+      // after the index is built.
+      double obsbw;
+
+      // The timestep that the block starts at, counted from SYNCTIME.
+      int64_t first_timestep;
+    };
+    std::vector<IndexedBlock> block_index;
+    bool block_index_built = false;
+    long synctime = 0;
+    double index_tbin = 0;
+
+    // Where to count I/O, or nullptr when RAW_STATS is off.
+    Stats* statsPointer() const {
+#ifdef RAW_STATS
+      return &io_stats;
+#else
+      return nullptr;
+#endif
+    }
     
   public:
     std::string filename;
     
     Reader(const std::string& filename) : filename(filename) {
       fdin = open(filename.c_str(), O_RDONLY);
-      // posix_fadvise(fdin, 0, 0, POSIX_FADV_SEQUENTIAL);
     }
 
     Reader(const Reader&) = delete;
     Reader& operator=(Reader&) = delete;
     
     ~Reader() {
+      page_cache.release(fdin, lseek(fdin, 0, SEEK_CUR));
       close(fdin);
+      if (inotify_fd >= 0) {
+        close(inotify_fd);
+      }
     }
 
     // Whether we have run into an error
@@ -63,7 +265,320 @@ namespace raw {
     std::string errorMessage() {
       return err;
     }
+
+    // Turns on follow mode, for files that are still being recorded.
+    //
+    // In follow mode, when the reader gets to the end of the file it waits for the
+    // file to grow instead of treating it as the end of the data. Partially written
+    // headers and blocks are waited for too. When the recorder moves on to the next
+    // file in the sequence, like foo.0001.raw after foo.0000.raw, the reader rolls
+    // over to it, and filename changes to match.
+    //
+    // Waiting uses inotify, so it doesn't spin. If nothing arrives within
+    // timeout_ms, the read returns false with timedOut() set and no error, and
+    // calling it again resumes waiting.
+    // To loop over blocks as they arrive, use blockStream() rather than blocks(),
+    // which waits for the timeout before returning any.
+    // Returns whether follow mode could be set up.
+    bool follow(int timeout_ms) {
+      if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+          err << "could not initialize inotify";
+          return false;
+        }
+        size_t slash = filename.rfind('/');
+        std::string dir = (slash == std::string::npos) ? "." : filename.substr(0, slash + 1);
+        inotify_add_watch(inotify_fd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+        file_watch = inotify_add_watch(inotify_fd, filename.c_str(),
+                                       IN_MODIFY | IN_CLOSE_WRITE);
+      }
+      follow_timeout_ms = timeout_ms < 0 ? 0 : timeout_ms;
+      return true;
+    }
+
+    // Whether the last read returned false because follow mode timed out.
+    bool timedOut() const {
+      return timed_out;
+    }
+
+    // Turns on checking each block that readData reads against its DATACRC card,
+    // if it has one. A mismatch is an error. readBand doesn't read whole blocks,
+    // so it can't check them.
+    void verifyChecksums(bool on) {
+      verify_checksums = on;
+    }
+
+    // Turns on delivering channels in ascending frequency order.
+    // A negative OBSBW means a block's channels are stored from the highest
+    // frequency down. With this on, readData, readBand, readTimeRange and the
+    // band task methods reverse the channels of such blocks as part of the read,
+    // by reading each channel straight into its reversed position, and band 0 is
+    // the lowest frequency band. Blocks with a positive OBSBW are read as usual.
+    void ascendingFrequency(bool on) {
+      ascending_frequency = on;
+    }
+
+    // Sets how readHeader and readData use the page cache as they move through
+    // the file. See cache_policy.h.
+    void cachePolicy(const CachePolicy& policy) {
+      page_cache.setPolicy(fdin, policy);
+    }
+
+    const PageCacheAdvisor& pageCache() const {
+      return page_cache;
+    }
+
+    // Serves readBand from a cache, which can be shared with other readers and
+    // threads. Pass nullptr to stop.
+    void useCache(BlockCache* block_cache) {
+      cache = block_cache;
+    }
+
+    // Whether reads reverse the channels of this block.
+    bool reversesChannels(const Header& header) const {
+      return ascending_frequency && header.obsbw < 0;
+    }
+
+#ifdef RAW_STATS
+    // Counters for the work this reader has done so far.
+    // Only available when RAW_STATS is defined.
+    const Stats& stats() const {
+      return io_stats;
+    }
+
+    void resetStats() {
+      io_stats.reset();
+    }
+#endif
     
+  private:
+    off_t fileSize() const {
+      struct stat st;
+      if (fstat(fdin, &st) != 0) {
+        return 0;
+      }
+      return st.st_size;
+    }
+
+    // Sleeps until the file or its directory changes, or the deadline passes.
+    // Returns false if the deadline passed.
+    bool waitForChange(uint64_t deadline_ns) const {
+      uint64_t now = nowNanos();
+      if (now >= deadline_ns) {
+        return false;
+      }
+      struct pollfd pfd;
+      pfd.fd = inotify_fd;
+      pfd.events = POLLIN;
+      int ms = (deadline_ns - now + 999999) / 1000000;
+      if (poll(&pfd, 1, ms) <= 0) {
+        return nowNanos() < deadline_ns;
+      }
+
+      // Drain the events. We only care that something happened.
+      char events[4096];
+      while (read(inotify_fd, events, sizeof(events)) > 0) {}
+      return true;
+    }
+
+    // In follow mode, waits until the file has at least `end` bytes.
+    // Returns false on timeout.
+    bool waitForBytes(off_t end) const {
+      uint64_t deadline = nowNanos() + follow_timeout_ms * 1000000ULL;
+      while (fileSize() < end) {
+        if (!waitForChange(deadline)) {
+          timed_out = true;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Whether a complete header has been written at pos.
+    bool headerWritten(off_t pos) {
+      follow_buffer.resize(MAX_RAW_HEADER_SIZE);
+      ssize_t n = pread(fdin, follow_buffer.data(), MAX_RAW_HEADER_SIZE, pos);
+      return n >= 80 && rawspec_raw_header_size(follow_buffer.data(), n, 0) > 0;
+    }
+
+    // Switches to the next file of the recording sequence.
+    bool rollOver(const std::string& next) {
+      int fd = open(next.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      page_cache.release(fdin, lseek(fdin, 0, SEEK_CUR));
+      close(fdin);
+      fdin = fd;
+      page_cache.opened(fdin);
+      filename = next;
+      current_block_size = 0;
+      current_block_offset = 0;
+      if (file_watch >= 0) {
+        inotify_rm_watch(inotify_fd, file_watch);
+      }
+      file_watch = inotify_add_watch(inotify_fd, filename.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+      return true;
+    }
+
+    // In follow mode, waits until a complete header is available, rolling over to the
+    // next file in the sequence once this one has ended.
+    // Returns false on timeout.
+    bool waitForHeader() {
+      uint64_t deadline = nowNanos() + follow_timeout_ms * 1000000ULL;
+      while (true) {
+        off_t pos = lseek(fdin, 0, SEEK_CUR);
+        if (headerWritten(pos)) {
+          return true;
+        }
+
+        // The recorder creates the next file after it finishes this one, so once
+        // the next file exists, whatever is here is all there will be.
+        std::string next = nextSequenceFilename(filename);
+        if (!next.empty() && access(next.c_str(), R_OK) == 0 && !headerWritten(pos) &&
+            rollOver(next)) {
+          continue;
+        }
+
+        if (!waitForChange(deadline)) {
+          timed_out = true;
+          return false;
+        }
+      }
+    }
+
+    // The bytes in one [antenna][channel] row of the current block.
+    size_t currentRowBytes() const {
+      if (current_nants == 0 || current_num_channels == 0) {
+        return current_block_size;
+      }
+      return current_block_size / current_nants / current_num_channels;
+    }
+
+    // Where a row of the current block goes in a buffer with row_stride bytes
+    // between rows, reversing the channels if current_reversed is set.
+    char* rowDestination(char* buffer, int antenna, int channel, size_t row_stride) const {
+      if (current_reversed) {
+        channel = current_num_channels - 1 - channel;
+      }
+      return buffer + ((size_t) antenna * current_num_channels + channel) * row_stride;
+    }
+
+    // Reads the current block one row at a time with a single preadv,
+    // advancing fdin.
+    bool readRows(char* buffer, size_t row_stride) {
+      size_t row_bytes = currentRowBytes();
+      std::vector<struct iovec> iov;
+      for (int antenna = 0; antenna < current_nants; ++antenna) {
+        for (int channel = 0; channel < current_num_channels; ++channel) {
+          iov.push_back({rowDestination(buffer, antenna, channel, row_stride), row_bytes});
+        }
+      }
+      off_t offset = lseek(fdin, 0, SEEK_CUR);
+      if (!preadv_fully(fdin, iov, offset, statsPointer())) {
+        err << "incomplete block at end of file";
+        return false;
+      }
+      lseek(fdin, current_block_size, SEEK_CUR);
+      return true;
+    }
+
+    // The CRC32C of the current block as it is stored in the file, taking the
+    // rows in file order from wherever readRows put them.
+    uint32_t blockChecksum(const char* buffer, size_t row_stride) const {
+      size_t row_bytes = currentRowBytes();
+      if (!current_reversed && row_stride == row_bytes) {
+        return crc32c(buffer, current_block_size);
+      }
+      uint32_t crc = 0;
+      for (int antenna = 0; antenna < current_nants; ++antenna) {
+        for (int channel = 0; channel < current_num_channels; ++channel) {
+          const char* row = rowDestination((char*) buffer, antenna, channel, row_stride);
+          crc = crc32c(row, row_bytes, crc);
+        }
+      }
+      return crc;
+    }
+
+    // Scans every header of the file with a separate reader, so this one's
+    // position isn't disturbed.
+    bool buildBlockIndex() {
+      Reader scanner(filename);
+      Header header;
+      while (scanner.readHeader(&header)) {
+        long sync = header.getUnsignedInt("SYNCTIME", UNSIGNED_INT_NOT_PRESENT);
+        long piperblk = header.getUnsignedInt("PIPERBLK", UNSIGNED_INT_NOT_PRESENT);
+        if (sync == UNSIGNED_INT_NOT_PRESENT || piperblk == UNSIGNED_INT_NOT_PRESENT ||
+            piperblk <= 0) {
+          err << "readTimeRange needs SYNCTIME and PIPERBLK headers in " << filename;
+          return false;
+        }
+        synctime = sync;
+        index_tbin = header.tbin;
+        // The start time is synctime + pktidx * tbin * num_timesteps / piperblk.
+        int64_t first_timestep = header.pktidx * header.num_timesteps / piperblk;
+        block_index.push_back({header.data_offset, header.nants, header.num_channels,
+                               header.num_timesteps, (int) header.npol, header.obsbw,
+                               first_timestep});
+      }
+      if (scanner.error()) {
+        err << scanner.errorMessage();
+        return false;
+      }
+      block_index_built = true;
+      return true;
+    }
+
+    // One contiguous piece of the file to read into dest.
+    struct ReadSegment {
+      off_t offset;
+      size_t size;
+      char* dest;
+    };
+
+    // Reads segments, which must be in increasing order of offset. Segments
+    // separated by at most max_gap bytes are read by a single preadv, with the
+    // bytes between them read into a scratch buffer and discarded.
+    bool readSegments(const std::vector<ReadSegment>& segments, size_t max_gap) const {
+      std::vector<char> scratch;
+      std::vector<struct iovec> iov;
+      off_t start = 0;
+      off_t end = 0;
+      for (size_t i = 0; i <= segments.size(); ++i) {
+        bool last = i == segments.size();
+        if (!iov.empty() && (last || segments[i].offset < end ||
+                             (size_t) (segments[i].offset - end) > max_gap)) {
+          if (!preadv_fully(fdin, iov, start, statsPointer())) {
+            return false;
+          }
+          iov.clear();
+        }
+        if (last) {
+          break;
+        }
+        const ReadSegment& segment = segments[i];
+        if (iov.empty()) {
+          start = segment.offset;
+        } else if (segment.offset > end) {
+          scratch.resize(max_gap);
+          iov.push_back({scratch.data(), (size_t) (segment.offset - end)});
+        }
+        iov.push_back({segment.dest, segment.size});
+        end = segment.offset + segment.size;
+      }
+      return true;
+    }
+
+    // Reads the next header and makes a view of its block, for blocks() and
+    // blockStream(). source is shared by the views of one file, and replaced
+    // when the reader rolls over to the next.
+    // Returns false at the end, on an error, or on a follow mode timeout.
+    bool nextBlockView(std::shared_ptr<BlockSource>* source, int index,
+                       std::unique_ptr<BlockView>* view);
+    friend class BlockStream;
+
+  public:
     // Reads the next header, advancing the internal file descriptor to the start of the
     // subsequent data block.
     // Returns whether the read was successful.
@@ -71,6 +586,7 @@ namespace raw {
     // the file.
     // Callers should check reader.error() to see if there was an error.
     bool readHeader(Header* header) {
+      timed_out = false;
       if (error()) {
 	return false;
       }
@@ -79,11 +595,18 @@ namespace raw {
 	// We may have to advance fdin to get to the next block.
 	int advance = current_block_size - current_block_offset;
 	if (advance != 0) {
+          RAW_STATS_ONLY(uint64_t start = nowNanos());
 	  lseek(fdin, advance, SEEK_CUR);
+          RAW_STATS_ONLY(io_stats.addSeek(start));
 	}
+        current_block_offset = current_block_size;
+      }
+
+      if (follow_timeout_ms >= 0 && !waitForHeader()) {
+        return false;
       }
       
-      auto pos = rawspec_raw_read_header(fdin, header);
+      auto pos = rawspec_raw_read_header(fdin, header, statsPointer());
       if (pos <= 0) {
 	if (pos != -1) {
 	  // We're at the end of the file.
@@ -99,68 +622,228 @@ namespace raw {
 	return false;
       }      
 
-      // Verify that obsnchan is divisible by nants
-      if (header->obsnchan % header->nants != 0) {
-	err << "bad obsnchan/nants: " << header->obsnchan << " % " << header->nants
-            << " != 0";
-	return false;
-      }
-      header->num_channels = header->obsnchan / header->nants;
-
-      if (header->nbits != 8) {
-	err << "the raw library can currently only handle nbits = 8";
-	return false;
-      }
-
-      // Validate block dimensions.
-      // The 2 is because we store both real and complex values.
-      int bits_per_timestep = 2 * header->npol * header->obsnchan * header->nbits;
-      int bytes_per_timestep = bits_per_timestep / 8;
-      if (header->blocsize % bytes_per_timestep != 0) {
-	err << "invalid block dimensions: blocsize " << header->blocsize
-            << " is not divisible by " << bytes_per_timestep;
-	return false;
+      if (!setBlockDimensions(header, err)) {
+        return false;
       }
-
+      setMissingBlocks(header, headers_read, pktidx, &pktidx_step);
       pktidx = header->pktidx;
       
-      header->num_timesteps = header->blocsize / bytes_per_timestep;
       current_block_size = header->blocsize;
       current_block_offset = 0;
+      current_datacrc = header->datacrc;
+      current_nants = header->nants;
+      current_num_channels = header->num_channels;
+      current_reversed = reversesChannels(*header);
       ++headers_read;
+      page_cache.consumed(fdin, header->data_offset, header->blocsize);
       return true;
     }
 
     // Reads all data from the current block into the buffer, advancing fdin.
     // Returns whether the read was successful.
     bool readData(char* buffer) {
+      return readData(buffer, currentRowBytes());
+    }
+
+    // Like readData, but starts each [antenna][channel] row of the block
+    // row_stride bytes after the previous one, so the caller can keep other data,
+    // like timesteps from an earlier block, in between. The rows are still read
+    // with a single call. row_stride must be at least a row, so rows don't overlap.
+    bool readData(char* buffer, size_t row_stride) {
+      timed_out = false;
       if (current_block_offset != 0) {
 	err << "cannot readData when data from this block has already been read";
 	return false;
       }
-      auto bytes_read = read_fully(fdin, buffer, current_block_size);
-      if (bytes_read < 0) {
-	err << "error while reading file";
-	return false;
+      if (row_stride < currentRowBytes()) {
+        err << "row_stride " << row_stride << " is less than the " << currentRowBytes()
+            << " bytes in a row";
+        return false;
       }
-      if (bytes_read < current_block_size) {
-	err << "incomplete block at end of file";
-	return false;
+      if (follow_timeout_ms >= 0 &&
+          !waitForBytes(lseek(fdin, 0, SEEK_CUR) + current_block_size)) {
+        return false;
+      }
+      RAW_STATS_ONLY(uint64_t start = nowNanos());
+      bool contiguous = !current_reversed && row_stride == currentRowBytes();
+      if (!contiguous) {
+        if (!readRows(buffer, row_stride)) {
+          return false;
+        }
+      } else {
+        auto bytes_read = read_fully(fdin, buffer, current_block_size, statsPointer());
+        if (bytes_read < 0) {
+          err << "error while reading file";
+          return false;
+        }
+        if (bytes_read < current_block_size) {
+          err << "incomplete block at end of file";
+          return false;
+        }
       }
       current_block_offset += current_block_size;
+      RAW_STATS_ONLY(io_stats.addBlock(start));
+      if (verify_checksums && current_datacrc >= 0 &&
+          blockChecksum(buffer, row_stride) != current_datacrc) {
+        err << "checksum mismatch in block #" << headers_read << " of " << filename;
+        return false;
+      }
+      return true;
+    }
+
+    // Reads all of the remaining headers, returning a view of each block that
+    // fetches its data only when it's used. See block_view.h.
+    // Check error() afterwards, since the range stops early on an error,
+    // including a last block that the file ends partway through.
+    // In follow mode this returns only once the follow timeout expires, so use
+    // blockStream() there.
+    BlockList blocks();
+
+    // Like blocks(), but reads each header only when the loop gets to it, so in
+    // follow mode the loop sees each block as soon as it's recorded. The range
+    // can be iterated once, front to back.
+    BlockStream blockStream();
+
+    /*
+      Reads channels [first_channel, last_channel) of one antenna, from
+      start_time up to end_time in unix seconds, across as many blocks as that
+      spans. Each channel comes out as one contiguous time series.
+      With ascendingFrequency on, the channels of negative-OBSBW blocks are
+      numbered from the lowest frequency, like readData's output.
+
+      The blocks are found from their PKTIDX, which needs the SYNCTIME and
+      PIPERBLK headers. Only the needed part of each channel is read, and
+      reads that are close together in the file are combined into one preadv.
+      Times that fall in blocks missing from the file are zero in the output
+      and listed in out->gaps.
+
+      The first call scans all the headers of the file, without moving this
+      reader's position, and later calls reuse that.
+      Returns whether the read succeeded.
+    */
+    bool readTimeRange(int antenna, int first_channel, int last_channel, double start_time,
+                       double end_time, TimeSeries* out) {
+      if (error() || (!block_index_built && !buildBlockIndex())) {
+        return false;
+      }
+      if (block_index.empty()) {
+        err << "no blocks in " << filename;
+        return false;
+      }
+      const IndexedBlock& first = block_index[0];
+      if (antenna < 0 || antenna >= first.nants || first_channel < 0 ||
+          last_channel > first.num_channels || first_channel >= last_channel) {
+        err << "readTimeRange: antenna " << antenna << " channels [" << first_channel << ", "
+            << last_channel << ") are out of range";
+        return false;
+      }
+
+      // Times within a hundredth of a timestep of a sample count as that sample,
+      // which absorbs the rounding in large unix times.
+      int64_t begin = ceil((start_time - synctime) / index_tbin - 0.01);
+      int64_t end = ceil((end_time - synctime) / index_tbin - 0.01);
+      if (end < begin) {
+        end = begin;
+      }
+      int num_channels = last_channel - first_channel;
+      out->start_time = synctime + begin * index_tbin;
+      out->tbin = index_tbin;
+      out->num_channels = num_channels;
+      out->num_timesteps = end - begin;
+      out->npol = first.npol;
+      size_t timestep_bytes = first.npol * 2;
+      size_t channel_bytes = out->num_timesteps * timestep_bytes;
+      out->data.assign(num_channels * channel_bytes, 0);
+      out->gaps.clear();
+
+      std::vector<ReadSegment> segments;
+      int64_t covered = begin;
+      for (const IndexedBlock& block : block_index) {
+        int64_t block_end = block.first_timestep + block.num_timesteps;
+        if (block_end <= begin || block.first_timestep >= end) {
+          continue;
+        }
+        if (block.nants != first.nants || block.num_channels != first.num_channels ||
+            block.npol != first.npol) {
+          err << "block dimensions change within " << filename;
+          return false;
+        }
+        int64_t t0 = std::max(begin, block.first_timestep);
+        int64_t t1 = std::min(end, block_end);
+        if (t0 > covered) {
+          out->gaps.push_back({covered - begin, t0 - covered});
+        }
+        covered = std::max(covered, t1);
+
+        size_t row_bytes = block.num_timesteps * timestep_bytes;
+        bool reversed = ascending_frequency && block.obsbw < 0;
+        for (int channel = first_channel; channel < last_channel; ++channel) {
+          int file_channel = reversed ? block.num_channels - 1 - channel : channel;
+          off_t row = block.data_offset +
+            ((off_t) antenna * block.num_channels + file_channel) * row_bytes;
+          segments.push_back({(off_t) (row + (t0 - block.first_timestep) * timestep_bytes),
+                              (size_t) (t1 - t0) * timestep_bytes,
+                              out->data.data() + (channel - first_channel) * channel_bytes +
+                              (t0 - begin) * timestep_bytes});
+        }
+      }
+      if (covered < end) {
+        out->gaps.push_back({covered - begin, end - covered});
+      }
+
+      std::sort(segments.begin(), segments.end(),
+                [](const ReadSegment& a, const ReadSegment& b) { return a.offset < b.offset; });
+      if (!readSegments(segments, 256 * 1024)) {
+        err << "error reading time range from " << filename;
+        return false;
+      }
       return true;
     }
 
     // Reads a subset of the data in this block, defined by a frequency subband.
     // Returns whether the read succeeded.
     // This works regardless of where fdin is pointing and does not modify fdin.
+    // When there's a cache, the band is copied from it if it's there.
     bool readBand(const Header& header, int band, int num_bands, char* buffer) const {
+      if (cache == nullptr) {
+        return readBandFromFile(header, band, num_bands, buffer);
+      }
+      PinnedBlock pinned;
+      if (!readBand(header, band, num_bands, &pinned)) {
+        return false;
+      }
+      memcpy(buffer, pinned.data(), pinned.size());
+      return true;
+    }
+
+    // Like readBand, but gives access to the band in the cache, with no copy.
+    // Without a cache, out gets a buffer of its own.
+    bool readBand(const Header& header, int band, int num_bands, PinnedBlock* out) const {
+      auto load = [&](char* buffer) {
+        return readBandFromFile(header, band, num_bands, buffer);
+      };
+      size_t size = header.blocsize / num_bands;
+      if (cache == nullptr) {
+        return loadUncached(size, load, out);
+      }
+      CacheKey key{filename, header.data_offset, band, num_bands, reversesChannels(header)};
+      return cache->get(key, size, load, out);
+    }
+
+    // readBand without the cache.
+    bool readBandFromFile(const Header& header, int band, int num_bands, char* buffer) const {
+      timed_out = false;
+      if (follow_timeout_ms >= 0 && !waitForBytes(header.data_offset + header.blocsize)) {
+        return false;
+      }
+      RAW_STATS_ONLY(uint64_t start = nowNanos());
       std::vector<std::function<bool()> > tasks;
       readBandTasks(header, band, num_bands, buffer, &tasks);
       bool answer = true;
       for (auto& t : tasks) {
         answer = answer && t();
       }
+      RAW_STATS_ONLY(if (answer) io_stats.addBlock(start));
       return answer;
     }
 
@@ -180,14 +863,83 @@ namespace raw {
 
       char* dest = buffer;
       
+      if (reversesChannels(header)) {
+        // The file's bands run from high frequency to low, so take the mirror image
+        // band, and read its channels into reversed positions.
+        preband_bytes = (num_bands - 1 - band) * band_bytes;
+        size_t row_bytes = band_bytes / channels_per_band;
+        for (int antenna = 0; antenna < header.nants; ++antenna) {
+          std::vector<struct iovec> iov;
+          for (int channel = channels_per_band - 1; channel >= 0; --channel) {
+            iov.push_back({dest + channel * row_bytes, row_bytes});
+          }
+          off_t offset = header.data_offset + preband_bytes + antenna * num_bands * band_bytes;
+          int fd = fdin;
+          Stats* stats = statsPointer();
+          tasks->push_back([fd, iov, offset, stats]() {
+            return preadv_fully(fd, iov, offset, stats);
+          });
+          dest += band_bytes;
+        }
+        return;
+      }
+
       for (int antenna = 0; antenna < header.nants; ++antenna) {
         auto fn = std::bind(pread_fully, fdin, dest, band_bytes,
                             header.data_offset + preband_bytes +
-                            antenna * num_bands * band_bytes);
+                            antenna * num_bands * band_bytes, statsPointer());
         tasks->push_back(std::move(fn));
         dest += band_bytes;
       }
     }
-    
+
+    // The part of a readBand buffer, as [first, second) byte offsets, that holds
+    // the index-th group of antennas from readBandTasksByNode.
+    static std::pair<size_t, size_t> nodeByteRange(const Header& header, int num_bands,
+                                                   int index, int num_nodes) {
+      // Each antenna's slice of the band is this long
+      size_t antenna_bytes = header.blocsize / ((size_t) header.nants * num_bands);
+      size_t first = (size_t) index * header.nants / num_nodes;
+      size_t last = (size_t) (index + 1) * header.nants / num_nodes;
+      return std::make_pair(first * antenna_bytes, last * antenna_bytes);
+    }
+
+    // Like readBandTasks, but partitions the work across NUMA nodes.
+    // The antennas are split into num_nodes contiguous groups, and (*tasks)[i] reads
+    // the group destined for node numa::nodeId(i). The part of the buffer each group
+    // lands in is also bound to its node, so run the tasks with numa::runOnNodes to
+    // keep both the I/O threads and the memory local. On single-node machines this
+    // is equivalent to readBandTasks with everything in (*tasks)[0].
+    void readBandTasksByNode(const Header& header, int band, int num_bands, char* buffer,
+                             int num_nodes,
+                             std::vector<std::vector<std::function<bool()> > >* tasks) const {
+      assert(num_nodes > 0);
+      tasks->resize(num_nodes);
+      std::vector<std::function<bool()> > flat;
+      readBandTasks(header, band, num_bands, buffer, &flat);
+      size_t page = sysconf(_SC_PAGESIZE);
+
+      for (int node = 0; node < num_nodes; ++node) {
+        int first = node * header.nants / num_nodes;
+        int last = (node + 1) * header.nants / num_nodes;
+        for (int antenna = first; antenna < last; ++antenna) {
+          (*tasks)[node].push_back(std::move(flat[antenna]));
+        }
+
+        // Only whole pages can be bound, so round the group inwards.
+        std::pair<size_t, size_t> range = nodeByteRange(header, num_bands, node, num_nodes);
+        uintptr_t begin = (uintptr_t) (buffer + range.first);
+        uintptr_t end = (uintptr_t) (buffer + range.second);
+        begin = (begin + page - 1) / page * page;
+        end = end / page * page;
+        if (end > begin) {
+          numa::placeOnNode((void*) begin, end - begin, numa::nodeId(node));
+        }
+      }
+    }
+
   };
 }
+
+// Defines Reader::blocks, which needs Reader to be complete.
+#include "block_view.h"
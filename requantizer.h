@@ -0,0 +1,288 @@
+#pragma once
+
+#include <assert.h>
+#include <complex>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "header.h"
+#include "thread_pool.h"
+
+/*
+  Converting float data back to the compact integer form of a .raw file, for
+  writing the output of beamforming, RFI excision and the like.
+
+  The input is complex floats in the data[antenna][channel][time][pol] layout,
+  and the output is the same layout with nbits of 8, 4 or 2. Each real and
+  imaginary value becomes a two's complement integer in
+  [-2^(nbits-1), 2^(nbits-1) - 1]. With fewer than 8 bits they are packed into
+  bytes high bits first, so a 4-bit byte is re << 4 | im.
+
+  Each antenna, channel and polarization gets its own offset and scale, from
+  running statistics over every block it has seen: the offset is the mean, and
+  the scale brings the standard deviation of the real and imaginary parts to
+  target_rms. Values that don't fit are clamped and counted as saturated.
+
+  Each row is summed and then quantized right away, while it is still in cache.
+*/
+
+namespace raw {
+
+  class Requantizer {
+  private:
+    int nbits;
+    float target_rms;
+    ThreadPool* pool;
+
+    int nants = 0;
+    int num_channels = 0;
+    int npol = 0;
+
+    // Running sums for each antenna, channel and polarization.
+    struct RunningStats {
+      double count = 0;
+      double sum_re = 0;
+      double sum_im = 0;
+      double sum_square = 0;
+    };
+    std::vector<RunningStats> stats;
+
+    // The offset and scale used for the last block, indexed [antenna][channel][pol].
+    std::vector<std::complex<float> > offsets;
+    std::vector<float> scales;
+
+    // Saturated values in the last block, per row.
+    std::vector<int64_t> row_saturated;
+    int64_t total_saturated = 0;
+
+    // Quantizes one row with per-pol offsets and scales.
+    template<int NBITS>
+    static int64_t quantizeRow(const float* in, int num_timesteps, int npol,
+                               const std::complex<float>* offset, const float* scale,
+                               uint8_t* out) {
+      const float lo = -(1 << (NBITS - 1));
+      const float hi = (1 << (NBITS - 1)) - 1;
+      const int per_byte = 8 / NBITS;
+      const int mask = (1 << NBITS) - 1;
+      int64_t saturated = 0;
+      int packed = 0;
+      int filled = 0;
+      for (int t = 0; t < num_timesteps; ++t) {
+        for (int pol = 0; pol < npol; ++pol) {
+          for (int k = 0; k < 2; ++k) {
+            float off = (k == 0) ? offset[pol].real() : offset[pol].imag();
+            float y = (*in++ - off) * scale[pol];
+            saturated += (y < lo) | (y > hi);
+            y = y < lo ? lo : (y > hi ? hi : y);
+            int q = (int) (y + (y >= 0 ? 0.5f : -0.5f));
+            if (NBITS == 8) {
+              *out++ = (uint8_t) q;
+              continue;
+            }
+            packed = (packed << NBITS) | (q & mask);
+            if (++filled == per_byte) {
+              *out++ = (uint8_t) packed;
+              packed = 0;
+              filled = 0;
+            }
+          }
+        }
+      }
+      return saturated;
+    }
+
+#ifdef __AVX2__
+    // quantizeRow<8> for npol of 1 or 2, 8 floats at a time.
+    static int64_t quantizeRow8AVX2(const float* in, int num_timesteps, int npol,
+                                    const std::complex<float>* offset, const float* scale,
+                                    uint8_t* out) {
+      // 8 floats are 4 complex values, which is a whole number of timesteps.
+      float off_lanes[8];
+      float scale_lanes[8];
+      for (int j = 0; j < 8; ++j) {
+        int pol = (j / 2) % npol;
+        off_lanes[j] = (j % 2 == 0) ? offset[pol].real() : offset[pol].imag();
+        scale_lanes[j] = scale[pol];
+      }
+      const __m256 off = _mm256_loadu_ps(off_lanes);
+      const __m256 sc = _mm256_loadu_ps(scale_lanes);
+      const __m256 lo = _mm256_set1_ps(-128.0f);
+      const __m256 hi = _mm256_set1_ps(127.0f);
+      int64_t saturated = 0;
+      size_t size = (size_t) num_timesteps * npol * 2;
+      size_t vector_size = size / 32 * 32;
+      for (size_t i = 0; i < vector_size; i += 32) {
+        __m256i q[4];
+        for (int j = 0; j < 4; ++j) {
+          __m256 y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(in + i + 8 * j), off), sc);
+          __m256 outside = _mm256_or_ps(_mm256_cmp_ps(y, lo, _CMP_LT_OQ),
+                                        _mm256_cmp_ps(y, hi, _CMP_GT_OQ));
+          saturated += __builtin_popcount(_mm256_movemask_ps(outside));
+          // Rounds half away from zero, like the scalar version
+          __m256 half = _mm256_or_ps(_mm256_set1_ps(0.5f),
+                                     _mm256_and_ps(y, _mm256_set1_ps(-0.0f)));
+          y = _mm256_min_ps(_mm256_max_ps(y, lo), hi);
+          q[j] = _mm256_cvttps_epi32(_mm256_add_ps(y, half));
+        }
+        // The packs work within 128-bit lanes, so put the bytes back in order after.
+        __m256i q16a = _mm256_packs_epi32(q[0], q[1]);
+        __m256i q16b = _mm256_packs_epi32(q[2], q[3]);
+        __m256i q8 = _mm256_packs_epi16(q16a, q16b);
+        q8 = _mm256_permutevar8x32_epi32(q8, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*) (out + i), q8);
+      }
+      // The leftover floats always start at pol 0, since 32 is a multiple of 2 * npol.
+      return saturated + quantizeRow<8>(in + vector_size, (size - vector_size) / (2 * npol),
+                                        npol, offset, scale, out + vector_size);
+    }
+#endif
+
+    int64_t quantize(const float* in, int num_timesteps, const std::complex<float>* offset,
+                     const float* scale, uint8_t* out) const {
+      switch (nbits) {
+      case 8:
+#ifdef __AVX2__
+        if (npol <= 2) {
+          return quantizeRow8AVX2(in, num_timesteps, npol, offset, scale, out);
+        }
+#endif
+        return quantizeRow<8>(in, num_timesteps, npol, offset, scale, out);
+      case 4:
+        return quantizeRow<4>(in, num_timesteps, npol, offset, scale, out);
+      default:
+        return quantizeRow<2>(in, num_timesteps, npol, offset, scale, out);
+      }
+    }
+
+    // Updates the statistics with one row, sets its offsets and scales, and
+    // quantizes it.
+    void processRow(int r, const float* in, int num_timesteps, uint8_t* out) {
+      RunningStats* s = stats.data() + (size_t) r * npol;
+      for (int pol = 0; pol < npol; ++pol) {
+        double sum_re = 0;
+        double sum_im = 0;
+        double sum_square = 0;
+        for (int t = 0; t < num_timesteps; ++t) {
+          float re = in[(t * npol + pol) * 2];
+          float im = in[(t * npol + pol) * 2 + 1];
+          sum_re += re;
+          sum_im += im;
+          sum_square += re * re + im * im;
+        }
+        s[pol].count += num_timesteps;
+        s[pol].sum_re += sum_re;
+        s[pol].sum_im += sum_im;
+        s[pol].sum_square += sum_square;
+
+        double mean_re = s[pol].sum_re / s[pol].count;
+        double mean_im = s[pol].sum_im / s[pol].count;
+        double variance = (s[pol].sum_square / s[pol].count - mean_re * mean_re -
+                           mean_im * mean_im) / 2;
+        offsets[(size_t) r * npol + pol] = std::complex<float>(mean_re, mean_im);
+        scales[(size_t) r * npol + pol] = (variance > 0) ? target_rms / sqrt(variance) : 1.0f;
+      }
+      row_saturated[r] = quantize(in, num_timesteps, offsets.data() + (size_t) r * npol,
+                                  scales.data() + (size_t) r * npol, out);
+    }
+
+  public:
+    // A reasonable target_rms for each nbits. With 8 bits there's plenty of
+    // headroom for bursts, and with fewer bits the levels are spread over most
+    // of the signal's range.
+    static float defaultTargetRMS(int nbits) {
+      return (nbits == 8) ? 32.0f : (nbits == 4) ? 3.0f : 1.0f;
+    }
+
+    // nbits must be 8, 4 or 2.
+    // Rows are quantized in parallel on the pool, if one is provided.
+    explicit Requantizer(int nbits, float target_rms = 0, ThreadPool* pool = nullptr)
+      : nbits(nbits), target_rms(target_rms > 0 ? target_rms : defaultTargetRMS(nbits)),
+        pool(pool) {
+      assert(nbits == 8 || nbits == 4 || nbits == 2);
+    }
+
+    // The size of the output for a block of this shape, in bytes.
+    size_t outputSize(const BlockShape& shape) const {
+      return (size_t) shape.nants * shape.num_channels * shape.rowSize() * 2 * nbits / 8;
+    }
+
+    // Quantizes a block of complex floats, as (re, im) pairs, into output, which
+    // must hold outputSize(shape) bytes.
+    // Returns false without doing anything if the shape doesn't match the blocks
+    // that came before, or if a row doesn't fill a whole number of bytes.
+    bool process(const BlockShape& shape, const float* input, char* output) {
+      if (shape.rowSize() * 2 * nbits % 8 != 0) {
+        return false;
+      }
+      if (stats.empty()) {
+        nants = shape.nants;
+        num_channels = shape.num_channels;
+        npol = shape.npol;
+        size_t size = (size_t) nants * num_channels * npol;
+        stats.assign(size, RunningStats());
+        offsets.assign(size, 0);
+        scales.assign(size, 1.0f);
+      } else if (shape.nants != nants || shape.num_channels != num_channels ||
+                 shape.npol != npol) {
+        return false;
+      }
+
+      int rows = nants * num_channels;
+      row_saturated.assign(rows, 0);
+      size_t in_row = shape.rowSize() * 2;
+      size_t out_row = in_row * nbits / 8;
+      forRanges(pool, rows, [&](int first, int last) {
+        for (int r = first; r < last; ++r) {
+          processRow(r, input + r * in_row, shape.num_timesteps,
+                     (uint8_t*) output + r * out_row);
+        }
+      });
+      for (int64_t n : row_saturated) {
+        total_saturated += n;
+      }
+      return true;
+    }
+
+    bool process(const BlockShape& shape, const std::complex<float>* input, char* output) {
+      return process(shape, (const float*) input, output);
+    }
+
+    // The offset that was subtracted from one antenna, channel and polarization
+    // in the last block.
+    std::complex<float> offset(int antenna, int channel, int pol) const {
+      return offsets[((size_t) antenna * num_channels + channel) * npol + pol];
+    }
+
+    // The scale that was applied after the offset in the last block.
+    // Dividing a quantized value by it and adding the offset recovers the input.
+    float scale(int antenna, int channel, int pol) const {
+      return scales[((size_t) antenna * num_channels + channel) * npol + pol];
+    }
+
+    // How many real and imaginary values were clamped in the last block.
+    int64_t lastSaturated() const {
+      int64_t total = 0;
+      for (int64_t n : row_saturated) {
+        total += n;
+      }
+      return total;
+    }
+
+    // How many were clamped since the last reset.
+    int64_t totalSaturated() const {
+      return total_saturated;
+    }
+
+    // Forgets the running statistics, so the next block starts them over.
+    void reset() {
+      stats.clear();
+      row_saturated.clear();
+      total_saturated = 0;
+    }
+  };
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "block_stats.h"
+#include "header.h"
+#include "thread_pool.h"
+
+/*
+  Flagging radio frequency interference with the spectral kurtosis estimator.
+
+  For M power samples P of one antenna, channel, and polarization, the spectral
+  kurtosis is
+
+    SK = (M + 1) / (M - 1) * (M * sum(P^2) / sum(P)^2 - 1)
+
+  which is 1 for Gaussian noise, whatever its power. A steady tone pushes it
+  toward 0 and bursty interference pushes it above 1, so windows where it is
+  too many standard deviations from 1 are flagged.
+
+  The power sums come straight from the int8 data, using the same vectorized
+  loops as computeBlockStats. Each row of a block, meaning every timestep of one
+  antenna and channel, is read once. Excision only touches the flagged windows
+  of a row right after they were summed, while they are still in cache.
+*/
+
+namespace raw {
+
+  // What to do with the data in flagged windows.
+  enum class Excision {
+    // Leave it alone. Only the flags are computed.
+    NONE,
+
+    // Set it to zero.
+    ZERO,
+
+    // Replace it with Gaussian noise at the mean power of the row's unflagged
+    // windows, so that later integrations aren't biased low.
+    NOISE,
+  };
+
+  // The standard deviation of SK for Gaussian noise, from Nita & Gary (2010).
+  inline double spectralKurtosisStddev(int m) {
+    double var = 4.0 * m * m / ((m - 1.0) * (m + 2.0) * (m + 3.0));
+    return sqrt(var);
+  }
+
+  // The spectral kurtosis of m power samples with the given sums.
+  // Returns 1 when there's nothing to measure, so the window isn't flagged.
+  inline double spectralKurtosis(int m, int64_t power_sum, int64_t power_square_sum) {
+    if (m < 2 || power_sum == 0) {
+      return 1.0;
+    }
+    double s1 = power_sum;
+    return (m + 1.0) / (m - 1.0) * (m * (double) power_square_sum / (s1 * s1) - 1.0);
+  }
+
+  /*
+    The typical workflow:
+
+      raw::Reader reader(filename);
+      raw::Header header;
+      raw::RFIFlagger flagger(256, 4.0, raw::Excision::NOISE);
+      std::vector<char> data;
+      while (reader.readHeader(&header)) {
+        data.resize(header.blocsize);
+        reader.readData(data.data());
+        flagger.process(header, data.data());
+        // data is cleaned, and flagger.flagged(...) says what was removed
+      }
+  */
+  class RFIFlagger {
+  private:
+    int window;
+    double threshold;
+    Excision excision;
+    ThreadPool* pool;
+
+    BlockShape shape;
+    int num_windows = 0;
+    int64_t blocks_processed = 0;
+
+    // One byte per window, indexed [antenna][channel][pol][window], 1 for flagged.
+    std::vector<uint8_t> flags;
+
+    // How many windows each row flagged, so the total doesn't need a lock.
+    std::vector<int> row_flagged;
+
+    // The number of timesteps in window w.
+    int windowSteps(int w) const {
+      int steps = shape.num_timesteps - w * window;
+      return steps < window ? steps : window;
+    }
+
+    // Fills a window of one polarization with noise of the given mean power.
+    void fillNoise(int8_t* row, int t0, int steps, int pol, double power,
+                   uint64_t* state) const {
+      // The sum of four uniforms, less 2, has mean 0 and variance 1/3.
+      // Each of re and im gets half the power.
+      float scale = sqrt(3.0 * power / 2.0);
+      for (int t = t0; t < t0 + steps; ++t) {
+        for (int k = 0; k < 2; ++k) {
+          // xorshift64*
+          *state ^= *state >> 12;
+          *state ^= *state << 25;
+          *state ^= *state >> 27;
+          uint64_t bits = *state * 2685821657736338717ull;
+          float sum = 0;
+          for (int j = 0; j < 4; ++j) {
+            sum += ((bits >> (16 * j)) & 0xffff) / 65536.0f;
+          }
+          float x = roundf((sum - 2.0f) * scale);
+          row[(t * shape.npol + pol) * 2 + k] = (int8_t) (x > 127 ? 127 : (x < -127 ? -127 : x));
+        }
+      }
+    }
+
+    // Flags, and possibly excises, one row.
+    void processRow(int r, int8_t* row) {
+      int npol = shape.npol;
+      std::vector<int64_t> sums(3 * npol);
+      std::vector<double> clean_power(npol, 0.0);
+      std::vector<int> clean_steps(npol, 0);
+      uint8_t* row_flags = flags.data() + (size_t) r * npol * num_windows;
+      int flagged = 0;
+
+      for (int w = 0; w < num_windows; ++w) {
+        int steps = windowSteps(w);
+        std::fill(sums.begin(), sums.end(), 0);
+        int64_t* ps = sums.data();
+        int64_t* pss = ps + npol;
+        rowSums(row + (size_t) w * window * npol * 2, steps, npol, ps, pss, pss + npol);
+
+        double limit = (steps >= 2) ? threshold * spectralKurtosisStddev(steps) : 0;
+        for (int pol = 0; pol < npol; ++pol) {
+          double sk = spectralKurtosis(steps, ps[pol], pss[pol]);
+          bool bad = steps >= 2 && fabs(sk - 1.0) > limit;
+          row_flags[pol * num_windows + w] = bad;
+          if (bad) {
+            ++flagged;
+            if (excision == Excision::ZERO) {
+              for (int t = w * window; t < w * window + steps; ++t) {
+                row[(t * npol + pol) * 2] = 0;
+                row[(t * npol + pol) * 2 + 1] = 0;
+              }
+            }
+          } else {
+            clean_power[pol] += ps[pol];
+            clean_steps[pol] += steps;
+          }
+        }
+      }
+      row_flagged[r] = flagged;
+
+      if (excision != Excision::NOISE || flagged == 0) {
+        return;
+      }
+      uint64_t state = ((uint64_t) blocks_processed << 32 | (uint32_t) r) *
+        0x9e3779b97f4a7c15ull + 1;
+      for (int pol = 0; pol < npol; ++pol) {
+        double power = clean_steps[pol] > 0 ? clean_power[pol] / clean_steps[pol] : 0.0;
+        for (int w = 0; w < num_windows; ++w) {
+          if (row_flags[pol * num_windows + w]) {
+            fillNoise(row, w * window, windowSteps(w), pol, power, &state);
+          }
+        }
+      }
+    }
+
+  public:
+    // window is the number of timesteps per SK estimate, and a window is flagged
+    // when its SK is more than threshold standard deviations from 1. A last
+    // window shorter than window is estimated from the timesteps it has.
+    // Rows are processed in parallel on the pool, if one is provided.
+    RFIFlagger(int window, double threshold = 4.0, Excision excision = Excision::NONE,
+               ThreadPool* pool = nullptr)
+      : window(window), threshold(threshold), excision(excision), pool(pool),
+        shape(0, 0, 0, 0) {
+      assert(window > 0);
+    }
+
+    // Computes the flags for a block, or a readBand band, and excises the
+    // flagged windows from data unless excision is NONE.
+    void process(const BlockShape& block_shape, char* data) {
+      shape = block_shape;
+      num_windows = (shape.num_timesteps + window - 1) / window;
+      int rows = shape.nants * shape.num_channels;
+      flags.assign((size_t) rows * shape.npol * num_windows, 0);
+      row_flagged.assign(rows, 0);
+      size_t row_bytes = shape.rowSize() * 2;
+      forRanges(pool, rows, [&](int first, int last) {
+        for (int r = first; r < last; ++r) {
+          processRow(r, (int8_t*) data + (size_t) r * row_bytes);
+        }
+      });
+      ++blocks_processed;
+    }
+
+    void process(const Header& header, char* data) {
+      process(BlockShape(header), data);
+    }
+
+    // The number of windows per row in the last block.
+    int numWindows() const {
+      return num_windows;
+    }
+
+    // Whether a window of the last block was flagged.
+    bool flagged(int antenna, int channel, int pol, int w) const {
+      return flags[(((size_t) antenna * shape.num_channels + channel) * shape.npol + pol) *
+                   num_windows + w];
+    }
+
+    // The flags for the last block, indexed [antenna][channel][pol][window],
+    // 1 for flagged.
+    const std::vector<uint8_t>& mask() const {
+      return flags;
+    }
+
+    // How many windows of the last block were flagged.
+    int64_t numFlagged() const {
+      int64_t total = 0;
+      for (int n : row_flagged) {
+        total += n;
+      }
+      return total;
+    }
+  };
+}
@@ -0,0 +1,14 @@
+#!/bin/bash -e
+
+# Runs the benchmarks on a synthetic file and appends the results, labeled
+# with the current commit, to bench_output.txt.
+# Any arguments are passed through to the bench binary, e.g. --cold.
+
+mkdir -p build
+cd build
+
+cmake ..
+cmake --build .
+
+LABEL=`git rev-parse --short HEAD`
+./bench --label $LABEL "$@" | tee -a ../bench_output.txt
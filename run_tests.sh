@@ -1,5 +1,6 @@
 #!/bin/bash -e
 
+mkdir -p build
 cd build
 
 # Configure
@@ -8,17 +9,18 @@ cmake ..
 # Compile & link
 cmake --build .
 
+# Tests against synthetic data
+./tests
+
 # For testing at Berkeley
 # TESTFILE="/mnt_blpd18/datax/incoming/guppi_59711_53086_001288_J0408-15-0_0001.0000.raw"
 
 # For testing on a local machine
-TESTFILE=`readlink -f ~/seticore/data/golden_synthesized_input.0000.raw`
+TESTFILE=`readlink -f ~/seticore/data/golden_synthesized_input.0000.raw || true`
 
 if [ ! -f "$TESTFILE" ]; then
-    echo could not find testfile: $TESTFILE
-    exit 1
+    echo could not find testfile: $TESTFILE, skipping the real-data test
+    exit 0
 fi
 
 time ./tests $TESTFILE
-
-
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "error_message.h"
+#include "header.h"
+#include "reader.h"
+#include "util.h"
+
+/*
+  Reading blocks straight out of a hashpipe shared-memory ring.
+
+  hashpipe recorders keep blocks in a "databuf": a SysV shared memory segment
+  that starts with a HashpipeDatabuf struct, followed, at offset header_size,
+  by n_block blocks of block_size bytes each. Every block begins with a
+  GUPPI header and the data follows at a fixed offset, which is
+  BLOCK_HDR_SIZE = 5*80*512 bytes in hpguppi.
+
+  Each block has a SysV semaphore in a set of n_block semaphores: 1 means the
+  block is filled and 0 means it is free. The producer waits for a block to be
+  free, fills it, and sets it to 1. The consumer waits for it to be filled,
+  processes it in place, and sets it back to 0.
+*/
+
+namespace raw {
+
+  // The size of the header area at the start of each hpguppi block.
+  const size_t HPGUPPI_BLOCK_HDR_SIZE = 5 * 80 * 512;
+
+  // The struct at the start of a hashpipe databuf.
+  struct HashpipeDatabuf {
+    char data_type[64];
+    size_t header_size;
+    size_t block_size;
+    int n_block;
+    int shmid;
+    int semid;
+  };
+
+  // The argument to semctl, which callers have to define.
+  union SemaphoreArg {
+    int val;
+    struct semid_ds* buf;
+    unsigned short* array;
+  };
+
+  /*
+    Reads blocks from a hashpipe databuf as they are filled, without copying them.
+
+    The typical workflow is like Reader, except that data points into the shared
+    memory instead of being read into a buffer:
+
+      raw::ShmRingReader reader(key);
+      raw::Header header;
+      while (reader.readHeader(&header)) {
+        handleData(reader.data(), header.blocsize);
+      }
+
+    The block stays owned by the reader until the next readHeader, which hands it
+    back to the producer, so data() is only valid until then.
+
+    Waiting for a block sleeps on its semaphore, so there is no polling.
+  */
+  class ShmRingReader {
+  private:
+    char* base = nullptr;
+    HashpipeDatabuf* databuf = nullptr;
+    size_t block_header_size;
+
+    // How long readHeader waits for a block, in milliseconds. Negative is forever.
+    int timeout_ms;
+
+    // The block we will read next, or are currently reading.
+    int block_id;
+
+    // Whether block_id holds a block the caller is working on.
+    bool holding = false;
+
+    bool timed_out = false;
+
+    // The size of the current block's data.
+    size_t current_blocsize = 0;
+
+    // How many headers have already been read from the ring
+    int headers_read = 0;
+
+    // For counting missing blocks. See setMissingBlocks.
+    int64_t pktidx = 0;
+    int64_t pktidx_step = 0;
+
+    // Once err is used, the reader is in "error state".
+    ErrorMessage err = ErrorMessage();
+
+    char* blockStart(int block) const {
+      return base + databuf->header_size + block * databuf->block_size;
+    }
+
+    // Hands the current block back to the producer and moves on to the next.
+    void release() {
+      if (!holding) {
+        return;
+      }
+      SemaphoreArg arg;
+      arg.val = 0;
+      if (semctl(databuf->semid, block_id, SETVAL, arg) != 0) {
+        err << "could not mark block " << block_id << " free";
+      }
+      holding = false;
+      block_id = (block_id + 1) % databuf->n_block;
+    }
+
+    // Waits until the block is filled. Returns false on timeout or error.
+    bool waitFilled() {
+      // Waiting for the value to be positive, then putting it back, as one atomic
+      // operation, leaves the block marked filled while we use it.
+      struct sembuf ops[2];
+      ops[0].sem_num = ops[1].sem_num = block_id;
+      ops[0].sem_flg = ops[1].sem_flg = 0;
+      ops[0].sem_op = -1;
+      ops[1].sem_op = 1;
+
+      struct timespec timeout;
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      while (true) {
+        int rv = semtimedop(databuf->semid, ops, 2, timeout_ms < 0 ? nullptr : &timeout);
+        if (rv == 0) {
+          return true;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          timed_out = true;
+        } else {
+          err << "error waiting for block " << block_id << ": errno = " << errno;
+        }
+        return false;
+      }
+    }
+
+  public:
+    // Attaches to the databuf with the given SysV key.
+    // block_header_size is where data starts within each block.
+    ShmRingReader(key_t key, int timeout_ms = -1,
+                  size_t block_header_size = HPGUPPI_BLOCK_HDR_SIZE, int start_block = 0)
+      : block_header_size(block_header_size), timeout_ms(timeout_ms),
+        block_id(start_block) {
+      int shmid = shmget(key, 0, 0);
+      if (shmid < 0) {
+        err << "no shared memory segment with key " << key;
+        return;
+      }
+      void* p = shmat(shmid, nullptr, SHM_RDONLY);
+      if (p == (void*) -1) {
+        err << "could not attach shared memory segment with key " << key;
+        return;
+      }
+      base = (char*) p;
+      databuf = (HashpipeDatabuf*) base;
+      if (databuf->n_block <= 0 || block_header_size >= databuf->block_size ||
+          start_block < 0 || start_block >= databuf->n_block) {
+        err << "unexpected databuf layout for key " << key;
+      }
+    }
+
+    ShmRingReader(const ShmRingReader&) = delete;
+    ShmRingReader& operator=(ShmRingReader&) = delete;
+
+    ~ShmRingReader() {
+      if (base != nullptr) {
+        release();
+        shmdt(base);
+      }
+    }
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used;
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err;
+    }
+
+    // Whether the last readHeader returned false because it timed out.
+    // Calling readHeader again will keep waiting for the same block.
+    bool timedOut() const {
+      return timed_out;
+    }
+
+    // Releases the current block and waits for the next one to be filled, then
+    // reads its header.
+    // Returns false on error or timeout. Check error() and timedOut() to tell which.
+    bool readHeader(Header* header) {
+      timed_out = false;
+      if (error()) {
+        return false;
+      }
+      release();
+      if (error() || !waitFilled()) {
+        return false;
+      }
+      holding = true;
+
+      char* start = blockStart(block_id);
+      size_t size = std::min(block_header_size, (size_t) MAX_RAW_HEADER_SIZE);
+      memcpy(header->buffer, start, size);
+      memset(header->buffer + size, 0, MAX_RAW_HEADER_SIZE - size);
+      rawspec_raw_parse_header(header);
+      header->hdr_size = rawspec_raw_header_size(header->buffer, size, 0);
+      if (header->hdr_size == 0 || !rawspec_raw_check_header(header)) {
+        err << "bad header in block " << block_id;
+        return false;
+      }
+      if (header->blocsize > databuf->block_size - block_header_size) {
+        err << "blocsize " << header->blocsize << " does not fit in block " << block_id;
+        return false;
+      }
+      header->data_offset = start + block_header_size - base;
+      if (!setBlockDimensions(header, err)) {
+        return false;
+      }
+      setMissingBlocks(header, headers_read, pktidx, &pktidx_step);
+      pktidx = header->pktidx;
+      current_blocsize = header->blocsize;
+      ++headers_read;
+      return true;
+    }
+
+    // The data for the current block, in shared memory.
+    // Valid until the next readHeader.
+    const char* data() const {
+      return blockStart(block_id) + block_header_size;
+    }
+
+    // Copies all data from the current block into the buffer.
+    // Returns whether it worked.
+    bool readData(char* buffer) {
+      if (error() || !holding) {
+        return false;
+      }
+      memcpy(buffer, data(), current_blocsize);
+      return true;
+    }
+
+    // Copies a frequency subband of the current block into the buffer, with the
+    // same layout as Reader::readBand.
+    // Returns whether it worked.
+    bool readBand(const Header& header, int band, int num_bands, char* buffer) {
+      if (error() || !holding) {
+        return false;
+      }
+      assert(0 == header.num_channels % num_bands);
+      assert(band < num_bands);
+      size_t band_bytes = (size_t) header.num_channels / num_bands * header.num_timesteps *
+        header.npol * 2;
+      for (int antenna = 0; antenna < header.nants; ++antenna) {
+        memcpy(buffer + antenna * band_bytes,
+               data() + (antenna * num_bands + band) * band_bytes, band_bytes);
+      }
+      return true;
+    }
+  };
+
+  /*
+    Creates a hashpipe-style databuf and fills it, standing in for a recorder.
+    This is for testing consumers without running hashpipe. The segment and
+    semaphores are removed when the producer is destroyed.
+  */
+  class ShmRingProducer {
+  private:
+    char* base = nullptr;
+    HashpipeDatabuf* databuf = nullptr;
+    int shmid = -1;
+    int semid = -1;
+
+    // Once err is used, the producer is in "error state".
+    ErrorMessage err = ErrorMessage();
+
+  public:
+    ShmRingProducer(key_t key, int n_block, size_t block_size) {
+      size_t header_size = 4096;
+      shmid = shmget(key, header_size + n_block * block_size, IPC_CREAT | IPC_EXCL | 0666);
+      if (shmid < 0) {
+        err << "could not create shared memory segment with key " << key;
+        return;
+      }
+      semid = semget(key, n_block, IPC_CREAT | IPC_EXCL | 0666);
+      if (semid < 0) {
+        err << "could not create semaphores with key " << key;
+        return;
+      }
+      void* p = shmat(shmid, nullptr, 0);
+      if (p == (void*) -1) {
+        err << "could not attach shared memory segment with key " << key;
+        return;
+      }
+      base = (char*) p;
+      databuf = (HashpipeDatabuf*) base;
+      memset(databuf, 0, sizeof(HashpipeDatabuf));
+      strncpy(databuf->data_type, "GUPPI RAW", sizeof(databuf->data_type) - 1);
+      databuf->header_size = header_size;
+      databuf->block_size = block_size;
+      databuf->n_block = n_block;
+      databuf->shmid = shmid;
+      databuf->semid = semid;
+      for (int i = 0; i < n_block; ++i) {
+        SemaphoreArg arg;
+        arg.val = 0;
+        semctl(semid, i, SETVAL, arg);
+      }
+    }
+
+    ShmRingProducer(const ShmRingProducer&) = delete;
+    ShmRingProducer& operator=(ShmRingProducer&) = delete;
+
+    ~ShmRingProducer() {
+      if (base != nullptr) {
+        shmdt(base);
+      }
+      if (shmid >= 0) {
+        shmctl(shmid, IPC_RMID, nullptr);
+      }
+      if (semid >= 0) {
+        semctl(semid, 0, IPC_RMID);
+      }
+    }
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used;
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err;
+    }
+
+    // The start of a block, where its header goes.
+    char* block(int block_id) {
+      return base + databuf->header_size + block_id * databuf->block_size;
+    }
+
+    // Waits until the consumer has freed the block.
+    bool waitFree(int block_id) {
+      struct sembuf op;
+      op.sem_num = block_id;
+      op.sem_op = 0;
+      op.sem_flg = 0;
+      while (semop(semid, &op, 1) != 0) {
+        if (errno != EINTR) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Marks the block filled, handing it to the consumer.
+    bool setFilled(int block_id) {
+      SemaphoreArg arg;
+      arg.val = 1;
+      return 0 == semctl(semid, block_id, SETVAL, arg);
+    }
+  };
+}
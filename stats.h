@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+// Opt-in instrumentation for the I/O and parsing done by the library.
+//
+// Define RAW_STATS before including raw.h to turn it on. Without it, the
+// counting code compiles away entirely and Reader has no stats() method, so
+// there is no cost to leaving the hooks in place.
+
+#ifdef RAW_STATS
+#define RAW_STATS_ONLY(x) x
+#else
+#define RAW_STATS_ONLY(x)
+#endif
+
+namespace raw {
+  // Nanoseconds on the monotonic clock.
+  inline uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  // A histogram of latencies with power-of-two buckets.
+  // Bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds, with bucket 0 also
+  // holding zero, and the last bucket holding everything too large for the others.
+  struct LatencyHistogram {
+    static const int NUM_BUCKETS = 40;
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+
+    LatencyHistogram() {
+      reset();
+    }
+
+    void add(uint64_t ns) {
+      int bucket = 0;
+      while (ns > 1 && bucket < NUM_BUCKETS - 1) {
+        ns >>= 1;
+        ++bucket;
+      }
+      buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+      uint64_t total = 0;
+      for (int i = 0; i < NUM_BUCKETS; ++i) {
+        total += buckets[i].load(std::memory_order_relaxed);
+      }
+      return total;
+    }
+
+    void reset() {
+      for (int i = 0; i < NUM_BUCKETS; ++i) {
+        buckets[i].store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  /*
+    Counters for the work a Reader has done.
+
+    The counters are atomic because readBand tasks may run on several threads
+    at once. Times are summed across threads, so with parallel band reads
+    read_ns can exceed wall-clock time.
+  */
+  struct Stats {
+    // Bytes returned by read and pread calls, including header bytes.
+    std::atomic<uint64_t> bytes_read{0};
+
+    // Number of read, pread, and lseek system calls.
+    std::atomic<uint64_t> syscalls{0};
+
+    // Number of headers that were parsed.
+    std::atomic<uint64_t> headers_parsed{0};
+
+    // Number of data blocks or bands that were read.
+    std::atomic<uint64_t> blocks_read{0};
+
+    // Time spent inside read and pread calls.
+    std::atomic<uint64_t> read_ns{0};
+
+    // Time spent parsing header text into fields.
+    std::atomic<uint64_t> parse_ns{0};
+
+    // Time spent inside lseek calls.
+    std::atomic<uint64_t> seek_ns{0};
+
+    // The latency of each readData or readBand call.
+    LatencyHistogram block_latency;
+
+    // Throughput of the read calls themselves, in MB/s.
+    double megabytesPerSecond() const {
+      uint64_t ns = read_ns.load(std::memory_order_relaxed);
+      if (ns == 0) {
+        return 0.0;
+      }
+      return bytes_read.load(std::memory_order_relaxed) * 1000.0 / ns;
+    }
+
+    void reset() {
+      bytes_read = 0;
+      syscalls = 0;
+      headers_parsed = 0;
+      blocks_read = 0;
+      read_ns = 0;
+      parse_ns = 0;
+      seek_ns = 0;
+      block_latency.reset();
+    }
+
+    // Records a read-style syscall that took the time since start.
+    void addRead(uint64_t start, ssize_t bytes) {
+      read_ns.fetch_add(nowNanos() - start, std::memory_order_relaxed);
+      syscalls.fetch_add(1, std::memory_order_relaxed);
+      if (bytes > 0) {
+        bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+      }
+    }
+
+    // Records an lseek that took the time since start.
+    void addSeek(uint64_t start) {
+      seek_ns.fetch_add(nowNanos() - start, std::memory_order_relaxed);
+      syscalls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Records a header parse that took the time since start.
+    void addParse(uint64_t start) {
+      parse_ns.fetch_add(nowNanos() - start, std::memory_order_relaxed);
+      headers_parsed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Records a completed block or band read that took the time since start.
+    void addBlock(uint64_t start) {
+      block_latency.add(nowNanos() - start);
+      blocks_read.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The counters as a JSON object.
+    // The histogram is a list of bucket counts, trimmed after the last nonzero bucket.
+    std::string toJson() const {
+      std::stringstream ss;
+      ss << "{\"bytes_read\": " << bytes_read
+         << ", \"syscalls\": " << syscalls
+         << ", \"headers_parsed\": " << headers_parsed
+         << ", \"blocks_read\": " << blocks_read
+         << ", \"read_ns\": " << read_ns
+         << ", \"parse_ns\": " << parse_ns
+         << ", \"seek_ns\": " << seek_ns
+         << ", \"mb_per_second\": " << megabytesPerSecond()
+         << ", \"block_latency_log2_ns\": [";
+      int last = LatencyHistogram::NUM_BUCKETS - 1;
+      while (last >= 0 && block_latency.buckets[last] == 0) {
+        --last;
+      }
+      for (int i = 0; i <= last; ++i) {
+        if (i > 0) {
+          ss << ", ";
+        }
+        ss << block_latency.buckets[i];
+      }
+      ss << "]}";
+      return ss.str();
+    }
+  };
+}
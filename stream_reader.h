@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "error_message.h"
+#include "header.h"
+#include "reader.h"
+#include "util.h"
+
+namespace raw {
+
+  /*
+    Reads a raw data stream from a descriptor that can't seek, like a pipe or stdin.
+
+    Reader finds headers by reading ahead and then seeking back, and skips unread
+    data by seeking forwards. StreamReader instead reads into its own ring buffer,
+    parses headers out of the buffered bytes, and skips data by consuming it.
+
+    readData copies whatever part of the block is already buffered into the
+    caller's buffer, and reads the rest of the block directly into it, so each
+    byte is copied at most once.
+
+    Since the stream can only be read once, each block can only be read once, by
+    either readData or readBand, and only before the next readHeader.
+  */
+  class StreamReader {
+  private:
+    int fdin;
+
+    // Whether we opened fdin, and so should close it.
+    bool owns_fd;
+
+    // The ring buffer. Bytes [head, head + buffered) modulo its size are the
+    // next bytes of the stream.
+    std::vector<char> ring;
+    size_t head = 0;
+    size_t buffered = 0;
+
+    // Whether we have seen the end of the stream.
+    bool eof = false;
+
+    // How many headers have already been read from this stream
+    int headers_read = 0;
+
+    // The number of bytes of the current block that haven't been consumed yet.
+    size_t block_remaining = 0;
+
+    // How many bytes of the stream have been consumed.
+    off_t position = 0;
+
+    // For counting missing blocks. See setMissingBlocks.
+    int64_t pktidx = 0;
+    int64_t pktidx_step = 0;
+
+    // Once err is used, the reader is in "error state".
+    ErrorMessage err = ErrorMessage();
+
+    // Reads from fdin into the free part of the ring, at most once.
+    // Returns the number of bytes read, 0 at the end of the stream, -1 on error.
+    ssize_t fillOnce() {
+      size_t tail = (head + buffered) % ring.size();
+      size_t free_bytes = ring.size() - buffered;
+      struct iovec iov[2];
+      int iovcnt = 1;
+      iov[0].iov_base = ring.data() + tail;
+      iov[0].iov_len = std::min(free_bytes, ring.size() - tail);
+      if (iov[0].iov_len < free_bytes) {
+        iov[1].iov_base = ring.data();
+        iov[1].iov_len = free_bytes - iov[0].iov_len;
+        iovcnt = 2;
+      }
+      ssize_t n;
+      do {
+        n = readv(fdin, iov, iovcnt);
+      } while (n < 0 && errno == EINTR);
+      if (n == 0) {
+        eof = true;
+      } else if (n > 0) {
+        buffered += n;
+      }
+      return n;
+    }
+
+    // Buffers at least min_bytes, unless the stream ends first.
+    // Returns false on a read error.
+    bool fill(size_t min_bytes) {
+      while (buffered < min_bytes && !eof) {
+        if (fillOnce() < 0) {
+          err << "error reading from " << filename;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Copies up to size buffered bytes into dest and consumes them.
+    // Returns how many were copied.
+    size_t take(char* dest, size_t size) {
+      size = std::min(size, buffered);
+      size_t first = std::min(size, ring.size() - head);
+      if (dest != nullptr) {
+        memcpy(dest, ring.data() + head, first);
+        memcpy(dest + first, ring.data(), size - first);
+      }
+      head = (head + size) % ring.size();
+      buffered -= size;
+      position += size;
+      return size;
+    }
+
+    // Copies up to size buffered bytes into dest without consuming them.
+    size_t peek(char* dest, size_t size) const {
+      size = std::min(size, buffered);
+      size_t first = std::min(size, ring.size() - head);
+      memcpy(dest, ring.data() + head, first);
+      memcpy(dest + first, ring.data(), size - first);
+      return size;
+    }
+
+    // Consumes size bytes of the stream, into dest unless it is nullptr.
+    // Bytes that aren't buffered yet are read straight into dest.
+    // Returns how many bytes were consumed, which is less than size at the end of
+    // the stream, or -1 on a read error.
+    ssize_t consume(char* dest, size_t size) {
+      size_t done = take(dest, size);
+      while (done < size) {
+        if (dest == nullptr) {
+          // Skipping. Read through the ring so we don't need another buffer.
+          if (!fill(1)) {
+            return -1;
+          }
+          if (buffered == 0) {
+            break;
+          }
+          done += take(nullptr, size - done);
+          continue;
+        }
+        ssize_t n = read_fully(fdin, dest + done, size - done);
+        if (n < 0) {
+          err << "error reading from " << filename;
+          return -1;
+        }
+        bool short_read = (size_t) n < size - done;
+        done += n;
+        position += n;
+        if (short_read) {
+          eof = true;
+          break;
+        }
+      }
+      return done;
+    }
+
+  public:
+    // A name for the stream, for error messages.
+    std::string filename;
+
+    // Reads from a file, or from stdin if filename is "-".
+    // ring_size is how much the reader buffers, and must be at least MAX_RAW_HEADER_SIZE.
+    StreamReader(const std::string& filename, size_t ring_size = 4 << 20)
+      : ring(std::max(ring_size, (size_t) MAX_RAW_HEADER_SIZE)), filename(filename) {
+      if (filename == "-") {
+        fdin = STDIN_FILENO;
+        owns_fd = false;
+      } else {
+        fdin = open(filename.c_str(), O_RDONLY);
+        owns_fd = true;
+        if (fdin < 0) {
+          err << "could not open " << filename;
+        }
+      }
+    }
+
+    // Reads from a descriptor that is already open. The caller keeps ownership of it.
+    StreamReader(int fd, size_t ring_size = 4 << 20)
+      : fdin(fd), owns_fd(false), ring(std::max(ring_size, (size_t) MAX_RAW_HEADER_SIZE)),
+        filename("fd " + std::to_string(fd)) {}
+
+    StreamReader(const StreamReader&) = delete;
+    StreamReader& operator=(StreamReader&) = delete;
+
+    ~StreamReader() {
+      if (owns_fd && fdin >= 0) {
+        close(fdin);
+      }
+    }
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used;
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err;
+    }
+
+    // Reads the next header, skipping any unread data from the previous block.
+    // Returns whether the read was successful.
+    // If readHeader returns false, it can either be an error, or we reached the end of
+    // the stream. Callers should check error() to see if there was an error.
+    // header->data_offset is the position of the data in the stream.
+    bool readHeader(Header* header) {
+      if (error()) {
+        return false;
+      }
+
+      if (block_remaining > 0) {
+        ssize_t skipped = consume(nullptr, block_remaining);
+        if (skipped < 0) {
+          return false;
+        }
+        if ((size_t) skipped < block_remaining) {
+          err << "incomplete block at end of " << filename;
+          return false;
+        }
+        block_remaining = 0;
+      }
+
+      if (!fill(MAX_RAW_HEADER_SIZE)) {
+        return false;
+      }
+      if (buffered < 80) {
+        // We're at the end of the stream.
+        return false;
+      }
+
+      size_t available = peek(header->buffer, MAX_RAW_HEADER_SIZE);
+      if (available < MAX_RAW_HEADER_SIZE) {
+        memset(header->buffer + available, 0, MAX_RAW_HEADER_SIZE - available);
+      }
+      rawspec_raw_parse_header(header);
+      if (!rawspec_raw_check_header(header)) {
+        err << "error reading block header #" << (headers_read + 1) << " from " << filename;
+        return false;
+      }
+      header->hdr_size = rawspec_raw_header_size(header->buffer, available, 0);
+      size_t padded_size = rawspec_raw_header_size(header->buffer, available,
+                                                   header->directio);
+      if (header->hdr_size == 0 || padded_size > available) {
+        err << "incomplete header #" << (headers_read + 1) << " in " << filename;
+        return false;
+      }
+
+      if (!setBlockDimensions(header, err)) {
+        return false;
+      }
+      setMissingBlocks(header, headers_read, pktidx, &pktidx_step);
+      pktidx = header->pktidx;
+
+      take(nullptr, padded_size);
+      header->data_offset = position;
+      block_remaining = header->blocsize;
+      ++headers_read;
+      return true;
+    }
+
+    // Reads all data from the current block into the buffer.
+    // Returns whether the read was successful.
+    bool readData(char* buffer) {
+      if (error()) {
+        return false;
+      }
+      if (block_remaining == 0) {
+        err << "cannot readData when data from this block has already been read";
+        return false;
+      }
+      size_t size = block_remaining;
+      ssize_t bytes_read = consume(buffer, size);
+      block_remaining = 0;
+      if (bytes_read < 0) {
+        return false;
+      }
+      if ((size_t) bytes_read < size) {
+        err << "incomplete block at end of " << filename;
+        return false;
+      }
+      return true;
+    }
+
+    // Reads a subset of the data in this block, defined by a frequency subband,
+    // with the same layout as Reader::readBand. The rest of the block is skipped.
+    // Returns whether the read succeeded.
+    bool readBand(const Header& header, int band, int num_bands, char* buffer) {
+      if (error()) {
+        return false;
+      }
+      if (block_remaining != header.blocsize) {
+        err << "cannot readBand when data from this block has already been read";
+        return false;
+      }
+      assert(0 == header.num_channels % num_bands);
+      assert(band < num_bands);
+      size_t band_bytes = (size_t) header.num_channels / num_bands * header.num_timesteps *
+        header.npol * 2;
+
+      char* dest = buffer;
+      for (int antenna = 0; antenna < header.nants; ++antenna) {
+        for (int b = 0; b < num_bands; ++b) {
+          ssize_t n = consume(b == band ? dest : nullptr, band_bytes);
+          if (n < 0) {
+            return false;
+          }
+          block_remaining -= n;
+          if ((size_t) n < band_bytes) {
+            err << "incomplete block at end of " << filename;
+            return false;
+          }
+        }
+        dest += band_bytes;
+      }
+      return true;
+    }
+  };
+}
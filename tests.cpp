@@ -1,18 +1,42 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <complex>
 #include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <math.h>
+#include <memory>
+#include <random>
+#include <set>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
 #include "raw.h"
+#include "raw_c.h"
 
 using namespace std;
 
-// Just runs some tests
-int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    cerr << "usage: tests <file.raw>\n";
+// Exits with an error message if the condition is false.
+void check(bool condition, const string& message) {
+  if (!condition) {
+    cerr << "FAILED: " << message << endl;
     exit(1);
   }
-  string filename(argv[1]);
+}
+
+// A filename for scratch output that won't collide with other test runs.
+string tempFilename(const string& name) {
+  const char* dir = getenv("TMPDIR");
+  return string(dir ? dir : "/tmp") + "/raw_tests_" + to_string(getpid()) + "_" + name;
+}
+
+// Reads through a raw file, printing some information about it.
+void testFile(const string& filename) {
   cout << "running tests on " << filename << endl;
 
   int num_blocks = 0;
@@ -29,7 +53,7 @@ int main(int argc, char* argv[]) {
       cout << "N_FREQ: " << header.num_channels << endl;
       cout << "N_ANT: " << header.nants << endl;
     }
-    
+
     // Read only the odd blocks
     if (num_blocks % 2 == 1) {
       std::vector<char> data(header.blocsize);
@@ -39,7 +63,7 @@ int main(int argc, char* argv[]) {
     if (num_blocks % 7 == 3) {
       cout << "num_timesteps " << header.num_timesteps << endl;
     }
-    
+
     ++num_blocks;
     if (num_blocks % 10 == 0) {
       cout << "processed " << num_blocks << " blocks\n";
@@ -51,6 +75,1879 @@ int main(int argc, char* argv[]) {
   }
 
   cout << "done. processed " << num_blocks << " blocks total\n";
-  
+}
+
+// Checks that the reader gets back exactly what the generator wrote.
+void testSynthetic(bool directio) {
+  cout << "testing synthetic file, directio = " << directio << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 16;
+  options.npol = 2;
+  options.blocsize = 16 * 2 * 2 * 256;
+  options.directio = directio;
+  options.num_blocks = 10;
+  options.gap_every = 3;
+
+  string filename = tempFilename("synthetic.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  vector<char> expected(options.blocsize);
+  vector<char> data(options.blocsize);
+  int num_blocks = 0;
+  int missing_blocks = 0;
+  while (reader.readHeader(&header)) {
+    check(header.nants == 2, "nants");
+    check(header.num_channels == 8, "num_channels");
+    check(header.num_timesteps == 256, "num_timesteps");
+    check(header.npol == 2, "npol");
+    check(header.pktidx == options.pktidx(num_blocks), "pktidx");
+    check(string(header.telescop) == "SYNTHETIC", "telescop");
+    missing_blocks += header.missing_blocks;
+
+    raw::syntheticData(options, num_blocks, expected.data());
+    if (num_blocks % 2 == 1) {
+      check(reader.readData(data.data()), "readData");
+      check(data == expected, "readData contents");
+    } else {
+      // Band 1 of 4 is channels 2-3 of each antenna
+      size_t band_bytes = options.blocsize / 4 / options.nants;
+      check(reader.readBand(header, 1, 4, data.data()), "readBand");
+      for (int antenna = 0; antenna < options.nants; ++antenna) {
+        check(0 == memcmp(data.data() + antenna * band_bytes,
+                          expected.data() + (antenna * 4 + 1) * band_bytes, band_bytes),
+              "readBand contents");
+      }
+    }
+    ++num_blocks;
+  }
+  check(!reader.error(), reader.errorMessage());
+  check(num_blocks == options.num_blocks, "number of blocks");
+  check(missing_blocks == options.numMissingBlocks(), "missing blocks");
+  unlink(filename.c_str());
+
+  // Options that don't make a readable file are rejected before writing
+  raw::SyntheticOptions bad = options;
+  bad.nbits = 2;
+  bad.npol = 1;
+  bad.obsnchan = 1;
+  bad.nants = 1;
+  check(!raw::writeSyntheticFile(filename, bad, &error_message), "sub-byte timestep");
+  bad = options;
+  bad.obsnchan = 0;
+  check(!raw::writeSyntheticFile(filename, bad, &error_message), "no channels");
+  bad = options;
+  bad.blocsize = 0;
+  check(!raw::writeSyntheticFile(filename, bad, &error_message), "zero blocsize");
+  bad = options;
+  bad.num_blocks = -3;
+  check(!raw::writeSyntheticFile(filename, bad, &error_message), "negative blocks");
+  check(access(filename.c_str(), F_OK) != 0, "rejected options write nothing");
+}
+
+// Checks that StreamReader reads a synthetic file correctly through a pipe.
+void testStream() {
+  cout << "testing stream reader" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 16;
+  options.blocsize = 16 * 2 * 2 * 300;
+  options.num_blocks = 9;
+  options.gap_every = 4;
+  string filename = tempFilename("stream.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  // Feed the file through a pipe in odd-sized pieces
+  int fds[2];
+  check(0 == pipe(fds), "pipe");
+  thread producer([&]() {
+    int fd = open(filename.c_str(), O_RDONLY);
+    vector<char> chunk(7777);
+    ssize_t n;
+    while ((n = read(fd, chunk.data(), chunk.size())) > 0) {
+      check(n == write(fds[1], chunk.data(), n), "write to pipe");
+    }
+    close(fd);
+    close(fds[1]);
+  });
+
+  // A small ring, so that it wraps around
+  raw::StreamReader reader(fds[0], 30000);
+  raw::Header header;
+  vector<char> expected(options.blocsize);
+  vector<char> data(options.blocsize);
+  int num_blocks = 0;
+  int missing_blocks = 0;
+  while (reader.readHeader(&header)) {
+    check(header.pktidx == options.pktidx(num_blocks), "stream pktidx");
+    missing_blocks += header.missing_blocks;
+    raw::syntheticData(options, num_blocks, expected.data());
+    if (num_blocks % 3 == 0) {
+      check(reader.readData(data.data()), "stream readData");
+      check(data == expected, "stream readData contents");
+    } else if (num_blocks % 3 == 1) {
+      size_t band_bytes = options.blocsize / 2 / options.nants;
+      check(reader.readBand(header, 1, 2, data.data()), "stream readBand");
+      for (int antenna = 0; antenna < options.nants; ++antenna) {
+        check(0 == memcmp(data.data() + antenna * band_bytes,
+                          expected.data() + (antenna * 2 + 1) * band_bytes, band_bytes),
+              "stream readBand contents");
+      }
+    }
+    ++num_blocks;
+  }
+  producer.join();
+  close(fds[0]);
+  check(!reader.error(), reader.errorMessage());
+  check(num_blocks == options.num_blocks, "stream number of blocks");
+  check(missing_blocks == options.numMissingBlocks(), "stream missing blocks");
+  unlink(filename.c_str());
+}
+
+// Checks that a compressed container reads back the same as the original.
+void testCompressed(raw::Codec codec) {
+  cout << "testing compressed container, codec = " << raw::codecName(codec) << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 500;
+  options.num_blocks = 12;
+  options.gap_every = 5;
+
+  string filename = tempFilename("compressed.rawz");
+  {
+    raw::CompressedWriter writer(filename, codec);
+    vector<char> data(options.blocsize);
+    for (int block = 0; block < options.num_blocks; ++block) {
+      raw::syntheticData(options, block, data.data());
+      check(writer.writeBlock(raw::syntheticHeader(options, block), data.data(), data.size()),
+            writer.errorMessage());
+    }
+  }
+
+  raw::CompressedReader reader(filename, 3, 4);
+  raw::Header header;
+  vector<char> expected(options.blocsize);
+  vector<char> data(options.blocsize);
+  int num_blocks = 0;
+  int missing_blocks = 0;
+  while (reader.readHeader(&header)) {
+    check(header.blocsize == options.blocsize, "compressed blocsize");
+    check(header.pktidx == options.pktidx(num_blocks), "compressed pktidx");
+    missing_blocks += header.missing_blocks;
+    raw::syntheticData(options, num_blocks, expected.data());
+    if (num_blocks % 3 == 0) {
+      check(reader.readData(data.data()), "compressed readData");
+      check(data == expected, "compressed readData contents");
+    } else if (num_blocks % 3 == 1) {
+      size_t band_bytes = options.blocsize / 4 / options.nants;
+      check(reader.readBand(header, 3, 4, data.data()), "compressed readBand");
+      for (int antenna = 0; antenna < options.nants; ++antenna) {
+        check(0 == memcmp(data.data() + antenna * band_bytes,
+                          expected.data() + (antenna * 4 + 3) * band_bytes, band_bytes),
+              "compressed readBand contents");
+      }
+    }
+    ++num_blocks;
+  }
+  check(!reader.error(), reader.errorMessage());
+  check(num_blocks == options.num_blocks, "compressed number of blocks");
+  check(missing_blocks == options.numMissingBlocks(), "compressed missing blocks");
+
+  // A header without a frame size is an error, rather than a frame of nothing
+  int fd = open(filename.c_str(), O_RDWR);
+  string first(80 * 40, ' ');
+  check(fd >= 0 && pread(fd, &first[0], first.size(), 0) == (ssize_t) first.size(),
+        "compressed reread");
+  size_t card = first.find("ZBLOCSIZ");
+  check(card != string::npos && pwrite(fd, "XBLOCSIZ", 8, card) == 8,
+        "compressed corrupt header");
+  close(fd);
+  raw::CompressedReader broken(filename, 1, 1);
+  check(!broken.readHeader(&header) && broken.error(), "compressed missing ZBLOCSIZ");
+  check(broken.errorMessage().find("ZBLOCSIZ") != string::npos, broken.errorMessage());
+  unlink(filename.c_str());
+}
+
+// Checks that ShmRingReader gets blocks from a stand-in hashpipe producer.
+void testShmRing() {
+  cout << "testing shared memory ring" << endl;
+  raw::SyntheticOptions options;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 128;
+  options.num_blocks = 10;
+  options.gap_every = 4;
+  const int n_block = 3;
+  key_t key = 0x52570000 | (getpid() & 0xffff);
+
+  raw::ShmRingProducer producer(key, n_block, raw::HPGUPPI_BLOCK_HDR_SIZE + options.blocsize);
+  check(!producer.error(), producer.errorMessage());
+  thread recorder([&]() {
+    for (int block = 0; block < options.num_blocks; ++block) {
+      int block_id = block % n_block;
+      check(producer.waitFree(block_id), "waitFree");
+      raw::HeaderCards cards = raw::syntheticHeader(options, block);
+      cards.set("BLOCSIZE", options.blocsize);
+      string text = cards.toString();
+      memcpy(producer.block(block_id), text.data(), text.size());
+      raw::syntheticData(options, block, producer.block(block_id) + raw::HPGUPPI_BLOCK_HDR_SIZE);
+      check(producer.setFilled(block_id), "setFilled");
+    }
+  });
+
+  raw::ShmRingReader reader(key, 200);
+  raw::Header header;
+  vector<char> expected(options.blocsize);
+  int num_blocks = 0;
+  int missing_blocks = 0;
+  while (reader.readHeader(&header)) {
+    check(header.pktidx == options.pktidx(num_blocks), "shm pktidx");
+    missing_blocks += header.missing_blocks;
+    raw::syntheticData(options, num_blocks, expected.data());
+    check(0 == memcmp(reader.data(), expected.data(), options.blocsize), "shm data");
+    ++num_blocks;
+  }
+  recorder.join();
+  check(!reader.error(), reader.errorMessage());
+  check(reader.timedOut(), "shm reader should time out at the end");
+  check(num_blocks == options.num_blocks, "shm number of blocks");
+  check(missing_blocks == options.numMissingBlocks(), "shm missing blocks");
+}
+
+// Checks that follow mode picks up blocks as they are written, including partial
+// writes and rolling over to the next file.
+void testFollow(bool streamed) {
+  cout << "testing follow mode, streamed = " << streamed << endl;
+  raw::SyntheticOptions options;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 256;
+  options.num_blocks = 6;
+  string first = tempFilename("follow.0000.raw");
+  string second = tempFilename("follow.0001.raw");
+  unlink(second.c_str());
+  int fd = open(first.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  check(fd >= 0, "open follow file");
+
+  atomic<bool> recorded(false);
+  thread recorder([&]() {
+    vector<char> data(options.blocsize);
+    for (int block = 0; block < options.num_blocks; ++block) {
+      if (block == options.num_blocks / 2) {
+        close(fd);
+        fd = open(second.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      }
+      raw::HeaderCards cards = raw::syntheticHeader(options, block);
+      cards.set("BLOCSIZE", options.blocsize);
+      string text = cards.toString();
+      raw::syntheticData(options, block, data.data());
+      text.append(data.begin(), data.end());
+
+      // Write each block in a few pieces, so the reader sees partial headers and data
+      size_t piece = text.size() / 3 + 1;
+      for (size_t i = 0; i < text.size(); i += piece) {
+        size_t n = min(piece, text.size() - i);
+        check(write(fd, text.data() + i, n) == (ssize_t) n, "follow write");
+        this_thread::sleep_for(chrono::milliseconds(2));
+      }
+    }
+    close(fd);
+    recorded = true;
+  });
+
+  raw::Reader reader(first);
+  check(reader.follow(300), "follow");
+  raw::Header header;
+  vector<char> expected(options.blocsize);
+  vector<char> data(options.blocsize);
+  int num_blocks = 0;
+  if (streamed) {
+    for (auto& block : reader.blockStream()) {
+      // The first block comes while the recorder is still writing, not after
+      // the follow timeout
+      check(num_blocks > 0 || !recorded, "follow stream waits for the timeout");
+      check(block.index == num_blocks, "follow stream index");
+      check(block.pktidx == options.pktidx(num_blocks), "follow stream pktidx");
+      raw::syntheticData(options, num_blocks, expected.data());
+      check(!memcmp(block.data(), expected.data(), block.blocsize), "follow stream data");
+      ++num_blocks;
+    }
+  } else {
+    while (reader.readHeader(&header)) {
+      check(header.pktidx == options.pktidx(num_blocks), "follow pktidx");
+      check(reader.readData(data.data()), "follow readData");
+      raw::syntheticData(options, num_blocks, expected.data());
+      check(data == expected, "follow readData contents");
+      ++num_blocks;
+    }
+  }
+  recorder.join();
+  check(!reader.error(), reader.errorMessage());
+  check(reader.timedOut(), "follow should time out at the end");
+  check(num_blocks == options.num_blocks, "follow number of blocks");
+  check(reader.filename == second, "follow should roll over to the next file");
+  unlink(first.c_str());
+  unlink(second.c_str());
+}
+
+// Checks the block statistics kernel against a direct computation, and that
+// quicklook finds the synthetic tone.
+void testBlockStats() {
+  cout << "testing block stats" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 1000;
+  options.num_blocks = 5;
+  string filename = tempFilename("stats.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  check(reader.readHeader(&header), "stats readHeader");
+  vector<char> data(header.blocsize);
+  check(reader.readData(data.data()), "stats readData");
+  data[10] = 127;
+  data[11] = -128;
+  data[13] = -127;
+
+  vector<raw::ChannelStats> stats;
+  raw::computeBlockStats(header, data.data(), &stats);
+  check((int) stats.size() == header.nants * header.num_channels * (int) header.npol,
+        "stats size");
+  for (int row = 0; row < header.nants * header.num_channels; ++row) {
+    for (int pol = 0; pol < (int) header.npol; ++pol) {
+      double sum = 0;
+      double square_sum = 0;
+      int64_t clipped = 0;
+      for (int t = 0; t < header.num_timesteps; ++t) {
+        const int8_t* x = (const int8_t*) data.data() +
+          ((row * header.num_timesteps + t) * header.npol + pol) * 2;
+        double p = x[0] * x[0] + x[1] * x[1];
+        sum += p;
+        square_sum += p * p;
+        clipped += raw::isClipped(x[0]) + raw::isClipped(x[1]);
+      }
+      const raw::ChannelStats& s = stats[row * header.npol + pol];
+      double mean = sum / header.num_timesteps;
+      check(fabs(s.mean_power - mean) < 1e-9, "mean power");
+      check(fabs(s.power_variance - (square_sum / header.num_timesteps - mean * mean)) < 1e-6,
+            "power variance");
+      check(s.clipped == clipped, "clipped count");
+    }
+  }
+  check(stats[0].clipped == 1 && stats[1].clipped == 2, "clipped values land in the right pol");
+
+  raw::QuickLook ql;
+  check(raw::quicklook(filename, &ql, 3, &error_message), error_message);
+  check(ql.num_blocks == options.num_blocks, "quicklook blocks");
+  check(ql.num_channels == 4, "quicklook channels");
+  for (int block = 0; block < ql.num_blocks; ++block) {
+    for (int channel = 0; channel < ql.num_channels; ++channel) {
+      if (channel != 1) {
+        check(ql.power[block * ql.num_channels + 1] > 2 * ql.power[block * ql.num_channels + channel],
+              "quicklook should find the tone in channel 1");
+      }
+    }
+  }
+  unlink(filename.c_str());
+}
+
+// Checks the beamformers against a direct computation, on one band of a block.
+void testBeamformer() {
+  cout << "testing beamformer" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 3;
+  options.obsnchan = 12;
+  options.blocsize = 12 * 2 * 2 * 100;
+  options.num_blocks = 1;
+  string filename = tempFilename("beams.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  check(reader.readHeader(&header), "beamformer readHeader");
+  const int num_bands = 2;
+  raw::BlockShape shape = raw::BlockShape::forBand(header, num_bands);
+  vector<char> data(header.blocsize / num_bands);
+  check(reader.readBand(header, 1, num_bands, data.data()), "beamformer readBand");
+
+  const int num_beams = 3;
+  vector<complex<float> > weights(num_beams * shape.nants * shape.num_channels);
+  for (size_t i = 0; i < weights.size(); ++i) {
+    weights[i] = complex<float>((int) (i % 7) - 3, (int) (i % 5) - 2);
+  }
+  size_t row_size = shape.rowSize();
+  vector<complex<float> > beams(num_beams * shape.num_channels * row_size);
+  vector<float> power(shape.num_channels * row_size);
+  raw::ThreadPool pool(3);
+  raw::formCoherentBeams(shape, data.data(), weights.data(), num_beams, beams.data(), &pool);
+  raw::formIncoherentBeam(shape, data.data(), power.data(), &pool);
+
+  for (int channel = 0; channel < shape.num_channels; ++channel) {
+    for (size_t i = 0; i < row_size; ++i) {
+      float expected_power = 0;
+      vector<complex<float> > expected(num_beams);
+      for (int antenna = 0; antenna < shape.nants; ++antenna) {
+        const int8_t* x = (const int8_t*) data.data() +
+          ((antenna * shape.num_channels + channel) * row_size + i) * 2;
+        complex<float> value(x[0], x[1]);
+        expected_power += norm(value);
+        for (int beam = 0; beam < num_beams; ++beam) {
+          expected[beam] +=
+            weights[(beam * shape.nants + antenna) * shape.num_channels + channel] * value;
+        }
+      }
+      check(power[channel * row_size + i] == expected_power, "incoherent beam");
+      for (int beam = 0; beam < num_beams; ++beam) {
+        check(beams[(beam * shape.num_channels + channel) * row_size + i] == expected[beam],
+              "coherent beam");
+      }
+    }
+  }
+  unlink(filename.c_str());
+}
+
+// Checks that a tone in one window of Gaussian noise is flagged, and nothing else
+// is, and that excision only changes the flagged window.
+void testRFI() {
+  cout << "testing rfi" << endl;
+  raw::BlockShape shape(2, 4, 1024, 2);
+  vector<char> noise(shape.nants * shape.num_channels * shape.rowSize() * 2);
+  mt19937 gen(7);
+  normal_distribution<double> normal(0.0, 20.0);
+  for (auto& x : noise) {
+    x = (char) max(-127.0, min(127.0, round(normal(gen))));
+  }
+  // A tone in antenna 1, channel 2, pol 0, timesteps 256 to 511.
+  int8_t* row = (int8_t*) noise.data() + (1 * shape.num_channels + 2) * shape.rowSize() * 2;
+  for (int t = 256; t < 512; ++t) {
+    row[t * 4] = (int8_t) round(60 * cos(0.3 * t));
+    row[t * 4 + 1] = (int8_t) round(60 * sin(0.3 * t));
+  }
+
+  for (raw::Excision excision : {raw::Excision::NONE, raw::Excision::ZERO,
+                                 raw::Excision::NOISE}) {
+    vector<char> data(noise);
+    raw::ThreadPool pool(2);
+    raw::RFIFlagger flagger(256, 5.0, excision, &pool);
+    flagger.process(shape, data.data());
+    check(flagger.numWindows() == 4, "rfi windows");
+    check(flagger.numFlagged() == 1, "rfi flag count");
+    check(flagger.flagged(1, 2, 0, 1), "rfi flagged tone");
+
+    int8_t* cleaned = (int8_t*) data.data() + (row - (int8_t*) noise.data());
+    for (size_t i = 0; i < data.size(); ++i) {
+      size_t in_row = i - (size_t) ((char*) row - noise.data());
+      bool in_window = in_row < shape.rowSize() * 2 && in_row / 4 >= 256 && in_row / 4 < 512 &&
+        in_row % 4 < 2;
+      if (!in_window || excision == raw::Excision::NONE) {
+        check(data[i] == noise[i], "rfi unflagged data unchanged");
+      }
+    }
+    double power = 0;
+    for (int t = 256; t < 512; ++t) {
+      power += cleaned[t * 4] * cleaned[t * 4] + cleaned[t * 4 + 1] * cleaned[t * 4 + 1];
+    }
+    power /= 256;
+    if (excision == raw::Excision::ZERO) {
+      check(power == 0, "rfi zeroed");
+    } else if (excision == raw::Excision::NOISE) {
+      // The noise has 2 * 20^2 power
+      check(fabs(power - 800) < 160, "rfi noise power");
+    }
+  }
+}
+
+// Checks that requantized data decodes back to the input, to within the
+// quantization step, and that saturation is counted.
+void testRequantizer() {
+  cout << "testing requantizer" << endl;
+  raw::BlockShape shape(2, 3, 100, 2);
+  int rows = shape.nants * shape.num_channels;
+  vector<float> input(rows * shape.rowSize() * 2);
+  mt19937 gen(3);
+  for (int r = 0; r < rows; ++r) {
+    normal_distribution<float> normal(r - 2.0f, 1.0f + r);
+    for (size_t i = 0; i < shape.rowSize() * 2; ++i) {
+      input[r * shape.rowSize() * 2 + i] = normal(gen);
+    }
+  }
+
+  raw::ThreadPool pool(2);
+  for (int nbits : {8, 4, 2}) {
+    raw::Requantizer requantizer(nbits, 0, &pool);
+    vector<char> output(requantizer.outputSize(shape));
+    check(output.size() == input.size() * nbits / 8, "requantized size");
+    check(requantizer.process(shape, input.data(), output.data()), "requantize");
+
+    int64_t saturated = 0;
+    float lo = -(1 << (nbits - 1));
+    float hi = (1 << (nbits - 1)) - 1;
+    for (size_t i = 0; i < input.size(); ++i) {
+      // Decode the i-th value by shifting it to the top of the byte and back
+      int position = i % (8 / nbits);
+      int q = (int8_t) ((uint8_t) output[i * nbits / 8] << (position * nbits)) >> (8 - nbits);
+
+      size_t r = i / (shape.rowSize() * 2);
+      int pol = (i / 2) % shape.npol;
+      int antenna = r / shape.num_channels;
+      int channel = r % shape.num_channels;
+      complex<float> offset = requantizer.offset(antenna, channel, pol);
+      float scale = requantizer.scale(antenna, channel, pol);
+      float y = (input[i] - (i % 2 == 0 ? offset.real() : offset.imag())) * scale;
+      if (y < lo || y > hi) {
+        ++saturated;
+        check(q == (y < lo ? lo : hi), "requantized saturation");
+      } else {
+        check(fabs(q - y) <= 0.5001, "requantized value");
+      }
+    }
+    check(saturated == requantizer.lastSaturated(), "requantizer saturation count");
+    check(nbits == 8 || saturated > 0, "requantizer saturates");
+
+    // Channel 2 of antenna 1 is row 5, with a standard deviation of 6
+    float expected = raw::Requantizer::defaultTargetRMS(nbits) / 6;
+    check(fabs(requantizer.scale(1, 2, 0) / expected - 1) < 0.1, "requantizer scale");
+    check(!requantizer.process(raw::BlockShape(1, 3, 100, 2), input.data(), output.data()),
+          "requantizer shape change");
+  }
+}
+
+// Checks that decimating block by block matches decimating the whole stream at
+// once, including samples that span block boundaries.
+void testDecimator() {
+  cout << "testing decimator" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 6;
+  options.blocsize = 6 * 2 * 2 * 100;
+  options.num_blocks = 4;
+  string filename = tempFilename("decimate.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  // Every block's data, concatenated along the time axis, indexed [row][time][pol][re/im]
+  raw::Reader reader(filename);
+  raw::Header header;
+  vector<vector<char> > blocks;
+  while (reader.readHeader(&header)) {
+    blocks.emplace_back(header.blocsize);
+    check(reader.readData(blocks.back().data()), "decimator readData");
+  }
+  check((int) blocks.size() == options.num_blocks, "decimator blocks");
+  int rows = header.nants * header.num_channels;
+  int npol = header.npol;
+  int total_timesteps = header.num_timesteps * blocks.size();
+  auto sample = [&](int row, int t, int pol, int part) {
+    const vector<char>& block = blocks[t / header.num_timesteps];
+    int bt = t % header.num_timesteps;
+    return (int8_t) block[((row * header.num_timesteps + bt) * npol + pol) * 2 + part];
+  };
+
+  const int factor = 30;
+  raw::ThreadPool pool(2);
+  for (int voltage = 0; voltage < 2; ++voltage) {
+    for (int sum_pols = 0; sum_pols < 2; ++sum_pols) {
+      raw::DecimateMode mode = voltage ? raw::DecimateMode::VOLTAGE : raw::DecimateMode::POWER;
+      raw::Decimator decimator(factor, mode, sum_pols, &pool);
+      vector<vector<float> > by_row(rows);
+      vector<float> output;
+      for (auto& block : blocks) {
+        int n = decimator.process(header, block.data(), &output);
+        size_t row_floats = (size_t) n * decimator.outputWidth();
+        check(output.size() == rows * row_floats, "decimator output size");
+        for (int row = 0; row < rows; ++row) {
+          by_row[row].insert(by_row[row].end(), output.begin() + row * row_floats,
+                             output.begin() + (row + 1) * row_floats);
+        }
+      }
+      int num_out = total_timesteps / factor;
+      check(decimator.pending() == total_timesteps % factor, "decimator pending");
+
+      for (int row = 0; row < rows; ++row) {
+        check((int) by_row[row].size() == num_out * decimator.outputWidth(),
+              "decimator samples per row");
+        vector<float> expected;
+        for (int i = 0; i < num_out; ++i) {
+          float total = 0;
+          for (int pol = 0; pol < npol; ++pol) {
+            float re = 0;
+            float im = 0;
+            float power = 0;
+            for (int t = i * factor; t < (i + 1) * factor; ++t) {
+              re += sample(row, t, pol, 0);
+              im += sample(row, t, pol, 1);
+              power += sample(row, t, pol, 0) * sample(row, t, pol, 0) +
+                sample(row, t, pol, 1) * sample(row, t, pol, 1);
+            }
+            if (voltage) {
+              expected.push_back(re / factor);
+              expected.push_back(im / factor);
+            } else if (sum_pols) {
+              total += power;
+            } else {
+              expected.push_back(power);
+            }
+          }
+          if (!voltage && sum_pols) {
+            expected.push_back(total);
+          }
+        }
+        for (size_t i = 0; i < expected.size(); ++i) {
+          check(fabs(by_row[row][i] - expected[i]) < 1e-3, "decimated value");
+        }
+      }
+    }
+  }
+  unlink(filename.c_str());
+}
+
+// Checks that ascendingFrequency reverses the channels of negative-OBSBW blocks
+// for readData and readBand, and leaves positive-OBSBW blocks alone.
+void testAscendingFrequency() {
+  cout << "testing ascending frequency" << endl;
+  for (double obsbw : {-187.5, 187.5}) {
+    raw::SyntheticOptions options;
+    options.nants = 2;
+    options.obsnchan = 8;
+    options.blocsize = 8 * 2 * 2 * 32;
+    options.num_blocks = 2;
+    options.obsbw = obsbw;
+    options.checksums = true;
+    string filename = tempFilename("ascending.0000.raw");
+    string error_message;
+    check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+    raw::Reader reader(filename);
+    reader.ascendingFrequency(true);
+    reader.verifyChecksums(true);
+    raw::Header header;
+    vector<char> stored(options.blocsize);
+    vector<char> expected(options.blocsize);
+    vector<char> data(options.blocsize);
+    vector<char> band(options.blocsize / 2);
+    vector<vector<char> > blocks;
+    int block = 0;
+    while (reader.readHeader(&header)) {
+      check(reader.reversesChannels(header) == (obsbw < 0), "reversesChannels");
+      raw::syntheticData(options, block, stored.data());
+      size_t row_bytes = options.blocsize / options.obsnchan;
+      for (int a = 0; a < header.nants; ++a) {
+        for (int c = 0; c < header.num_channels; ++c) {
+          int source = (obsbw < 0) ? header.num_channels - 1 - c : c;
+          memcpy(expected.data() + (a * header.num_channels + c) * row_bytes,
+                 stored.data() + (a * header.num_channels + source) * row_bytes, row_bytes);
+        }
+      }
+
+      for (int b = 0; b < 2; ++b) {
+        check(reader.readBand(header, b, 2, band.data()), "ascending readBand");
+        for (int a = 0; a < header.nants; ++a) {
+          size_t band_bytes = band.size() / header.nants;
+          check(memcmp(band.data() + a * band_bytes,
+                       expected.data() + (a * 2 + b) * band_bytes, band_bytes) == 0,
+                "ascending band data");
+        }
+      }
+      check(reader.readData(data.data()), reader.errorMessage());
+      check(data == expected, "ascending block data");
+      blocks.push_back(expected);
+      ++block;
+    }
+    check(!reader.error() && block == 2, "ascending blocks");
+
+    // readTimeRange numbers channels the same way, here channels 1 and 2 of
+    // antenna 1 over both blocks
+    int64_t timesteps = header.num_timesteps;
+    int64_t begin = options.pktidx(0) / options.piperblk * timesteps;
+    double synctime = 1652363000;
+    raw::TimeSeries series;
+    check(reader.readTimeRange(1, 1, 3, synctime + begin * header.tbin,
+                               synctime + (begin + 2 * timesteps) * header.tbin, &series),
+          reader.errorMessage());
+    size_t row_bytes = timesteps * 4;
+    for (int c = 0; c < 2; ++c) {
+      for (int b = 0; b < 2; ++b) {
+        check(memcmp(series.data.data() + (c * 2 + b) * row_bytes,
+                     blocks[b].data() + (header.num_channels + 1 + c) * row_bytes,
+                     row_bytes) == 0, "ascending time range");
+      }
+    }
+    unlink(filename.c_str());
+  }
+}
+
+// Checks CRC32C against a known value, and that readers and verifyFile catch a
+// corrupted block.
+void testChecksums() {
+  cout << "testing checksums" << endl;
+  check(raw::crc32c("123456789", 9) == 0xe3069283, "crc32c check value");
+  vector<char> bytes(1000);
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = i * 7919 % 251;
+  }
+  for (size_t size : {0, 1, 7, 8, 9, 100, 1000}) {
+    uint32_t crc = raw::crc32cSoftware(bytes.data(), size);
+    check(raw::crc32c(bytes.data(), size) == crc, "hardware and software crc32c agree");
+    check(raw::crc32c(bytes.data() + size / 2, size - size / 2,
+                      raw::crc32c(bytes.data(), size / 2)) == crc, "crc32c continues");
+  }
+
+  raw::SyntheticOptions options;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 256;
+  options.num_blocks = 6;
+  options.checksums = true;
+  string filename = tempFilename("crc.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::VerifyResult result;
+  check(raw::verifyFile(filename, &result, 3, &error_message), error_message);
+  check(result.num_blocks == 6 && result.num_checked == 6 && result.ok(), "clean file verifies");
+
+  // Corrupt one byte of the data in block 4
+  off_t offset = 0;
+  {
+    raw::Reader reader(filename);
+    raw::Header header;
+    for (int i = 0; i < 5; ++i) {
+      check(reader.readHeader(&header), "crc readHeader");
+    }
+    offset = header.data_offset + 100;
+  }
+  int fd = open(filename.c_str(), O_WRONLY);
+  char x = 99;
+  check(pwrite(fd, &x, 1, offset) == 1, "crc corrupt");
+  close(fd);
+
+  check(raw::verifyFile(filename, &result, 3, &error_message), error_message);
+  check(result.bad_blocks.size() == 1 && result.bad_blocks[0] == 4, "verify finds the bad block");
+
+  raw::Reader reader(filename);
+  reader.verifyChecksums(true);
+  raw::Header header;
+  vector<char> data(options.blocsize);
+  int good_blocks = 0;
+  while (reader.readHeader(&header) && reader.readData(data.data())) {
+    ++good_blocks;
+  }
+  check(good_blocks == 4 && reader.error(), "reader stops at the bad block");
+
+  // The compressed container checks on its worker threads
+  string compressed = tempFilename("crc.rawz");
+  {
+    raw::Reader in(filename);
+    raw::CompressedWriter out(compressed, raw::Codec::NONE);
+    while (in.readHeader(&header) && in.readData(data.data())) {
+      raw::HeaderCards cards;
+      cards.copyFrom(header);
+      check(out.writeBlock(cards, data.data(), data.size()), "crc compressed write");
+    }
+  }
+  raw::CompressedReader creader(compressed, 2);
+  creader.verifyChecksums(true);
+  good_blocks = 0;
+  while (creader.readHeader(&header) && creader.readData(data.data())) {
+    ++good_blocks;
+  }
+  check(good_blocks == 4 && creader.error(), "compressed reader stops at the bad block");
+
+  unlink(filename.c_str());
+  unlink(compressed.c_str());
+}
+
+#ifdef RAW_HAVE_COROUTINES
+// A coroutine that starts right away and cleans up after itself.
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+DetachedTask checksumWithCoroutine(raw::AsyncReader* reader, vector<uint32_t>* crcs) {
+  while (const raw::AsyncBlock* block = co_await reader->nextBlock()) {
+    crcs->push_back(raw::crc32c(block->data.data(), block->data.size()));
+  }
+}
+#endif
+
+// Reads several files at once through one AsyncEngine, and checks that they match
+// reading them synchronously.
+void testAsync() {
+  cout << "testing async reader" << endl;
+  const int num_files = 5;
+  vector<string> filenames;
+  vector<vector<uint32_t> > expected(num_files);
+  for (int i = 0; i < num_files; ++i) {
+    raw::SyntheticOptions options;
+    options.obsnchan = 8;
+    options.blocsize = 8 * 2 * 2 * 128;
+    options.num_blocks = 3 + i;
+    options.seed = i + 1;
+    filenames.push_back(tempFilename("async" + to_string(i) + ".0000.raw"));
+    string error_message;
+    check(raw::writeSyntheticFile(filenames[i], options, &error_message), error_message);
+
+    raw::Reader reader(filenames[i]);
+    raw::Header header;
+    vector<char> data;
+    while (reader.readHeader(&header)) {
+      data.resize(header.blocsize);
+      check(reader.readData(data.data()), "async expected readData");
+      expected[i].push_back(raw::crc32c(data.data(), data.size()));
+    }
+  }
+
+  raw::AsyncEngine engine(2);
+  vector<unique_ptr<raw::AsyncReader> > readers;
+  vector<vector<uint32_t> > crcs(num_files);
+  vector<function<void(const raw::AsyncBlock*)> > handlers(num_files);
+  for (int i = 0; i < num_files; ++i) {
+    readers.emplace_back(new raw::AsyncReader(engine, filenames[i]));
+    handlers[i] = [&, i](const raw::AsyncBlock* block) {
+      if (block) {
+        crcs[i].push_back(raw::crc32c(block->data.data(), block->data.size()));
+        readers[i]->nextBlock(handlers[i]);
+      }
+    };
+    readers[i]->nextBlock(handlers[i]);
+  }
+  engine.run();
+  for (int i = 0; i < num_files; ++i) {
+    check(!readers[i]->error(), readers[i]->errorMessage());
+    check(crcs[i] == expected[i], "async callbacks read the same data");
+  }
+
+#ifdef RAW_HAVE_COROUTINES
+  cout << "testing async reader with coroutines" << endl;
+  readers.clear();
+  vector<vector<uint32_t> > coroutine_crcs(num_files);
+  for (int i = 0; i < num_files; ++i) {
+    readers.emplace_back(new raw::AsyncReader(engine, filenames[i]));
+    checksumWithCoroutine(readers[i].get(), &coroutine_crcs[i]);
+  }
+  engine.run();
+  for (int i = 0; i < num_files; ++i) {
+    check(coroutine_crcs[i] == expected[i], "async coroutines read the same data");
+  }
+#endif
+
+  for (auto& filename : filenames) {
+    unlink(filename.c_str());
+  }
+}
+
+// Checks that the C interface sees the same headers and data as Reader, both
+// copied and mapped.
+void testCApi() {
+  cout << "testing c api" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 64;
+  options.num_blocks = 3;
+  string filename = tempFilename("capi.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  check(raw_abi_version() == RAW_C_ABI_VERSION, "abi version");
+  raw_reader* reader = raw_open(filename.c_str());
+  raw_header header;
+  vector<char> expected(options.blocsize);
+  vector<char> copied(options.blocsize);
+  int blocks = 0;
+  while (raw_read_header(reader, &header, sizeof(header))) {
+    check(header.nants == 2 && header.num_channels == 4 && header.num_timesteps == 64,
+          "c api header dimensions");
+    check(header.pktidx == options.pktidx(blocks), "c api pktidx");
+    check(string(header.src_name) == "SYNTH_SRC", "c api src_name");
+    char value[16];
+    check(raw_get_card(reader, "TELESCOP", value, sizeof(value)) &&
+          string(value) == "SYNTHETIC", "c api card");
+    check(!raw_get_card(reader, "NOTACARD", value, sizeof(value)), "c api missing card");
+    raw::syntheticData(options, blocks, expected.data());
+
+    raw_array array;
+    check(raw_map_data(reader, &array), "c api map");
+    check(array.shape[2] == 64 && array.strides[0] == (int64_t) options.blocsize / 2,
+          "c api shape");
+    check(memcmp(array.data, expected.data(), expected.size()) == 0, "c api mapped data");
+
+    // Band 1 of 2 is channels 2 and 3 of each antenna
+    check(raw_map_band(reader, 1, 2, &array), "c api map band");
+    check(raw_read_band(reader, 1, 2, copied.data(), copied.size()), "c api read band");
+    size_t i = 0;
+    for (int a = 0; a < array.shape[0]; ++a) {
+      for (int c = 0; c < array.shape[1]; ++c) {
+        for (int k = 0; k < array.shape[2] * array.strides[2]; ++k) {
+          check(array.data[a * array.strides[0] + c * array.strides[1] + k] == copied[i++],
+                "c api band data");
+        }
+      }
+    }
+
+    check(!raw_read_data(reader, copied.data(), 10), "c api small buffer");
+    check(raw_error(reader) != nullptr, "c api small buffer error");
+    ++blocks;
+  }
+  check(blocks == 3, "c api block count");
+  raw_close(reader);
+
+  reader = raw_open(filename.c_str());
+  check(raw_read_header(reader, &header, sizeof(header)), "c api reopen");
+  check(raw_read_data(reader, copied.data(), copied.size()), "c api read data");
+  raw::syntheticData(options, 0, expected.data());
+  check(copied == expected, "c api copied data");
+  check(raw_error(reader) == nullptr, "c api no error");
+  raw_close(reader);
+
+  // A caller built against a smaller raw_header, without the strings, only
+  // gets the fields it asked for
+  reader = raw_open(filename.c_str());
+  memset(&header, 'x', sizeof(header));
+  check(raw_read_header(reader, &header, offsetof(raw_header, src_name)) &&
+        header.nants == 2 && header.src_name[0] == 'x' &&
+        header.telescop[sizeof(header.telescop) - 1] == 'x', "c api older header size");
+  raw_close(reader);
+
+  reader = raw_open("/nonexistent.raw");
+  check(!raw_read_header(reader, &header, sizeof(header)) && raw_error(reader) != nullptr,
+        "c api open error");
+  raw_close(reader);
+  unlink(filename.c_str());
+}
+
+// Checks readTimeRange against syntheticData over a range that spans several
+// blocks, starts and ends mid-block, and crosses a dropped block.
+void testTimeRange() {
+  cout << "testing time range" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 64;
+  options.num_blocks = 6;
+  options.gap_every = 3;
+  string filename = tempFilename("timerange.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  check(reader.readHeader(&header), "time range header");
+  int64_t timesteps_per_block = header.num_timesteps;
+  double synctime = 1652363000;
+
+  // Timesteps counted from SYNCTIME, starting partway into the first block.
+  // Block 3 is dropped, so the range has a gap of one block.
+  int64_t begin = 20;
+  int64_t end = 5 * timesteps_per_block + 30;
+  raw::TimeSeries series;
+  check(reader.readTimeRange(1, 1, 3, synctime + begin * header.tbin,
+                             synctime + end * header.tbin, &series), reader.errorMessage());
+  check(series.num_channels == 2 && series.num_timesteps == end - begin && series.npol == 2,
+        "time range dimensions");
+  check(series.gaps.size() == 1 && series.gaps[0].first == 3 * timesteps_per_block - begin &&
+        series.gaps[0].count == timesteps_per_block, "time range gaps");
+
+  // The reader's own position isn't disturbed
+  vector<char> block(options.blocsize);
+  vector<char> first_block(options.blocsize);
+  check(reader.readData(first_block.data()), "time range readData");
+  raw::syntheticData(options, 0, block.data());
+  check(block == first_block, "time range reader position");
+
+  vector<char> expected(series.data.size(), 0);
+  size_t row_bytes = timesteps_per_block * 4;
+  for (int b = 0; b < options.num_blocks; ++b) {
+    raw::syntheticData(options, b, block.data());
+    int64_t first = options.pktidx(b) / options.piperblk * timesteps_per_block;
+    for (int c = 0; c < 2; ++c) {
+      for (int64_t t = max(first, begin); t < min(first + timesteps_per_block, end); ++t) {
+        memcpy(expected.data() + (c * series.num_timesteps + t - begin) * 4,
+               block.data() + (options.obsnchan / 2 + 1 + c) * row_bytes + (t - first) * 4, 4);
+      }
+    }
+  }
+  check(series.data == expected, "time range data");
+
+  check(!reader.readTimeRange(2, 0, 1, synctime, synctime + 1, &series), "bad antenna");
+  unlink(filename.c_str());
+}
+
+// Checks that each OverlapReader window holds the end of the previous blocks
+// followed by the block, with zeros where there is no history.
+void testOverlapReader() {
+  cout << "testing overlap reader" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 4;
+  options.blocsize = 4 * 2 * 2 * 32;
+  options.num_blocks = 5;
+  options.gap_every = 3;
+  options.checksums = true;
+  string filename = tempFilename("overlap.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  // More than a block of overlap, so the history reaches back two blocks
+  const int overlap = 40;
+  const int timesteps = 32;
+  const size_t timestep_bytes = 4;
+  raw::OverlapReader reader(filename, overlap);
+  reader.verifyChecksums(true);
+  vector<vector<char> > blocks;
+  vector<char> block(options.blocsize);
+  int expected_history = 0;
+  while (reader.next()) {
+    int b = blocks.size();
+    raw::syntheticData(options, b, block.data());
+    blocks.push_back(block);
+    expected_history = (b == 3) ? 0 : min(overlap, expected_history + (b > 0 ? timesteps : 0));
+    check(reader.historyTimesteps() == expected_history, "overlap history timesteps");
+    raw::BlockShape shape = reader.shape();
+    check(shape.num_timesteps == overlap + timesteps, "overlap shape");
+
+    size_t row_stride = shape.rowSize() * 2;
+    for (int r = 0; r < 4; ++r) {
+      const char* row = reader.data() + r * row_stride;
+      for (int t = 0; t < overlap + timesteps; ++t) {
+        // Timestep t of the window is timestep t - overlap of this block, which
+        // may be in an earlier block.
+        int back = t - overlap;
+        int source = b;
+        while (back < 0) {
+          back += timesteps;
+          --source;
+        }
+        const char* actual = row + t * timestep_bytes;
+        if (t < overlap - expected_history) {
+          check(actual[0] == 0 && actual[1] == 0 && actual[2] == 0 && actual[3] == 0,
+                "overlap zero history");
+        } else {
+          const char* expected = blocks[source].data() + r * timesteps * timestep_bytes +
+            back * timestep_bytes;
+          check(memcmp(actual, expected, timestep_bytes) == 0, "overlap data");
+        }
+      }
+    }
+  }
+  check(!reader.error() && blocks.size() == 5, reader.errorMessage());
+
+  // A stride shorter than a row would make the rows overlap
+  raw::Reader strided(filename);
+  raw::Header header;
+  check(strided.readHeader(&header), strided.errorMessage());
+  vector<char> data(header.blocsize);
+  check(!strided.readData(data.data(), header.blocsize / header.nants / header.num_channels - 2)
+        && strided.error(), "overlap short row stride");
+  unlink(filename.c_str());
+}
+
+// Checks that readBandTasksByNode gives each antenna to exactly one node, binds
+// only memory inside the buffer, and reads the same data as readBand.
+void testNuma() {
+  cout << "testing numa" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 5;
+  options.obsnchan = 20;
+  options.blocsize = 20 * 2 * 2 * 256;
+  options.num_blocks = 1;
+  string filename = tempFilename("numa.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  check(reader.readHeader(&header), reader.errorMessage());
+  const int num_bands = 2;
+  const size_t band_size = header.blocsize / num_bands;
+  vector<char> expected(band_size);
+  check(reader.readBand(header, 1, num_bands, expected.data()), reader.errorMessage());
+
+  for (int num_nodes : {1, 2, 3, 5, 8}) {
+    raw::numa::NodeBuffer buffer(band_size, 0);
+    check(buffer.data() != nullptr, "numa buffer");
+    vector<vector<function<bool()> > > tasks;
+    reader.readBandTasksByNode(header, 1, num_bands, buffer.data(), num_nodes, &tasks);
+    check((int) tasks.size() == num_nodes, "numa task lists");
+
+    // The ranges should tile the buffer, one antenna per task
+    size_t covered = 0;
+    size_t num_tasks = 0;
+    for (int node = 0; node < num_nodes; ++node) {
+      pair<size_t, size_t> range = raw::Reader::nodeByteRange(header, num_bands, node,
+                                                               num_nodes);
+      check(range.first == covered && range.second <= band_size, "numa range in buffer");
+      check(range.second - range.first == tasks[node].size() * band_size / options.nants,
+            "numa range matches tasks");
+      covered = range.second;
+      num_tasks += tasks[node].size();
+    }
+    check(covered == band_size && num_tasks == (size_t) options.nants, "numa antennas");
+
+    check(raw::numa::runOnNodes(tasks), "numa run");
+    check(memcmp(buffer.data(), expected.data(), band_size) == 0, "numa data");
+  }
+
+  // Task lists go on the online nodes, whatever their ids
+  const vector<int>& nodes = raw::numa::onlineNodes();
+  check(!nodes.empty() && (int) nodes.size() == raw::numa::numNodes(), "numa online nodes");
+  for (int i = 0; i < 2 * raw::numa::numNodes(); ++i) {
+    check(raw::numa::nodeId(i) == nodes[i % nodes.size()], "numa node ids");
+  }
+
+  if (raw::numa::numNodes() == 1) {
+    raw::numa::NodeBuffer buffer(1 << 16, 0);
+    check(raw::numa::bindThreadToNode(0), "numa bind thread");
+    check(raw::numa::placeOnNode(buffer.data(), buffer.size(), 0), "numa place");
+  }
+  unlink(filename.c_str());
+}
+
+#ifdef RAW_STATS
+// Whether text is a JSON object whose values are numbers or arrays of numbers,
+// which is all that Stats::toJson writes.
+bool isFlatJson(const string& text) {
+  size_t pos = 0;
+  auto skip = [&]() {
+    while (pos < text.size() && text[pos] == ' ') {
+      ++pos;
+    }
+  };
+  auto expect = [&](char c) {
+    skip();
+    if (pos < text.size() && text[pos] == c) {
+      ++pos;
+      return true;
+    }
+    return false;
+  };
+  auto number = [&]() {
+    skip();
+    const char* start = text.c_str() + pos;
+    char* end;
+    strtod(start, &end);
+    pos += end - start;
+    return end != start;
+  };
+  if (!expect('{')) {
+    return false;
+  }
+  do {
+    skip();
+    if (!expect('"')) {
+      return false;
+    }
+    size_t close = text.find('"', pos);
+    if (close == string::npos) {
+      return false;
+    }
+    pos = close + 1;
+    if (!expect(':')) {
+      return false;
+    }
+    if (expect('[')) {
+      if (!expect(']')) {
+        do {
+          if (!number()) {
+            return false;
+          }
+        } while (expect(','));
+        if (!expect(']')) {
+          return false;
+        }
+      }
+    } else if (!number()) {
+      return false;
+    }
+  } while (expect(','));
+  if (!expect('}')) {
+    return false;
+  }
+  skip();
+  return pos == text.size();
+}
+
+// Checks the counters against a synthetic file whose size we know.
+void testStats() {
+  cout << "testing stats" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 4;
+  options.blocsize = 4 * 2 * 2 * 64;
+  options.num_blocks = 4;
+  string filename = tempFilename("stats.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+  struct stat st;
+  check(stat(filename.c_str(), &st) == 0, "stats file size");
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  vector<char> data(options.blocsize);
+  int blocks = 0;
+  // Each header is found with one read of up to MAX_RAW_HEADER_SIZE bytes, which
+  // runs on into the data, and then the data is read in full.
+  uint64_t expected_bytes = 0;
+  off_t header_start = 0;
+  while (reader.readHeader(&header)) {
+    expected_bytes += min<off_t>(raw::MAX_RAW_HEADER_SIZE, st.st_size - header_start);
+    check(reader.readData(data.data()), reader.errorMessage());
+    expected_bytes += header.blocsize;
+    header_start = header.data_offset + header.blocsize;
+    ++blocks;
+  }
+  check(!reader.error() && blocks == 4, "stats blocks");
+
+  const raw::Stats& stats = reader.stats();
+  check(stats.bytes_read == expected_bytes, "stats bytes_read");
+  check(stats.headers_parsed == 4, "stats headers_parsed");
+  check(stats.blocks_read == 4, "stats blocks_read");
+  check(stats.block_latency.count() == 4, "stats histogram total");
+  check(stats.syscalls >= 8, "stats syscalls");
+  check(isFlatJson(stats.toJson()), "stats json: " + stats.toJson());
+
+  // Bands count as blocks too
+  check(reader.readBand(header, 0, 2, data.data()), reader.errorMessage());
+  check(stats.blocks_read == 5 && stats.block_latency.count() == 5, "stats band");
+  reader.resetStats();
+  check(stats.bytes_read == 0 && stats.block_latency.count() == 0, "stats reset");
+  unlink(filename.c_str());
+}
+#endif
+
+// Checks that cached bands match reads from the file, that the cache stays
+// within its capacity except for pinned entries, and that it can be shared by
+// several threads.
+void testBlockCache() {
+  cout << "testing block cache" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 32;
+  options.num_blocks = 6;
+  string filename = tempFilename("cache.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader scanner(filename);
+  // Headers are over-aligned, so they're kept by pointer
+  vector<unique_ptr<raw::Header, raw::AlignedDelete<raw::Header> > > headers;
+  headers.push_back(raw::makeAligned<raw::Header>());
+  while (scanner.readHeader(headers.back().get())) {
+    headers.push_back(raw::makeAligned<raw::Header>());
+  }
+  headers.pop_back();
+  check(headers.size() == 6, "cache headers");
+  const int num_bands = 4;
+  const size_t band_size = options.blocsize / num_bands;
+  vector<vector<char> > expected;
+  vector<char> band(band_size);
+  for (auto& h : headers) {
+    for (int b = 0; b < num_bands; ++b) {
+      check(scanner.readBand(*h, b, num_bands, band.data()), "cache uncached read");
+      expected.push_back(band);
+    }
+  }
+
+  // Room for all 24 bands in one shard
+  raw::BlockCache cache(24 * band_size, 1);
+  raw::Reader reader(filename);
+  reader.useCache(&cache);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < headers.size(); ++i) {
+      for (int b = 0; b < num_bands; ++b) {
+        raw::PinnedBlock pinned;
+        check(reader.readBand(*headers[i], b, num_bands, &pinned), reader.errorMessage());
+        check(pinned.size() == band_size &&
+              memcmp(pinned.data(), expected[i * num_bands + b].data(), band_size) == 0,
+              "cache data");
+      }
+    }
+  }
+  check(cache.misses() == 24 && cache.hits() == 24 && cache.evictions() == 0,
+        "cache hits and misses");
+  check(cache.bytes() == 24 * band_size, "cache bytes");
+  check(reader.readBand(*headers[5], 3, num_bands, band.data()) &&
+        band == expected[23], "cache copy");
+
+  // With room for two bands, a pinned band outlives the ones read after it
+  raw::BlockCache small(2 * band_size, 1);
+  reader.useCache(&small);
+  raw::PinnedBlock first;
+  check(reader.readBand(*headers[0], 0, num_bands, &first), "cache pin");
+  for (int b = 1; b < num_bands; ++b) {
+    raw::PinnedBlock other;
+    check(reader.readBand(*headers[0], b, num_bands, &other), "cache small read");
+  }
+  check(small.evictions() == 2 && small.bytes() == 2 * band_size, "cache evictions");
+  check(memcmp(first.data(), expected[0].data(), band_size) == 0, "cache pinned data");
+  raw::PinnedBlock again;
+  check(reader.readBand(*headers[0], 0, num_bands, &again) && small.hits() == 1,
+        "cache pinned hit");
+  first.unpin();
+  again.unpin();
+  small.clear();
+  check(small.bytes() == 0, "cache clear");
+
+  // Threads reading overlapping bands through one cache
+  raw::BlockCache shared(8 * band_size, 4);
+  vector<thread> threads;
+  atomic<bool> ok(true);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t]() {
+      raw::Reader thread_reader(filename);
+      thread_reader.useCache(&shared);
+      for (int k = 0; k < 200; ++k) {
+        int i = (k * 7 + t) % expected.size();
+        raw::PinnedBlock pinned;
+        if (!thread_reader.readBand(*headers[i / num_bands], i % num_bands, num_bands, &pinned) ||
+            memcmp(pinned.data(), expected[i].data(), band_size) != 0) {
+          ok = false;
+        }
+      }
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  check(ok, "cache threads");
+  check(shared.hits() + shared.misses() == 800, "cache thread lookups");
+  unlink(filename.c_str());
+}
+
+// How many pages of [begin, end) of a file are in the page cache.
+size_t residentPages(const string& filename, off_t begin, off_t end) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  check(fd >= 0 && fstat(fd, &st) == 0, "resident pages open");
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  check(map != MAP_FAILED, "resident pages mmap");
+  size_t page = sysconf(_SC_PAGESIZE);
+  vector<unsigned char> resident((st.st_size + page - 1) / page);
+  check(mincore(map, st.st_size, resident.data()) == 0, "resident pages mincore");
+  size_t count = 0;
+  for (size_t k = begin / page; k < resident.size() && (off_t) (k * page) < end; ++k) {
+    count += resident[k] & 1;
+  }
+  munmap(map, st.st_size);
+  close(fd);
+  return count;
+}
+
+// Whether POSIX_FADV_DONTNEED really releases pages of a file written in the
+// same directory as filename. It doesn't on tmpfs, where the page cache is
+// the file's only copy.
+bool dropBehindObservable(const string& filename) {
+  string probe = filename + ".probe";
+  size_t page = sysconf(_SC_PAGESIZE);
+  vector<char> buffer(page, 1);
+  int fd = open(probe.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  check(fd >= 0, "drop-behind probe open");
+  bool written = write(fd, buffer.data(), page) == (ssize_t) page && fdatasync(fd) == 0;
+  posix_fadvise(fd, 0, page, POSIX_FADV_DONTNEED);
+  close(fd);
+  bool observable = written && residentPages(probe, 0, page) == 0;
+  unlink(probe.c_str());
+  return observable;
+}
+
+// Checks that the page cache policies don't change what's read or written, that
+// the readahead window follows the consumption rate, and that drop-behind
+// really releases the pages behind the reader and writer.
+void testCachePolicy() {
+  cout << "testing cache policy" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 1024;
+  options.num_blocks = 8;
+  string filename = tempFilename("policy.0000.raw");
+  bool observable = dropBehindObservable(filename);
+  if (!observable) {
+    cout << "skipping page cache residency checks, this filesystem doesn't drop pages"
+         << endl;
+  }
+  vector<char> expected(options.blocsize);
+  off_t last_frame = 0;
+  {
+    raw::Writer writer(filename);
+    writer.dropBehind(true);
+    for (int block = 0; block < options.num_blocks; ++block) {
+      struct stat written;
+      check(stat(filename.c_str(), &written) == 0, "cache policy written size");
+      last_frame = written.st_size;
+      raw::syntheticData(options, block, expected.data());
+      check(writer.writeBlock(raw::syntheticHeader(options, block), expected.data(),
+                              expected.size()), writer.errorMessage());
+    }
+  }
+  // The writer drops every frame once the one after it is written
+  size_t page = sysconf(_SC_PAGESIZE);
+  check(!observable || residentPages(filename, 0, last_frame / page * page) == 0,
+        "writer drop-behind");
+
+  // Read the whole file into the page cache, so there's something to drop
+  {
+    raw::Reader reader(filename);
+    raw::Header header;
+    vector<char> data(options.blocsize);
+    while (reader.readHeader(&header)) {
+      check(reader.readData(data.data()), reader.errorMessage());
+    }
+  }
+  raw::Reader reader(filename);
+  raw::CachePolicy policy = raw::CachePolicy::scan();
+  policy.max_readahead = 3 * options.blocsize;
+  // Long enough that any measured rate asks for more than the maximum
+  policy.readahead_seconds = 1000;
+  reader.cachePolicy(policy);
+  raw::Header header;
+  vector<char> data(options.blocsize);
+  int block = 0;
+  off_t previous_behind = 0;
+  while (reader.readHeader(&header)) {
+    // Until there's a rate, the window is the two-block minimum
+    size_t window = reader.pageCache().readaheadBytes();
+    check(window == (block == 0 ? 2 * (size_t) options.blocsize : policy.max_readahead),
+          "cache policy readahead window");
+
+    // Everything before this block's data has been dropped, and a large folio
+    // straddling the previous block's data offset has been dropped again
+    off_t behind = header.data_offset / page * page;
+    check(reader.pageCache().droppedTo() == behind, "cache policy dropped_to");
+    check(!observable || residentPages(filename, 0, previous_behind) == 0,
+          "cache policy drop-behind");
+    previous_behind = behind;
+
+    // Every other block is skipped, which the drop-behind covers too
+    if (block % 2 == 0) {
+      check(reader.readData(data.data()), reader.errorMessage());
+      raw::syntheticData(options, block, expected.data());
+      check(data == expected, "cache policy data");
+    }
+    ++block;
+  }
+  check(!reader.error() && block == options.num_blocks, "cache policy blocks");
+  check(reader.pageCache().consumptionRate() > 0, "cache policy rate");
+  unlink(filename.c_str());
+}
+
+// Checks that iterating with blocks() sees the same blocks and data as readData,
+// and that the views can be used from several threads.
+void testBlockViews() {
+  cout << "testing block views" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 2;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 64;
+  options.num_blocks = 7;
+  options.gap_every = 3;
+  string filename = tempFilename("views.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  vector<vector<char> > expected;
+  {
+    raw::Reader reader(filename);
+    raw::Header header;
+    while (reader.readHeader(&header)) {
+      expected.emplace_back(header.blocsize);
+      check(reader.readData(expected.back().data()), "views readData");
+    }
+  }
+
+  raw::Reader reader(filename);
+  int count = 0;
+  for (auto& block : reader.blocks()) {
+    check(block.index == count, "view index");
+    check(block.pktidx == options.pktidx(count), "view pktidx");
+    check(block.missing_blocks == (count > 0 && count % options.gap_every == 0),
+          "view missing blocks");
+    check(!memcmp(block.data(), expected[count].data(), block.blocsize), "view data");
+    raw::Sample s = block.at(1, 3, 10, 1);
+    check(s.re == expected[count][block.offset(1, 3, 10, 1)] &&
+          s.im == expected[count][block.offset(1, 3, 10, 1) + 1], "view at");
+    ++count;
+  }
+  check(!reader.error() && count == options.num_blocks, "views cover the file");
+
+  raw::Reader stream_reader(filename);
+  count = 0;
+  for (auto& block : stream_reader.blockStream()) {
+    check(block.index == count && block.pktidx == options.pktidx(count), "stream view");
+    check(!memcmp(block.data(), expected[count].data(), block.blocsize), "stream view data");
+    ++count;
+  }
+  check(!stream_reader.error() && count == options.num_blocks, "stream covers the file");
+
+  raw::Reader parallel_reader(filename);
+  raw::BlockList blocks = parallel_reader.blocks();
+  check(count_if(blocks.begin(), blocks.end(),
+                 [](const raw::BlockView& b) { return b.missing_blocks > 0; }) == 2,
+        "algorithms over views");
+  vector<uint32_t> crcs(blocks.size());
+  raw::ThreadPool pool(3);
+  pool.parallelFor(blocks.size(), [&](int i) {
+    crcs[i] = raw::crc32c(blocks[i].data(), blocks[i].blocsize);
+    blocks[i].release();
+  });
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    check(crcs[i] == raw::crc32c(expected[i].data(), expected[i].size()), "parallel views");
+  }
+
+  // A cut-off last block is left out, and reported like readData would
+  struct stat st;
+  check(stat(filename.c_str(), &st) == 0 && truncate(filename.c_str(), st.st_size - 100) == 0,
+        "views truncate");
+  raw::Reader truncated_reader(filename);
+  raw::BlockList truncated = truncated_reader.blocks();
+  check(truncated.size() == (size_t) options.num_blocks - 1 && truncated_reader.error(),
+        "views truncated file");
+  for (auto& block : truncated) {
+    check(block.data() != nullptr, "views truncated data");
+  }
+  unlink(filename.c_str());
+}
+
+// Checks that the compile-time layouts agree with the runtime index math.
+void testLayout() {
+  cout << "testing layout" << endl;
+  for (int npol = 1; npol <= 2; ++npol) {
+    raw::SyntheticOptions options;
+    options.nants = 3;
+    options.obsnchan = 6;
+    options.npol = npol;
+    options.blocsize = options.bytesPerTimestep() * 20;
+    options.num_blocks = 1;
+    string filename = tempFilename("layout.0000.raw");
+    string error_message;
+    check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+    raw::Reader reader(filename);
+    raw::BlockList blocks = reader.blocks();
+    check(blocks.size() == 1, "layout blocks");
+    const raw::BlockView& block = blocks[0];
+    int chosen = 0;
+    raw::BlockShape shape = block.shape();
+    check(raw::withLayout(shape, 8, [&](auto layout) {
+      chosen = layout.npol;
+      for (int a = 0; a < shape.nants; ++a) {
+        for (int c = 0; c < shape.num_channels; ++c) {
+          for (int t = 0; t < shape.num_timesteps; ++t) {
+            for (int p = 0; p < shape.npol; ++p) {
+              check(layout.offset(a, c, t, p) == block.offset(a, c, t, p), "layout offset");
+              check(layout.at(block.data(), a, c, t, p).im == block.at(a, c, t, p).im,
+                    "layout at");
+            }
+          }
+        }
+      }
+    }), "withLayout");
+    check(chosen == npol, "withLayout picks npol");
+    unlink(filename.c_str());
+  }
+  raw::BlockShape four_pols(1, 1, 1, 4);
+  check(!raw::withLayout(four_pols, 8, [](auto) {}), "withLayout rejects npol 4");
+}
+
+// Indexes a small directory tree and queries it, including through a saved file.
+void testCatalog() {
+  cout << "testing catalog" << endl;
+  string dir = tempFilename("catalog");
+  mkdir(dir.c_str(), 0755);
+  mkdir((dir + "/session").c_str(), 0755);
+
+  // Two sources, at two frequencies, in consecutive files
+  struct FileSpec {
+    string name;
+    string source;
+    double obsfreq;
+    int first_block;
+  };
+  vector<FileSpec> specs = {
+    {dir + "/a.0000.raw", "VOYAGER1", 1500.0, 0},
+    {dir + "/session/b.0000.raw", "VOYAGER1", 8400.0, 4},
+    {dir + "/session/c.0000.raw", "TRAPPIST1", 1500.0, 8},
+  };
+  raw::SyntheticOptions options;
+  options.obsnchan = 8;
+  options.blocsize = 8 * 2 * 2 * 16;
+  for (auto& spec : specs) {
+    raw::Writer writer(spec.name);
+    vector<char> data(options.blocsize);
+    for (int block = spec.first_block; block < spec.first_block + 4; ++block) {
+      raw::HeaderCards cards = raw::syntheticHeader(options, block);
+      cards.set("SRC_NAME", spec.source);
+      cards.set("OBSFREQ", spec.obsfreq);
+      raw::syntheticData(options, block, data.data());
+      check(writer.writeBlock(cards, data.data(), data.size()), "catalog write");
+    }
+  }
+  string junk = dir + "/session/junk.raw";
+  FILE* f = fopen(junk.c_str(), "w");
+  fputs("not a raw file", f);
+  fclose(f);
+
+  raw::Catalog built;
+  vector<string> errors;
+  raw::indexDirectory(dir, &built, 2, &errors);
+  check(built.size() == 3 && errors.size() == 1, "catalog indexes the good files");
+  // A link back to an ancestor doesn't index anything twice
+  string loop = dir + "/session/loop";
+  check(symlink(dir.c_str(), loop.c_str()) == 0, "catalog symlink");
+  vector<string> found;
+  raw::findRawFiles(dir, &found);
+  check(found.size() == 4, "catalog follows a symlink loop once");
+  unlink(loop.c_str());
+
+  raw::Catalog unthreaded;
+  raw::indexDirectory(dir, &unthreaded, 0);
+  check(unthreaded.size() == 3 && unthreaded.entry(0).filename == specs[0].name,
+        "catalog with no threads");
+
+  string catalog_file = dir + "/index.cat";
+  string error_message;
+  check(built.save(catalog_file, &error_message), error_message);
+  raw::Catalog catalog;
+  check(catalog.load(catalog_file, &error_message), error_message);
+  check(catalog.size() == 3, "catalog load");
+
+  raw::CatalogEntry a = catalog.entry(0);
+  check(a.filename == specs[0].name && a.src_name == "VOYAGER1" && a.num_blocks == 4,
+        "catalog entry");
+  check(a.first_pktidx == 0 && a.last_pktidx == 3 * options.piperblk, "catalog pktidx");
+  double block_seconds = 0.000341333 * 16;
+  check(fabs(a.end_time - a.start_time - 4 * block_seconds) < 1e-6, "catalog times");
+
+  raw::CatalogQuery query;
+  query.src_name = "VOYAGER1";
+  check(catalog.query(query) == vector<int>({0, 1}), "query by source");
+  query.frequency = 1450;
+  check(catalog.query(query) == vector<int>({0}), "query by source and frequency");
+  query = raw::CatalogQuery();
+  query.frequency = 1500;
+  query.start_time = a.start_time + 5 * block_seconds;
+  check(catalog.query(query) == vector<int>({2}), "query by frequency and time");
+  query.src_name = "NOBODY";
+  check(catalog.query(query).empty(), "query for a missing source");
+
+  for (auto& spec : specs) {
+    unlink(spec.name.c_str());
+  }
+  unlink(junk.c_str());
+  unlink(catalog_file.c_str());
+  rmdir((dir + "/session").c_str());
+  rmdir(dir.c_str());
+}
+
+// Aligns streams with gaps in different places, in both gap modes.
+void testMultiStream() {
+  cout << "testing multi-stream reader" << endl;
+  vector<int> gaps = {0, 3, 4};
+  vector<string> filenames;
+  vector<map<long, uint32_t> > crcs(gaps.size());
+  for (size_t i = 0; i < gaps.size(); ++i) {
+    raw::SyntheticOptions options;
+    options.obsnchan = 8;
+    options.blocsize = 8 * 2 * 2 * 32;
+    options.num_blocks = 12;
+    options.gap_every = gaps[i];
+    options.seed = i + 1;
+    filenames.push_back(tempFilename("multi" + to_string(i) + ".0000.raw"));
+    string error_message;
+    check(raw::writeSyntheticFile(filenames[i], options, &error_message), error_message);
+
+    raw::Reader reader(filenames[i]);
+    raw::Header header;
+    vector<char> data;
+    while (reader.readHeader(&header)) {
+      data.resize(header.blocsize);
+      check(reader.readData(data.data()), "multi readData");
+      crcs[i][header.pktidx] = raw::crc32c(data.data(), data.size());
+    }
+  }
+
+  for (int require_all = 0; require_all < 2; ++require_all) {
+    // The times that every stream has, or that any stream has
+    set<long> expected;
+    for (auto& entry : crcs[0]) {
+      expected.insert(entry.first);
+    }
+    for (size_t i = 1; i < crcs.size(); ++i) {
+      set<long> next;
+      for (auto& entry : crcs[i]) {
+        if (!require_all || expected.count(entry.first)) {
+          next.insert(entry.first);
+        }
+      }
+      if (!require_all) {
+        next.insert(expected.begin(), expected.end());
+      }
+      expected = next;
+    }
+
+    // A queue depth under 1 still reads ahead one block, rather than deadlocking
+    raw::MultiStreamReader reader(filenames, require_all, require_all ? 3 : 0);
+    vector<const raw::AsyncBlock*> blocks;
+    vector<long> seen;
+    while (reader.next(&blocks)) {
+      seen.push_back(reader.pktidx());
+      for (size_t i = 0; i < blocks.size(); ++i) {
+        auto it = crcs[i].find(reader.pktidx());
+        if (it == crcs[i].end()) {
+          check(blocks[i] == nullptr, "multi stream gap is empty");
+        } else {
+          check(blocks[i] != nullptr && blocks[i]->header.pktidx == reader.pktidx() &&
+                raw::crc32c(blocks[i]->data.data(), blocks[i]->data.size()) == it->second,
+                "multi stream block");
+        }
+      }
+    }
+    check(!reader.error(), reader.errorMessage());
+    check(seen == vector<long>(expected.begin(), expected.end()), "multi stream times");
+  }
+
+  for (auto& filename : filenames) {
+    unlink(filename.c_str());
+  }
+}
+
+// Checks visibilities integrated over two blocks against a direct computation.
+void testCorrelator() {
+  cout << "testing correlator" << endl;
+  raw::SyntheticOptions options;
+  options.nants = 3;
+  options.obsnchan = 6;
+  options.blocsize = 6 * 2 * 2 * 300;
+  options.num_blocks = 2;
+  string filename = tempFilename("correlate.0000.raw");
+  string error_message;
+  check(raw::writeSyntheticFile(filename, options, &error_message), error_message);
+
+  raw::Reader reader(filename);
+  raw::Header header;
+  vector<vector<char> > blocks;
+  raw::ThreadPool pool(2);
+  raw::Correlator correlator(&pool);
+  while (reader.readHeader(&header)) {
+    blocks.emplace_back(header.blocsize);
+    check(reader.readData(blocks.back().data()), "correlator readData");
+    check(correlator.add(header, blocks.back().data()), "correlator add");
+  }
+  check(correlator.integratedTimesteps() == 2 * header.num_timesteps, "correlator timesteps");
+  vector<complex<float> > vis;
+  correlator.visibilities(&vis);
+
+  raw::BlockShape shape(header);
+  int npol = shape.npol;
+  for (int c = 0; c < shape.num_channels; ++c) {
+    for (int i = 0; i < shape.nants; ++i) {
+      for (int j = i; j < shape.nants; ++j) {
+        for (int p = 0; p < npol; ++p) {
+          for (int q = 0; q < npol; ++q) {
+            complex<double> sum = 0;
+            for (auto& block : blocks) {
+              for (int t = 0; t < shape.num_timesteps; ++t) {
+                const int8_t* x = (const int8_t*) block.data() +
+                  (((i * shape.num_channels + c) * shape.num_timesteps + t) * npol + p) * 2;
+                const int8_t* y = (const int8_t*) block.data() +
+                  (((j * shape.num_channels + c) * shape.num_timesteps + t) * npol + q) * 2;
+                sum += complex<double>(x[0], x[1]) * conj(complex<double>(y[0], y[1]));
+              }
+            }
+            sum /= (double) correlator.integratedTimesteps();
+            complex<float> v = vis[((c * raw::Correlator::numBaselines(shape.nants) +
+                                     raw::Correlator::baselineIndex(shape.nants, i, j)) * npol +
+                                    p) * npol + q];
+            check(abs(complex<double>(v) - sum) < 1e-3, "visibility");
+          }
+        }
+      }
+    }
+  }
+
+  // The extreme values, where -re of -128 needs the full int16 range
+  raw::BlockShape extreme_shape(2, 1, 300, 2);
+  vector<char> extreme(2 * 300 * 2 * 2);
+  for (size_t k = 0; k < extreme.size(); ++k) {
+    extreme[k] = (k % 3 == 0) ? -128 : 127;
+  }
+  raw::Correlator extreme_correlator;
+  check(extreme_correlator.add(extreme_shape, extreme.data()), "correlator extreme add");
+  extreme_correlator.visibilities(&vis);
+  for (int p = 0; p < 2; ++p) {
+    for (int q = 0; q < 2; ++q) {
+      complex<double> sum = 0;
+      for (int t = 0; t < 300; ++t) {
+        const int8_t* x = (const int8_t*) extreme.data() + (t * 2 + p) * 2;
+        const int8_t* y = (const int8_t*) extreme.data() + ((300 + t) * 2 + q) * 2;
+        sum += complex<double>(x[0], x[1]) * conj(complex<double>(y[0], y[1]));
+      }
+      check(abs(complex<double>(vis[(1 * 2 + p) * 2 + q]) - sum / 300.0) < 1e-2,
+            "extreme visibility");
+    }
+  }
+  unlink(filename.c_str());
+}
+
+// Just runs some tests.
+// With a file argument, reads through that file. Without one, tests against
+// synthetic data.
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    cerr << "usage: tests [file.raw]\n";
+    exit(1);
+  }
+  if (argc == 2) {
+    testFile(argv[1]);
+  } else {
+    testSynthetic(false);
+    testSynthetic(true);
+    testStream();
+    testShmRing();
+    testFollow(false);
+    testFollow(true);
+    testBlockStats();
+    testBeamformer();
+    testDecimator();
+    testRFI();
+    testRequantizer();
+    testChecksums();
+    testAscendingFrequency();
+    testTimeRange();
+    testOverlapReader();
+    testNuma();
+#ifdef RAW_STATS
+    testStats();
+#endif
+    testBlockCache();
+    testCachePolicy();
+    testAsync();
+    testBlockViews();
+    testCApi();
+    testLayout();
+    testCatalog();
+    testMultiStream();
+    testCorrelator();
+    check(raw::codecAvailable(raw::bestCodec()), "best codec is available");
+    for (raw::Codec codec : {raw::Codec::NONE, raw::Codec::ZSTD, raw::Codec::LZ4}) {
+      if (raw::codecAvailable(codec)) {
+        testCompressed(codec);
+      }
+    }
+  }
+
   cout << "OK" << endl;
 }
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace raw {
+
+  // The number of threads to use when the caller doesn't say.
+  inline int defaultNumThreads() {
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  }
+
+  /*
+    A fixed set of worker threads that run tasks in the order they are submitted.
+
+    The destructor runs any tasks that are still queued before joining the
+    threads, so futures from submit are always fulfilled.
+  */
+  class ThreadPool {
+  private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()> > queue;
+    bool stopping = false;
+
+    void work() {
+      while (true) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+          if (queue.empty()) {
+            return;
+          }
+          task = std::move(queue.front());
+          queue.pop_front();
+        }
+        task();
+      }
+    }
+
+  public:
+    explicit ThreadPool(int num_threads = defaultNumThreads()) {
+      for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([this]() { work(); });
+      }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&) = delete;
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      ready.notify_all();
+      for (auto& t : threads) {
+        t.join();
+      }
+    }
+
+    int size() const {
+      return threads.size();
+    }
+
+    // Queues f to run on a worker thread, returning a future for its result.
+    template<typename F>
+    auto submit(F f) -> std::future<decltype(f())> {
+      auto task = std::make_shared<std::packaged_task<decltype(f())()> >(std::move(f));
+      auto answer = task->get_future();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back([task]() { (*task)(); });
+      }
+      ready.notify_one();
+      return answer;
+    }
+
+    // Runs fn(i) for every i in [0, n) across the pool, and waits for them all.
+    void parallelFor(int n, const std::function<void(int)>& fn) {
+      std::vector<std::future<void> > futures;
+      for (int i = 0; i < n; ++i) {
+        futures.push_back(submit([&fn, i]() { fn(i); }));
+      }
+      for (auto& f : futures) {
+        f.get();
+      }
+    }
+  };
+
+  // Splits [0, n) into one contiguous range per pool thread and runs fn(begin, end)
+  // on each. Runs inline if there's no pool.
+  inline void forRanges(ThreadPool* pool, int n, const std::function<void(int, int)>& fn) {
+    if (pool == nullptr || pool->size() <= 1 || n <= 1) {
+      fn(0, n);
+      return;
+    }
+    int chunks = std::min(n, pool->size());
+    pool->parallelFor(chunks, [&](int chunk) {
+      fn(chunk * n / chunks, (chunk + 1) * n / chunks);
+    });
+  }
+}
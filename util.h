@@ -2,7 +2,12 @@
 #define __RAW_UTIL_H
 
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <vector>
+
 #include "hget.h"
+#include "stats.h"
 
 // Utilities ported from plain C.
 
@@ -10,12 +15,15 @@ namespace raw {
   // Reads `bytes_to_read` bytes from `fd` into the buffer pointed to by `buf`.
   // Returns the total bytes read or -1 on error.  A non-negative return value
   // will be less than `bytes_to_read` only of EOF is reached.
-  inline ssize_t read_fully(int fd, char* buf, size_t bytes_to_read) {
+  // If `stats` is provided, the reads are counted in it when RAW_STATS is defined.
+  inline ssize_t read_fully(int fd, char* buf, size_t bytes_to_read, Stats* stats = nullptr) {
     ssize_t bytes_read;
     ssize_t total_bytes_read = 0;
 
     while(bytes_to_read > 0) {
+      RAW_STATS_ONLY(uint64_t start = nowNanos());
       bytes_read = read(fd, buf, bytes_to_read);
+      RAW_STATS_ONLY(if (stats) stats->addRead(start, bytes_read));
       if(bytes_read <= 0) {
 	if(bytes_read == 0) {
 	  break;
@@ -32,11 +40,15 @@ namespace raw {
   }
 
   // Returns whether we read the whole thing.
-  inline bool pread_fully(int fd, char* buf, size_t bytes_to_read, off_t offset) {
+  // If `stats` is provided, the reads are counted in it when RAW_STATS is defined.
+  inline bool pread_fully(int fd, char* buf, size_t bytes_to_read, off_t offset,
+                          Stats* stats = nullptr) {
     ssize_t bytes_read;
     size_t total_bytes_read = 0;
     while (bytes_to_read > 0) {
+      RAW_STATS_ONLY(uint64_t start = nowNanos());
       bytes_read = pread(fd, buf, bytes_to_read, offset);
+      RAW_STATS_ONLY(if (stats) stats->addRead(start, bytes_read));
       if (bytes_read < 0) {
         int err = errno;
         fprintf(stderr, "pread failed. errno = %d\n", err);
@@ -59,6 +71,42 @@ namespace raw {
     return true;
   }
 
+  // Reads consecutive bytes of fd, starting at offset, into a list of buffers,
+  // batching the buffers into as few preadv calls as IOV_MAX allows.
+  // Returns whether we read the whole thing.
+  // If `stats` is provided, the reads are counted in it when RAW_STATS is defined.
+  inline bool preadv_fully(int fd, std::vector<struct iovec> iov, off_t offset,
+                           Stats* stats = nullptr) {
+    size_t next = 0;
+    while (next < iov.size()) {
+      int count = (iov.size() - next < IOV_MAX) ? iov.size() - next : IOV_MAX;
+      RAW_STATS_ONLY(uint64_t start = nowNanos());
+      ssize_t bytes_read = preadv(fd, &iov[next], count, offset);
+      RAW_STATS_ONLY(if (stats) stats->addRead(start, bytes_read));
+      if (bytes_read < 0) {
+        int err = errno;
+        fprintf(stderr, "preadv failed. errno = %d\n", err);
+        return false;
+      }
+      if (bytes_read == 0) {
+        fprintf(stderr, "preadv hit unexpected EOF\n");
+        return false;
+      }
+      offset += bytes_read;
+
+      // Skip the buffers that were filled, and trim a partly filled one.
+      while (next < iov.size() && (size_t) bytes_read >= iov[next].iov_len) {
+        bytes_read -= iov[next].iov_len;
+        ++next;
+      }
+      if (bytes_read > 0) {
+        iov[next].iov_base = (char*) iov[next].iov_base + bytes_read;
+        iov[next].iov_len -= bytes_read;
+      }
+    }
+    return true;
+  }
+
   inline void rawspec_raw_get_str(const char * buf, const char * key, const char * def,
 			   char * out, size_t len)
   {
@@ -143,6 +191,7 @@ namespace raw {
     header->tbin     = header->getDouble("TBIN", 0.0);
     header->directio = header->getInt("DIRECTIO", 0);
     header->pktidx   = header->getUnsignedLong("PKTIDX", -1);
+    header->datacrc  = header->getUnsignedLong("DATACRC", -1);
     header->beam_id  = header->getInt("BEAM_ID", -1);
     header->nants    = header->getUnsignedInt("NANTS", 1);
 
@@ -160,55 +209,36 @@ namespace raw {
     rawspec_raw_get_str(header->buffer, "TELESCOP", "Unknown", header->telescop, 80);
   }
   
-  // Reads RAW file params from fd.  On entry, fd is assumed to be at the start
-  // of a RAW header section.  On success, this function returns the file offset
-  // of the subsequent data block and the file descriptor `fd` will also refer to
-  // that location in the file.  On EOF, this function returns 0.  On failure,
-  // this function returns -1 and the location to which fd refers is undefined.
-  inline off_t rawspec_raw_read_header(int fd, Header* raw_hdr) {
-    int hdr_size;
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-
-    // Read header (plus some data, probably)
-    hdr_size = read(fd, raw_hdr->buffer, MAX_RAW_HEADER_SIZE);
-
-    if (hdr_size == -1) {
-      int err = errno;
-      fprintf(stderr, "read failed. errno = %d\n", err);
-      return -1;
-    } else if (hdr_size < 80) {
-      return 0;
-    }
-
-    rawspec_raw_parse_header(raw_hdr);
-
+  // Checks that the required RAW header params were present, and normalizes them.
+  // Returns whether the header is usable.
+  inline bool rawspec_raw_check_header(Header* raw_hdr) {
     if(raw_hdr->blocsize ==  0) {
       fprintf(stderr, "BLOCSIZE not found in header\n");
-      return -1;
+      return false;
     }
     if(raw_hdr->npol  ==  0) {
       fprintf(stderr, "NPOL not found in header\n");
-      return -1;
+      return false;
     }
     if(raw_hdr->obsnchan ==  0) {
       fprintf(stderr, "OBSNCHAN not found in header\n");
-      return -1;
+      return false;
     }
     if(raw_hdr->obsfreq  ==  0.0) {
       fprintf(stderr, "OBSFREQ not found in header\n");
-      return -1;
+      return false;
     }
     if(raw_hdr->obsbw    ==  0.0) {
       fprintf(stderr, "OBSBW not found in header\n");
-      return -1;
+      return false;
     }
     if(raw_hdr->tbin     ==  0.0) {
       fprintf(stderr, "TBIN not found in header\n");
-      return -1;
+      return false;
     }
     if(raw_hdr->pktidx   == -1) {
       fprintf(stderr, "PKTIDX not found in header\n");
-      return -1;
+      return false;
     }
 
     // TODO: Figure out why we do this.
@@ -217,6 +247,41 @@ namespace raw {
       // 2 is the actual number of polarizations present
       raw_hdr->npol = 2;
     }
+    return true;
+  }
+
+  // Reads RAW file params from fd.  On entry, fd is assumed to be at the start
+  // of a RAW header section.  On success, this function returns the file offset
+  // of the subsequent data block and the file descriptor `fd` will also refer to
+  // that location in the file.  On EOF, this function returns 0.  On failure,
+  // this function returns -1 and the location to which fd refers is undefined.
+  // If `stats` is provided, the work is counted in it when RAW_STATS is defined.
+  inline off_t rawspec_raw_read_header(int fd, Header* raw_hdr, Stats* stats = nullptr) {
+    int hdr_size;
+    RAW_STATS_ONLY(uint64_t start = nowNanos());
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    RAW_STATS_ONLY(if (stats) stats->addSeek(start));
+
+    // Read header (plus some data, probably)
+    RAW_STATS_ONLY(start = nowNanos());
+    hdr_size = read(fd, raw_hdr->buffer, MAX_RAW_HEADER_SIZE);
+    RAW_STATS_ONLY(if (stats) stats->addRead(start, hdr_size));
+
+    if (hdr_size == -1) {
+      int err = errno;
+      fprintf(stderr, "read failed. errno = %d\n", err);
+      return -1;
+    } else if (hdr_size < 80) {
+      return 0;
+    }
+
+    RAW_STATS_ONLY(start = nowNanos());
+    rawspec_raw_parse_header(raw_hdr);
+    RAW_STATS_ONLY(if (stats) stats->addParse(start));
+
+    if (!rawspec_raw_check_header(raw_hdr)) {
+      return -1;
+    }
 
     // Save the header size with no padding
     raw_hdr->hdr_size = rawspec_raw_header_size(raw_hdr->buffer, hdr_size, 0);
@@ -226,7 +291,9 @@ namespace raw {
     //printf("RRP: hdr=%lu\n", hdr_size);
 
     raw_hdr->data_offset = pos + hdr_size;    
+    RAW_STATS_ONLY(start = nowNanos());
     pos = lseek(fd, raw_hdr->data_offset, SEEK_SET);
+    RAW_STATS_ONLY(if (stats) stats->addSeek(start));
 
     return pos;
   }  
@@ -0,0 +1,45 @@
+#include <iostream>
+#include <string.h>
+
+#include "raw.h"
+
+using namespace std;
+
+// Checks the blocks of raw files against their DATACRC cards, using every core.
+// Exits with status 1 if any block is bad or any file can't be read.
+int main(int argc, char* argv[]) {
+  int num_threads = raw::defaultNumThreads();
+  vector<string> filenames;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    if (arg == "--threads" && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+
+  if (filenames.empty() || num_threads <= 0) {
+    cerr << "usage: verify <file.raw> [more files...] [--threads N]\n";
+    exit(1);
+  }
+
+  bool all_ok = true;
+  for (auto& filename : filenames) {
+    raw::VerifyResult result;
+    string error_message;
+    if (!raw::verifyFile(filename, &result, num_threads, &error_message)) {
+      cerr << filename << ": error: " << error_message << endl;
+      all_ok = false;
+      continue;
+    }
+    cout << filename << ": " << result.num_blocks << " blocks, " << result.num_checked
+         << " with checksums, " << result.bad_blocks.size() << " bad" << endl;
+    for (int block : result.bad_blocks) {
+      cout << "  block " << block << " does not match its checksum" << endl;
+    }
+    all_ok = all_ok && result.ok();
+  }
+  return all_ok ? 0 : 1;
+}
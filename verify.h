@@ -0,0 +1,108 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "checksum.h"
+#include "header.h"
+#include "reader.h"
+#include "thread_pool.h"
+#include "util.h"
+
+namespace raw {
+
+  // The outcome of checking a file's blocks against their DATACRC cards.
+  struct VerifyResult {
+    int num_blocks = 0;
+
+    // How many blocks had a DATACRC card to check against.
+    int num_checked = 0;
+
+    // The indices of the blocks whose data didn't match, starting from 0.
+    std::vector<int> bad_blocks;
+
+    bool ok() const {
+      return bad_blocks.empty();
+    }
+  };
+
+  // Checks every block of a file against its DATACRC card, reading and
+  // checksumming blocks on num_threads threads.
+  // Returns whether the file could be read. If it couldn't, the error is written to
+  // error_message. Bad checksums are reported in out, not as errors.
+  inline bool verifyFile(const std::string& filename, VerifyResult* out,
+                         int num_threads = defaultNumThreads(),
+                         std::string* error_message = nullptr) {
+    // First find all the blocks, which only needs the headers.
+    struct BlockInfo {
+      off_t data_offset;
+      size_t blocsize;
+      long datacrc;
+    };
+    std::vector<BlockInfo> blocks;
+    Reader reader(filename);
+    Header header;
+    while (reader.readHeader(&header)) {
+      blocks.push_back({header.data_offset, header.blocsize, header.datacrc});
+    }
+    if (reader.error()) {
+      if (error_message) {
+        *error_message = reader.errorMessage();
+      }
+      return false;
+    }
+
+    *out = VerifyResult();
+    out->num_blocks = blocks.size();
+    for (auto& block : blocks) {
+      out->num_checked += (block.datacrc >= 0);
+    }
+    if (out->num_checked == 0) {
+      return true;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      if (error_message) {
+        *error_message = "could not open " + filename;
+      }
+      return false;
+    }
+    std::vector<char> ok(num_threads, 1);
+    std::vector<char> bad(blocks.size(), 0);
+    ThreadPool pool(num_threads);
+    pool.parallelFor(num_threads, [&](int thread) {
+      std::vector<char> data;
+      for (size_t b = thread; b < blocks.size(); b += num_threads) {
+        if (blocks[b].datacrc < 0) {
+          continue;
+        }
+        data.resize(blocks[b].blocsize);
+        if (!pread_fully(fd, data.data(), data.size(), blocks[b].data_offset)) {
+          ok[thread] = 0;
+          return;
+        }
+        bad[b] = crc32c(data.data(), data.size()) != blocks[b].datacrc;
+      }
+    });
+    close(fd);
+
+    for (char x : ok) {
+      if (!x) {
+        if (error_message) {
+          *error_message = "error reading " + filename;
+        }
+        return false;
+      }
+    }
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      if (bad[b]) {
+        out->bad_blocks.push_back(b);
+      }
+    }
+    return true;
+  }
+}
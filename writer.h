@@ -0,0 +1,247 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+#include "checksum.h"
+#include "error_message.h"
+#include "header.h"
+
+namespace raw {
+
+  /*
+    The text of a header, built up one FITS card at a time.
+
+    Each card is an 80-character record of the form "KEY     = value", and the
+    header is terminated by an "END" record, which toString adds.
+  */
+  class HeaderCards {
+  private:
+    std::vector<std::string> cards;
+
+    void setRaw(const std::string& key, const std::string& value) {
+      char card[81];
+      snprintf(card, sizeof(card), "%-8.8s= %-70.70s", key.c_str(), value.c_str());
+      std::string padded(card);
+      padded.resize(80, ' ');
+
+      // Replace an existing card with the same key
+      for (auto& c : cards) {
+        if (c.compare(0, 10, padded, 0, 10) == 0) {
+          c = padded;
+          return;
+        }
+      }
+      cards.push_back(padded);
+    }
+
+  public:
+    void set(const std::string& key, const std::string& value) {
+      setRaw(key, "'" + value + "'");
+    }
+
+    void set(const std::string& key, const char* value) {
+      set(key, std::string(value));
+    }
+
+    void set(const std::string& key, long value) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%20ld", value);
+      setRaw(key, buf);
+    }
+
+    void set(const std::string& key, int value) {
+      set(key, (long) value);
+    }
+
+    void set(const std::string& key, unsigned int value) {
+      set(key, (long) value);
+    }
+
+    void set(const std::string& key, size_t value) {
+      set(key, (long) value);
+    }
+
+    void set(const std::string& key, double value) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%20.15g", value);
+      setRaw(key, buf);
+    }
+
+    // Copies every card from the header text in a Header, except END.
+    void copyFrom(const Header& header) {
+      for (int i = 0; i + 80 <= MAX_RAW_HEADER_SIZE; i += 80) {
+        if (!strncmp(header.buffer + i, "END ", 4)) {
+          return;
+        }
+        std::string card(header.buffer + i, 80);
+        setRaw(card.substr(0, 8), card.substr(10));
+      }
+    }
+
+    // The full header text, including the END record.
+    std::string toString() const {
+      std::string answer;
+      for (auto& c : cards) {
+        answer += c;
+      }
+      answer += "END";
+      answer.resize(answer.size() + 77, ' ');
+      return answer;
+    }
+  };
+
+  /*
+    Writes a .raw file, one block at a time.
+
+    When directio is set, each header is padded to a 512-byte boundary, the way
+    it is for recorders that write with O_DIRECT, and the DIRECTIO card is set
+    to match. In that case the block size must also be a multiple of 512.
+  */
+  class Writer {
+  private:
+    int fdout;
+    bool directio;
+
+    // Whether to add a DATACRC card to each header.
+    bool checksums = false;
+
+    // Whether written blocks are flushed and dropped from the page cache.
+    bool drop_behind = false;
+
+    // How much has been written, how much of that has had writeback started,
+    // and how much has been written back and dropped.
+    off_t written = 0;
+    off_t writeback_to = 0;
+    off_t dropped_to = 0;
+
+    // Once err is used, the writer is in "error state".
+    ErrorMessage err = ErrorMessage();
+
+    bool writeFully(const char* buf, size_t size) {
+      while (size > 0) {
+        ssize_t n = write(fdout, buf, size);
+        if (n <= 0) {
+          err << "error writing to " << filename;
+          return false;
+        }
+        buf += n;
+        size -= n;
+        written += n;
+      }
+      return true;
+    }
+
+    // Drops the previous frame, whose writeback should be done or nearly done by
+    // now, and starts writeback of the one just written without waiting for it.
+    // That keeps the disk busy while the caller works on the next block, and
+    // keeps at most two frames of dirty pages in memory.
+    void dropWritten() {
+      if (writeback_to > dropped_to) {
+        sync_file_range(fdout, dropped_to, writeback_to - dropped_to,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fdout, dropped_to, writeback_to - dropped_to, POSIX_FADV_DONTNEED);
+        // Only whole pages are dropped, so the page that the next frame starts
+        // in goes next time
+        static const off_t page_size = sysconf(_SC_PAGESIZE);
+        dropped_to = writeback_to / page_size * page_size;
+      }
+      sync_file_range(fdout, writeback_to, written - writeback_to, SYNC_FILE_RANGE_WRITE);
+      writeback_to = written;
+    }
+
+  public:
+    std::string filename;
+
+    Writer(const std::string& filename, bool directio = false)
+      : directio(directio), filename(filename) {
+      fdout = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fdout < 0) {
+        err << "could not open " << filename << " for writing";
+      }
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(Writer&) = delete;
+
+    ~Writer() {
+      if (fdout >= 0) {
+        close(fdout);
+      }
+    }
+
+    // Whether we have run into an error
+    bool error() {
+      return err.used;
+    }
+
+    // The string for the error message
+    std::string errorMessage() {
+      return err;
+    }
+
+    // Turns on the DATACRC card, holding the CRC32C of each block's data.
+    void writeChecksums(bool on) {
+      checksums = on;
+    }
+
+    bool writesChecksums() const {
+      return checksums;
+    }
+
+    // Turns on flushing each block to disk as it's written and dropping it from
+    // the page cache, so that writing a large file doesn't push everything else
+    // out of memory.
+    void dropBehind(bool on) {
+      drop_behind = on;
+    }
+
+    // Writes a header followed by a data block.
+    // The BLOCSIZE and DIRECTIO cards are set from the arguments, and so is
+    // DATACRC if checksums are on.
+    // Returns whether the write was successful.
+    bool writeBlock(HeaderCards cards, const char* data, size_t size) {
+      if (checksums) {
+        cards.set("DATACRC", (long) crc32c(data, size));
+      }
+      return writeFrame(std::move(cards), size, data, size);
+    }
+
+    // Writes a header whose BLOCSIZE is blocsize, followed by frame_size bytes of frame.
+    // This is for containers where the stored frame is an encoding of the block,
+    // rather than the block itself.
+    // Returns whether the write was successful.
+    bool writeFrame(HeaderCards cards, size_t blocsize, const char* frame, size_t frame_size) {
+      if (error()) {
+        return false;
+      }
+      if (directio && frame_size % 512 != 0) {
+        err << "directio block size " << frame_size << " is not a multiple of 512";
+        return false;
+      }
+      cards.set("BLOCSIZE", blocsize);
+      cards.set("DIRECTIO", directio ? 1 : 0);
+      std::string text = cards.toString();
+      if ((int) text.size() > MAX_RAW_HEADER_SIZE) {
+        err << "header is larger than " << MAX_RAW_HEADER_SIZE << " bytes";
+        return false;
+      }
+      if (directio) {
+        text.resize((text.size() + 511) / 512 * 512, ' ');
+      }
+      if (!writeFully(text.data(), text.size()) || !writeFully(frame, frame_size)) {
+        return false;
+      }
+      if (drop_behind) {
+        dropWritten();
+      }
+      return true;
+    }
+  };
+}